@@ -0,0 +1,710 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "bus.hpp"
+#include "clock.hpp"
+#include "state.hpp"
+#include "trace.hpp"
+
+// Band limited synthesis
+// http://www.slack.net/~ant/bl-synth/
+// The APU's output only ever changes in steps, so instead of computing it
+// every CPU cycle and filtering that down to the sample rate, every step is
+// added at its exact time (between two samples) as a band limited step: a
+// windowed sinc impulse into a buffer of differences, which reading sums up.
+// The cost is per step, not per cycle.
+class Blip {
+private:
+    static constexpr int phases = 32;
+    static constexpr int taps = 16;
+
+    // The impulse for a step a fraction phase / phases of a sample late. Each
+    // row sums to 1, so a step of d always adds up to exactly d.
+    struct Kernel {
+        std::array<std::array<float, taps>, phases> rows;
+    };
+    static const Kernel& kernel()
+    {
+        static const Kernel k = [] {
+            Kernel k;
+            const double pi = 3.14159265358979323846;
+            const double cutoff = 0.9; // of the output's Nyquist frequency
+            for (int p = 0; p < phases; p++) {
+                double sum = 0;
+                std::array<double, taps> row;
+                for (int j = 0; j < taps; j++) {
+                    double x = j - taps / 2 + 1 - double(p) / phases;
+                    double sinc = x == 0 ? 1 : std::sin(pi * cutoff * x) / (pi * cutoff * x);
+                    double blackman = 0.42 + 0.5 * std::cos(2 * pi * x / taps) + 0.08 * std::cos(4 * pi * x / taps);
+                    row[j] = sinc * blackman;
+                    sum += row[j];
+                }
+                for (int j = 0; j < taps; j++) {
+                    k.rows[p][j] = float(row[j] / sum);
+                }
+            }
+            return k;
+        }();
+        return k;
+    }
+
+    std::vector<float> buffer; // differences, sample 0 is the next one read
+    double nominalSamplesPerCycle = 0;
+    double samplesPerCycle = 0;
+    double offset = 0; // where cycle 0 falls, in samples
+    float sum = 0; // the level at the last sample read
+    float highpassIn = 0;
+    float highpassOut = 0;
+    float highpass = 0;
+
+public:
+    void setRate(double cyclesPerSecond, int sampleRate)
+    {
+        nominalSamplesPerCycle = samplesPerCycle = sampleRate / cyclesPerSecond;
+        // The NES's own 90Hz high pass, which also keeps the output centered
+        highpass = float(std::exp(-2 * 3.14159265358979323846 * 90 / sampleRate));
+        clear();
+    }
+
+    // Make ratio times as many samples per cycle, from the next step on
+    void setRatio(double ratio)
+    {
+        samplesPerCycle = nominalSamplesPerCycle * ratio;
+    }
+
+    void clear()
+    {
+        buffer.assign(buffer.size(), 0);
+        offset = sum = highpassIn = highpassOut = 0;
+    }
+
+    // A step of delta, cycle CPU cycles after the last read
+    void addDelta(int64_t cycle, float delta)
+    {
+        auto pos = offset + cycle * samplesPerCycle;
+        auto i = size_t(pos);
+        const auto& row = kernel().rows[int((pos - i) * phases)];
+        if (buffer.size() < i + taps) {
+            buffer.resize(i + taps + 256);
+        }
+        for (int j = 0; j < taps; j++) {
+            buffer[i + j] += row[j] * delta;
+        }
+    }
+
+    // Append the samples up to cycles CPU cycles after the last read (the
+    // last half kernel of them is still to come, that's the latency)
+    void read(int64_t cycles, float gain, std::vector<int16_t>& out)
+    {
+        auto end = offset + cycles * samplesPerCycle;
+        auto count = size_t(end);
+        if (buffer.size() < count + taps) {
+            buffer.resize(count + taps + 256);
+        }
+        for (size_t i = 0; i < count; i++) {
+            sum += buffer[i];
+            highpassOut = highpass * (highpassOut + sum - highpassIn);
+            highpassIn = sum;
+            out.push_back(int16_t(std::clamp(highpassOut * gain, -32768.0f, 32767.0f)));
+        }
+        std::copy(buffer.begin() + count, buffer.begin() + count + taps, buffer.begin());
+        std::fill(buffer.begin() + taps, buffer.end(), 0.0f);
+        offset = end - count;
+    }
+};
+
+// https://www.nesdev.org/wiki/APU
+// The 2A03's sound: two pulse channels, a triangle, noise and the delta
+// modulation channel (DMC), sequenced by the frame counter.
+//
+// Nothing is clocked per cycle. The APU is behind until something needs it
+// (a register access, the end of a frame) and then catches up to the CPU's
+// current cycle, one timer event at a time, so register writes take effect at
+// the cycle they were made and a frame's samples are made in one batch when
+// it ends. Channels that can't change their output (silent, muted, or a
+// triangle above hearing) have no timer events at all, and with audio off
+// only what the program can see is emulated: the length counters, the frame
+// counter and its IRQ, and the DMC.
+class Apu : public Mem {
+public:
+    // Off for headless runs that have nowhere to send sound
+    bool audio = true;
+    // The last frame's samples, mono
+    std::vector<int16_t> samples;
+    // CPU cycles the DMC's memory reads took from the CPU, for the console
+    // to hand over
+    int stolen = 0;
+
+private:
+    static constexpr int64_t never = INT64_MAX;
+
+    // https://www.nesdev.org/wiki/APU_Length_Counter
+    static constexpr uint8_t lengths[32] = {
+        10, 254, 20, 2, 40, 4, 80, 6, 160, 8, 60, 10, 14, 12, 26, 14,
+        12, 16, 24, 18, 48, 20, 96, 22, 192, 24, 72, 26, 16, 28, 32, 30
+    };
+
+    // https://www.nesdev.org/wiki/APU_Envelope
+    struct Envelope {
+        bool start;
+        bool loop; // also halts the length counter
+        bool constant;
+        uint8_t period; // or the constant volume
+        uint8_t divider;
+        uint8_t decay;
+
+        void write(uint8_t value)
+        {
+            loop = value & 0x20;
+            constant = value & 0x10;
+            period = value & 0x0f;
+        }
+        void clock()
+        {
+            if (start) {
+                start = false;
+                decay = 15;
+                divider = period;
+            } else if (divider) {
+                divider--;
+            } else {
+                divider = period;
+                if (decay) {
+                    decay--;
+                } else if (loop) {
+                    decay = 15;
+                }
+            }
+        }
+        int volume() const { return constant ? period : decay; }
+    };
+
+    // https://www.nesdev.org/wiki/APU_Pulse
+    // https://www.nesdev.org/wiki/APU_Sweep
+    struct Pulse {
+        Envelope envelope;
+        uint8_t duty;
+        uint8_t sequence;
+        uint16_t period;
+        uint8_t length;
+        bool sweepEnabled;
+        bool sweepNegate;
+        bool sweepReload;
+        uint8_t sweepPeriod;
+        uint8_t sweepShift;
+        uint8_t sweepDivider;
+        bool second; // pulse 2 negates in two's complement, pulse 1 in ones'
+        int64_t next;
+
+        int target() const
+        {
+            int change = period >> sweepShift;
+            return period + (sweepNegate ? -change - !second : change);
+        }
+        bool muted() const { return period < 8 || target() > 0x7ff; }
+        bool running() const { return length && !muted() && envelope.volume(); }
+        int output() const
+        {
+            static constexpr uint8_t duties[4] = { 0x02, 0x06, 0x1e, 0xf9 }; // bit n is step n
+            return running() && duties[duty] >> sequence & 1 ? envelope.volume() : 0;
+        }
+        int64_t cycles() const { return (period + 1) * 2; }
+        void sweep()
+        {
+            if (!sweepDivider && sweepEnabled && sweepShift && !muted()) {
+                period = target();
+            }
+            if (!sweepDivider || sweepReload) {
+                sweepDivider = sweepPeriod;
+                sweepReload = false;
+            } else {
+                sweepDivider--;
+            }
+        }
+    };
+
+    // https://www.nesdev.org/wiki/APU_Triangle
+    struct Triangle {
+        uint8_t sequence;
+        uint16_t period;
+        uint8_t length;
+        uint8_t linear;
+        uint8_t linearPeriod;
+        bool control; // also halts the length counter
+        bool reload;
+        int64_t next;
+
+        // Periods under 2 are far above hearing, so hold the output there
+        bool running() const { return length && linear && period >= 2; }
+        int output() const { return sequence < 16 ? 15 - sequence : sequence - 16; }
+        int64_t cycles() const { return period + 1; }
+    };
+
+    // https://www.nesdev.org/wiki/APU_Noise
+    struct Noise {
+        Envelope envelope;
+        uint16_t shift;
+        bool mode;
+        uint8_t rate;
+        uint8_t length;
+        int64_t next;
+
+        bool running() const { return length && envelope.volume(); }
+        int output() const { return running() && !(shift & 1) ? envelope.volume() : 0; }
+        int64_t cycles() const
+        {
+            static constexpr uint16_t periods[16] = { 4, 8, 16, 32, 64, 96, 128, 160, 202, 254, 380, 508, 762, 1016, 2034, 4068 };
+            return periods[rate];
+        }
+    };
+
+    // https://www.nesdev.org/wiki/APU_DMC
+    struct Dmc {
+        bool irqEnabled;
+        bool loop;
+        uint8_t rate;
+        uint8_t level;
+        uint16_t sampleAddress;
+        uint16_t sampleLength;
+        uint16_t address;
+        uint16_t remaining;
+        uint8_t buffer;
+        bool bufferFull;
+        uint8_t shift;
+        uint8_t bits;
+        bool silence;
+        int64_t next;
+
+        bool running() const { return remaining || bufferFull || !silence; }
+        int64_t cycles() const
+        {
+            static constexpr uint16_t rates[16] = { 428, 380, 340, 320, 286, 254, 226, 214, 190, 160, 142, 128, 106, 84, 72, 54 };
+            return rates[rate];
+        }
+    };
+
+    Bus& bus;
+    const Clock& clock;
+    Blip blip;
+
+    int64_t time = 0; // CPU cycle the APU has caught up to
+    int64_t frameStart = 0; // CPU cycle of the first sample of this frame
+    std::array<Pulse, 2> pulse {};
+    Triangle triangle {};
+    Noise noise {};
+    Dmc dmc {};
+    uint8_t enabled = 0; // $4015 bits 0-4
+
+    // https://www.nesdev.org/wiki/APU_Frame_Counter
+    // Steps at these CPU cycles into the sequence, which is 29830 cycles long
+    // in four step mode and 37282 in five step mode
+    static constexpr int64_t frameSteps[5] = { 7457, 14913, 22371, 29829, 37281 };
+    bool fiveStep = false;
+    bool irqInhibit = false;
+    int frameStep = 0;
+    int64_t frameSequence = 0; // CPU cycle the sequence started on
+    int64_t frameNext = frameSteps[0];
+    float level = 0; // the mixer output synthesized so far
+
+    int64_t cycle() const { return clock.now() / 12; }
+
+    // https://www.nesdev.org/wiki/APU_Mixer
+    // The exact, non linear, mix of each combination of channel outputs
+    static constexpr auto pulseMix = [] {
+        std::array<float, 31> table {};
+        for (int n = 1; n < 31; n++) {
+            table[n] = 95.52f / (8128.0f / n + 100);
+        }
+        return table;
+    }();
+    static constexpr auto tndMix = [] {
+        std::array<float, 203> table {};
+        for (int n = 1; n < 203; n++) {
+            table[n] = 163.67f / (24329.0f / n + 100);
+        }
+        return table;
+    }();
+
+    void mix(int64_t t)
+    {
+        if (!audio) {
+            return;
+        }
+        auto out = pulseMix[pulse[0].output() + pulse[1].output()]
+            + tndMix[3 * triangle.output() + 2 * noise.output() + dmc.level];
+        if (out != level) {
+            blip.addDelta(t - frameStart, out - level);
+            level = out;
+        }
+    }
+
+    // Give the channels that can now change their output a timer event, and
+    // take it from the ones that can't
+    void schedule(int64_t t)
+    {
+        auto update = [t](auto& channel, bool running) {
+            if (!running) {
+                channel.next = never;
+            } else if (channel.next == never) {
+                channel.next = t + channel.cycles();
+            }
+        };
+        update(pulse[0], audio && pulse[0].running());
+        update(pulse[1], audio && pulse[1].running());
+        update(triangle, audio && triangle.running());
+        update(noise, audio && noise.running());
+        update(dmc, dmc.running());
+    }
+
+    void quarterFrame()
+    {
+        pulse[0].envelope.clock();
+        pulse[1].envelope.clock();
+        noise.envelope.clock();
+        if (triangle.reload) {
+            triangle.linear = triangle.linearPeriod;
+        } else if (triangle.linear) {
+            triangle.linear--;
+        }
+        if (!triangle.control) {
+            triangle.reload = false;
+        }
+    }
+
+    void halfFrame()
+    {
+        for (auto& p : pulse) {
+            if (p.length && !p.envelope.loop) {
+                p.length--;
+            }
+            p.sweep();
+        }
+        if (triangle.length && !triangle.control) {
+            triangle.length--;
+        }
+        if (noise.length && !noise.envelope.loop) {
+            noise.length--;
+        }
+    }
+
+    // Every step clocks the envelopes, every other one the length counters
+    // and sweeps too. The fourth step of five does nothing, and the last of
+    // four raises the IRQ.
+    void frameClock()
+    {
+        auto count = fiveStep ? 5 : 4;
+        if (frameStep != 3 || !fiveStep) {
+            quarterFrame();
+        }
+        if (frameStep == 1 || frameStep == count - 1) {
+            halfFrame();
+        }
+        if (frameStep == 3 && !fiveStep && !irqInhibit) {
+            bus.interrupts.raise(Interrupts::FrameCounter);
+        }
+        if (++frameStep == count) {
+            frameStep = 0;
+            frameSequence += frameSteps[count - 1] + 1;
+        }
+        frameNext = frameSequence + frameSteps[frameStep];
+    }
+
+    void dmcFetch()
+    {
+        if (dmc.bufferFull || !dmc.remaining) {
+            return;
+        }
+        // https://www.nesdev.org/wiki/DMA#DMC_DMA
+        // Usually 4 cycles (halt, dummy, alignment, read)
+        dmc.buffer = bus.get(dmc.address);
+        stolen += 4;
+        dmc.bufferFull = true;
+        dmc.address = dmc.address == 0xffff ? 0x8000 : dmc.address + 1;
+        if (!--dmc.remaining) {
+            if (dmc.loop) {
+                dmc.address = dmc.sampleAddress;
+                dmc.remaining = dmc.sampleLength;
+            } else if (dmc.irqEnabled) {
+                bus.interrupts.raise(Interrupts::Dmc);
+            }
+        }
+    }
+
+    void dmcClock()
+    {
+        if (!dmc.silence) {
+            if (dmc.shift & 1) {
+                dmc.level += dmc.level <= 125 ? 2 : 0;
+            } else {
+                dmc.level -= dmc.level >= 2 ? 2 : 0;
+            }
+        }
+        dmc.shift >>= 1;
+        if (!--dmc.bits) {
+            dmc.bits = 8;
+            dmc.silence = !dmc.bufferFull;
+            dmc.shift = dmc.buffer;
+            dmc.bufferFull = false;
+            dmcFetch();
+        }
+    }
+
+    // Handle every event before cycle until, in order
+    void run(int64_t until)
+    {
+        for (;;) {
+            auto t = std::min({ frameNext, pulse[0].next, pulse[1].next, triangle.next, noise.next, dmc.next });
+            if (t >= until) {
+                break;
+            }
+            if (t == frameNext) {
+                frameClock();
+                schedule(t);
+            } else if (t == dmc.next) {
+                dmcClock();
+                dmc.next = dmc.running() ? t + dmc.cycles() : never;
+            } else if (t == noise.next) {
+                auto feedback = (noise.shift ^ noise.shift >> (noise.mode ? 6 : 1)) & 1;
+                noise.shift = noise.shift >> 1 | feedback << 14;
+                noise.next += noise.cycles();
+            } else if (t == triangle.next) {
+                triangle.sequence = (triangle.sequence + 1) & 31;
+                triangle.next += triangle.cycles();
+            } else {
+                auto& p = t == pulse[0].next ? pulse[0] : pulse[1];
+                p.sequence = (p.sequence + 1) & 7;
+                p.next += p.cycles();
+            }
+            mix(t);
+        }
+        time = until;
+    }
+
+public:
+    Apu(Bus& bus, const Clock& clock, int sampleRate = 48000)
+        : bus(bus)
+        , clock(clock)
+    {
+        pulse[1].second = true;
+        noise.shift = 1;
+        dmc.bits = 8;
+        dmc.silence = true;
+        schedule(0);
+        setSampleRate(sampleRate);
+    }
+
+    // The NTSC CPU clock, master / 12
+    void setSampleRate(int sampleRate)
+    {
+        blip.setRate(236'250'000.0 / 11 / 12, sampleRate);
+    }
+
+    // Scale the sample rate a little, to keep an output buffer from running
+    // dry or filling up
+    void setRateRatio(double ratio)
+    {
+        blip.setRatio(ratio);
+    }
+
+    // Catch up, and replace samples with the frame's. The console calls it
+    // when the PPU finishes a frame.
+    void endFrame()
+    {
+        auto now = cycle();
+        run(now);
+        samples.clear();
+        if (audio) {
+            blip.read(now - frameStart, 30000, samples);
+        }
+        frameStart = now;
+    }
+
+    // Catch up to the current cycle
+    void sync()
+    {
+        run(cycle());
+    }
+
+    // The CPU cycle of the DMC's next memory read, so the console can catch
+    // the APU up in time for it (the read should see the banks mapped then,
+    // and stalls the CPU)
+    int64_t dmcReadCycle() const
+    {
+        if (!dmc.remaining) {
+            return never;
+        }
+        return dmc.bufferFull ? dmc.next + (dmc.bits - 1) * dmc.cycles() : time;
+    }
+
+    // The CPU cycle the frame counter raises its IRQ next, so the console can
+    // catch the APU up in time for the CPU to see it. The DMC's IRQ comes
+    // with its last read, which the console catches up for anyway.
+    int64_t irqCycle() const
+    {
+        if (fiveStep || irqInhibit || bus.interrupts.test(Interrupts::FrameCounter)) {
+            return never;
+        }
+        return frameSequence + frameSteps[3];
+    }
+
+    void state(Serializer& s)
+    {
+        s(time);
+        s(pulse);
+        s(triangle);
+        s(noise);
+        s(dmc);
+        s(enabled);
+        s(fiveStep);
+        s(irqInhibit);
+        s(frameStep);
+        s(frameSequence);
+        s(frameNext);
+        s(stolen);
+        if (s.loading()) {
+            frameStart = time;
+            level = 0;
+            blip.clear();
+            schedule(time);
+        }
+    }
+
+    // Addresses are relative to $4000, only $4015 can be read
+    virtual uint8_t get(uint16_t addr) override
+    {
+        if (addr != 0x15) {
+            return 0;
+        }
+        run(cycle());
+        uint8_t status = (pulse[0].length ? 0x01 : 0) | (pulse[1].length ? 0x02 : 0)
+            | (triangle.length ? 0x04 : 0) | (noise.length ? 0x08 : 0) | (dmc.remaining ? 0x10 : 0)
+            | bus.interrupts.test(Interrupts::FrameCounter) << 6
+            | bus.interrupts.test(Interrupts::Dmc) << 7;
+        bus.interrupts.clear(Interrupts::FrameCounter);
+        return status;
+    }
+
+    virtual void set(uint16_t addr, uint8_t value) override
+    {
+        auto t = cycle();
+        run(t);
+        trace<Trace::Apu>("APU %02x = %02x", addr, value);
+        switch (addr) {
+        case 0x00:
+        case 0x04: {
+            auto& p = pulse[addr >> 2];
+            p.duty = value >> 6;
+            p.envelope.write(value);
+            break;
+        }
+        case 0x01:
+        case 0x05: {
+            auto& p = pulse[addr >> 2];
+            p.sweepEnabled = value & 0x80;
+            p.sweepPeriod = value >> 4 & 7;
+            p.sweepNegate = value & 0x08;
+            p.sweepShift = value & 7;
+            p.sweepReload = true;
+            break;
+        }
+        case 0x02:
+        case 0x06:
+            pulse[addr >> 2].period = (pulse[addr >> 2].period & 0x700) | value;
+            break;
+        case 0x03:
+        case 0x07: {
+            auto& p = pulse[addr >> 2];
+            p.period = (p.period & 0xff) | (value & 7) << 8;
+            if (enabled & (1 << (addr >> 2))) {
+                p.length = lengths[value >> 3];
+            }
+            p.sequence = 0;
+            p.envelope.start = true;
+            break;
+        }
+        case 0x08:
+            triangle.control = value & 0x80;
+            triangle.linearPeriod = value & 0x7f;
+            break;
+        case 0x0a:
+            triangle.period = (triangle.period & 0x700) | value;
+            break;
+        case 0x0b:
+            triangle.period = (triangle.period & 0xff) | (value & 7) << 8;
+            if (enabled & 0x04) {
+                triangle.length = lengths[value >> 3];
+            }
+            triangle.reload = true;
+            break;
+        case 0x0c:
+            noise.envelope.write(value);
+            break;
+        case 0x0e:
+            noise.mode = value & 0x80;
+            noise.rate = value & 0x0f;
+            break;
+        case 0x0f:
+            if (enabled & 0x08) {
+                noise.length = lengths[value >> 3];
+            }
+            noise.envelope.start = true;
+            break;
+        case 0x10:
+            dmc.irqEnabled = value & 0x80;
+            dmc.loop = value & 0x40;
+            dmc.rate = value & 0x0f;
+            if (!dmc.irqEnabled) {
+                bus.interrupts.clear(Interrupts::Dmc);
+            }
+            break;
+        case 0x11:
+            dmc.level = value & 0x7f;
+            break;
+        case 0x12:
+            dmc.sampleAddress = 0xc000 + value * 64;
+            break;
+        case 0x13:
+            dmc.sampleLength = value * 16 + 1;
+            break;
+        case 0x15:
+            enabled = value & 0x1f;
+            pulse[0].length = enabled & 0x01 ? pulse[0].length : 0;
+            pulse[1].length = enabled & 0x02 ? pulse[1].length : 0;
+            triangle.length = enabled & 0x04 ? triangle.length : 0;
+            noise.length = enabled & 0x08 ? noise.length : 0;
+            bus.interrupts.clear(Interrupts::Dmc);
+            if (!(enabled & 0x10)) {
+                dmc.remaining = 0;
+            } else if (!dmc.remaining) {
+                dmc.address = dmc.sampleAddress;
+                dmc.remaining = dmc.sampleLength;
+                dmcFetch();
+            }
+            break;
+        case 0x17:
+            // The sequence restarts 3 or 4 cycles later, and the five step
+            // mode clocks everything right away
+            fiveStep = value & 0x80;
+            irqInhibit = value & 0x40;
+            if (irqInhibit) {
+                bus.interrupts.clear(Interrupts::FrameCounter);
+            }
+            frameStep = 0;
+            frameSequence = t + (t & 1 ? 4 : 3);
+            frameNext = frameSequence + frameSteps[0];
+            if (fiveStep) {
+                quarterFrame();
+                halfFrame();
+            }
+            break;
+        default:
+            break;
+        }
+        schedule(t);
+        mix(t);
+    }
+};
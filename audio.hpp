@@ -0,0 +1,301 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Audio output
+// The emulation thread produces a frame of samples at a time and pushes them
+// into a lock-free ring. An audio thread takes them out at the sink's pace
+// and hands them to the sink. In real time the emulation thread never waits
+// on audio: samples that don't fit are dropped, and if the ring runs dry the
+// sink gets silence. Instead, the sample rate the APU produces at is nudged
+// up or down by at most half a percent to keep the ring near a target fill
+// (dynamic rate control), which absorbs the drift between the emulated
+// 60.0988 Hz frame clock and the sink's clock without audible pitch changes.
+// Writing a file, the emulation thread waits for room instead.
+// https://docs.libretro.com/development/cores/dynamic-rate-control/
+
+// Single producer, single consumer ring of samples
+class AudioRing {
+private:
+    std::vector<int16_t> ring;
+    size_t mask;
+    alignas(64) std::atomic<size_t> head = 0; // written by the emulation thread
+    alignas(64) std::atomic<size_t> tail = 0; // written by the audio thread
+
+public:
+    // Rounded up to a power of 2
+    explicit AudioRing(size_t capacity)
+    {
+        size_t size = 1;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        ring.resize(size);
+        mask = size - 1;
+    }
+
+    size_t capacity() const { return ring.size(); }
+    size_t size() const { return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire); }
+
+    // Returns how many fit
+    size_t push(const int16_t* samples, size_t count)
+    {
+        auto h = head.load(std::memory_order_relaxed);
+        count = std::min(count, ring.size() - (h - tail.load(std::memory_order_acquire)));
+        auto first = std::min(count, ring.size() - (h & mask));
+        std::copy(samples, samples + first, ring.data() + (h & mask));
+        std::copy(samples + first, samples + count, ring.data());
+        head.store(h + count, std::memory_order_release);
+        return count;
+    }
+
+    // Returns how many there were
+    size_t pop(int16_t* samples, size_t count)
+    {
+        auto t = tail.load(std::memory_order_relaxed);
+        count = std::min(count, head.load(std::memory_order_acquire) - t);
+        auto first = std::min(count, ring.size() - (t & mask));
+        std::copy(ring.data() + (t & mask), ring.data() + (t & mask) + first, samples);
+        std::copy(ring.data(), ring.data() + (count - first), samples + first);
+        tail.store(t + count, std::memory_order_release);
+        return count;
+    }
+};
+
+// Where the samples end up. Called on the audio thread only.
+class AudioSink {
+public:
+    virtual ~AudioSink() = default;
+    virtual void write(const int16_t* samples, size_t count) = 0;
+};
+
+// Throws them away, for tests and machines without sound
+class NullSink : public AudioSink {
+public:
+    virtual void write(const int16_t*, size_t) override { }
+};
+
+// Raw 16 bit mono samples into the standard input of a command that plays
+// them on the host's sound card, like
+//   aplay -q -t raw -f S16_LE -c 1 -r 48000
+//   pacat --format=s16le --channels=1 --rate=48000
+// A player that blocks when its buffer is full paces the audio thread like a
+// sound card would. If it quits, the rest is thrown away.
+class PipeSink : public AudioSink {
+private:
+    FILE* pipe;
+
+public:
+    explicit PipeSink(const std::string& command)
+        : pipe(popen(command.c_str(), "w"))
+    {
+        if (!pipe) {
+            std::fprintf(stderr, "%s: can't run\n", command.c_str());
+            return;
+        }
+        // A write to a player that quit fails instead of killing us
+        std::signal(SIGPIPE, SIG_IGN);
+    }
+
+    ~PipeSink()
+    {
+        if (pipe) {
+            pclose(pipe);
+        }
+    }
+
+    bool ok() const { return pipe != nullptr; }
+
+    virtual void write(const int16_t* samples, size_t count) override
+    {
+        if (pipe && std::fwrite(samples, 2, count, pipe) < count) {
+            pclose(pipe);
+            pipe = nullptr;
+        }
+    }
+};
+
+// http://soundfile.sapp.org/doc/WaveFormat/
+// 16 bit mono PCM. The header's sizes are kept up to date after every write,
+// so the file is valid even if the program never gets to close it. Assumes a
+// little endian host.
+class WavSink : public AudioSink {
+private:
+    std::ofstream file;
+    uint32_t bytes = 0;
+
+    void put(uint32_t value, int size)
+    {
+        for (int i = 0; i < size; i++) {
+            file.put(char(value >> (i * 8)));
+        }
+    }
+
+public:
+    WavSink(const std::string& path, int sampleRate)
+        : file(path, std::ios::binary | std::ios::trunc)
+    {
+        if (!file) {
+            std::fprintf(stderr, "%s: can't write\n", path.c_str());
+            return;
+        }
+        file.write("RIFF", 4);
+        put(36, 4);
+        file.write("WAVEfmt ", 8);
+        put(16, 4); // format chunk size
+        put(1, 2); // PCM
+        put(1, 2); // channels
+        put(sampleRate, 4);
+        put(sampleRate * 2, 4); // bytes per second
+        put(2, 2); // bytes per frame
+        put(16, 2); // bits per sample
+        file.write("data", 4);
+        put(0, 4);
+    }
+
+    bool ok() const { return bool(file); }
+
+    virtual void write(const int16_t* samples, size_t count) override
+    {
+        if (!file) {
+            return;
+        }
+        file.write((const char*)samples, count * 2);
+        bytes += count * 2;
+        file.seekp(4);
+        put(36 + bytes, 4);
+        file.seekp(40);
+        put(bytes, 4);
+        file.seekp(0, std::ios::end);
+    }
+};
+
+class AudioOutput {
+public:
+    struct Metrics {
+        size_t fill; // samples in the ring
+        size_t target;
+        double ratio; // the last rate adjustment
+        uint64_t played; // samples the sink got, silence included
+        uint64_t underruns; // times the sink wanted more than there was
+        uint64_t dropped; // samples that didn't fit in the ring, real time only
+    };
+
+private:
+    std::unique_ptr<AudioSink> sink;
+    int sampleRate;
+    bool realTime;
+    AudioRing ring;
+    size_t target;
+    std::atomic<double> lastRatio = 1.0;
+    std::atomic<uint64_t> played = 0;
+    std::atomic<uint64_t> underruns = 0;
+    std::atomic<uint64_t> dropped = 0;
+    std::atomic<bool> running = true;
+    std::thread thread;
+
+    static constexpr double maxAdjust = 0.005;
+    static constexpr auto period = std::chrono::milliseconds(5);
+
+    // Take what's owed every period, like a sound card pulling buffers.
+    // Playback starts once the ring first reaches the target fill.
+    void playRealTime()
+    {
+        std::vector<int16_t> chunk;
+        while (running && ring.size() < target) {
+            std::this_thread::sleep_for(period);
+        }
+        auto start = std::chrono::steady_clock::now();
+        for (auto next = start; running;) {
+            next += period;
+            std::this_thread::sleep_until(next);
+            auto due = uint64_t(std::chrono::duration<double>(next - start).count() * sampleRate);
+            chunk.resize(due - played);
+            auto got = ring.pop(chunk.data(), chunk.size());
+            if (got < chunk.size()) {
+                std::fill(chunk.begin() + got, chunk.end(), got ? chunk[got - 1] : int16_t(0));
+                underruns++;
+            }
+            sink->write(chunk.data(), chunk.size());
+            played += chunk.size();
+        }
+    }
+
+    // Take everything as soon as it's there (writing a file)
+    void playAll()
+    {
+        std::vector<int16_t> chunk(4096);
+        for (;;) {
+            // Read running first: everything pushed before it was cleared is
+            // in the ring by then
+            bool last = !running;
+            auto got = ring.pop(chunk.data(), chunk.size());
+            if (got) {
+                sink->write(chunk.data(), got);
+                played += got;
+            } else if (last) {
+                break;
+            } else {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        }
+    }
+
+public:
+    // realTime paces the sink at sampleRate and keeps latency seconds of
+    // samples in the ring, otherwise the sink gets samples as they come
+    AudioOutput(std::unique_ptr<AudioSink> sink, int sampleRate, bool realTime, double latency = 0.05)
+        : sink(std::move(sink))
+        , sampleRate(sampleRate)
+        , realTime(realTime)
+        , ring(realTime ? size_t(sampleRate * latency * 4) : size_t(sampleRate))
+        , target(size_t(sampleRate * latency))
+    {
+        thread = std::thread([this] { this->realTime ? playRealTime() : playAll(); });
+    }
+
+    // Writes what is left first, unless it's real time
+    ~AudioOutput()
+    {
+        running = false;
+        thread.join();
+    }
+
+    // A frame of samples, from the emulation thread. Returns the factor to
+    // scale the sample rate by for the next frame. In real time it doesn't
+    // block and drops what doesn't fit; otherwise nothing is waiting on the
+    // emulation, so it waits for room and the file gets every sample.
+    double push(const std::vector<int16_t>& samples)
+    {
+        if (!realTime) {
+            for (size_t pushed = 0;;) {
+                pushed += ring.push(samples.data() + pushed, samples.size() - pushed);
+                if (pushed == samples.size()) {
+                    return 1.0;
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        }
+        auto pushed = ring.push(samples.data(), samples.size());
+        dropped += samples.size() - pushed;
+        auto error = std::clamp((double(target) - double(ring.size())) / target, -1.0, 1.0);
+        auto ratio = 1.0 + maxAdjust * error;
+        lastRatio = ratio;
+        return ratio;
+    }
+
+    Metrics metrics() const
+    {
+        return { ring.size(), target, lastRatio, played, underruns, dropped };
+    }
+};
@@ -0,0 +1,82 @@
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <vector>
+
+#include "bus.hpp"
+#include "cpu.hpp"
+
+// The CPU and the bus on their own, in emulated millions of CPU cycles a
+// second for each core, so a change to either can be measured against the
+// numbers before it. No PPU or APU, the programs only touch RAM.
+//   lda    a stream of LDA #imm, the cheapest instruction there is
+//   mixed  a loop of loads, stores, indexed writes, a subroutine and a branch
+
+struct Workload {
+    const char* name;
+    std::vector<uint8_t> code; // at $8000, with the reset vector pointing there
+};
+
+static std::vector<Workload> workloads()
+{
+    std::vector<uint8_t> lda;
+    for (int i = 0; i < 1000; i++) {
+        lda.insert(lda.end(), { 0xa9, uint8_t(i) }); // LDA #i
+    }
+    lda.insert(lda.end(), { 0x4c, 0x00, 0x80 }); // JMP $8000
+
+    std::vector<uint8_t> mixed = {
+        0xa2, 0x00, // LDX #0
+        0xa5, 0x10, // LDA $10
+        0x18, // CLC
+        0x69, 0x03, // ADC #3
+        0x9d, 0x00, 0x03, // STA $0300,X
+        0xe6, 0x11, // INC $11
+        0x20, 0x15, 0x80, // JSR $8015
+        0xe8, // INX
+        0xd0, 0xf0, // BNE $8002
+        0x4c, 0x00, 0x80, // JMP $8000
+        0xbc, 0x00, 0x03, // $8015: LDY $0300,X
+        0x60, // RTS
+    };
+    return { { "lda", lda }, { "mixed", mixed } };
+}
+
+static double run(const Workload& workload, Cpu::Core core)
+{
+    auto rom = std::make_shared<Ram<0x8000>>();
+    for (size_t i = 0; i < workload.code.size(); i++) {
+        rom->set(uint16_t(i), workload.code[i]);
+    }
+    rom->set(0x7ffc, 0x00);
+    rom->set(0x7ffd, 0x80);
+    Bus bus;
+    bus.map(0x0000, 0x2000, std::make_shared<Ram<2048>>());
+    bus.map(0x8000, 0x10000, rom);
+    Cpu cpu(bus);
+    cpu.core = core;
+
+    using Clock = std::chrono::steady_clock;
+    auto start = Clock::now();
+    int64_t cycles = 0;
+    double seconds = 0;
+    while (seconds < 0.5) {
+        for (auto end = cycles + 1000000; cycles < end;) {
+            cycles += cpu.tick();
+        }
+        seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    }
+    return cycles / seconds / 1e6;
+}
+
+int main()
+{
+    for (const auto& workload : workloads()) {
+        std::printf("%-6s cycle %7.1f  instruction %7.1f Mcycles/s\n", workload.name,
+            run(workload, Cpu::Core::Cycle), run(workload, Cpu::Core::Instruction));
+    }
+    return 0;
+}
+
+// g++ -std=c++17 -O2 bench.cpp && ./a.out
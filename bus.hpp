@@ -1,98 +1,298 @@
 #pragma once
+#include <algorithm>
 #include <array>
 #include <cstddef>
 #include <cstdint>
+#include <cstdio>
+#include <cstdlib>
 #include <memory>
+#include <vector>
+
+#include "state.hpp"
+#include "trace.hpp"
 
 /*
     https : // www.nesdev.org/wiki/CPU_memory_map
 */
 
+// Who reads the dirty bits. Each reader gets every written page once, no
+// matter when the others take theirs.
+enum class DirtyReader {
+    Hashes, // Console::hashes
+    Snapshots, // Console::snapshot
+};
+
+// One bit per 256 byte page of a memory, set by every write to the page, so
+// whoever looks at the memory once a frame (hashes, snapshots) can skip the
+// pages that didn't change. Writers only ever OR into bits; a reader taking
+// its pages first hands the new bits to every reader's own set.
+template <size_t Pages>
+struct DirtyPages {
+    using Words = std::array<uint64_t, (Pages + 63) / 64>;
+    Words bits {};
+    std::array<Words, 2> unread {}; // by DirtyReader
+
+    void mark(size_t addr) { bits[addr >> 14] |= uint64_t(1) << (addr >> 8 & 63); }
+    void markAll() { bits.fill(~uint64_t(0)); }
+
+    // The pages written since reader last took them
+    Words take(DirtyReader reader)
+    {
+        for (auto& words : unread) {
+            for (size_t i = 0; i < bits.size(); i++) {
+                words[i] |= bits[i];
+            }
+        }
+        bits.fill(0);
+        auto& mine = unread[size_t(reader)];
+        auto taken = mine;
+        mine.fill(0);
+        return taken;
+    }
+
+    // Calls f(page) for every page written since reader last took them
+    template <typename F>
+    void take(DirtyReader reader, F&& f)
+    {
+        auto taken = take(reader);
+        for (size_t i = 0; i < taken.size(); i++) {
+            for (auto b = taken[i]; b; b &= b - 1) {
+                if (auto page = i * 64 + __builtin_ctzll(b); page < Pages) {
+                    f(page);
+                }
+            }
+        }
+    }
+
+    // Adds the pages of a memory of size bytes that aren't in written to out,
+    // as ranges of a saved state the memory is at offset in (SIZE_MAX: it
+    // isn't, nothing is added). Page i of the memory is page first + i here.
+    static void unwritten(const Words& written, size_t first, size_t size, size_t offset, std::vector<StateRange>& out)
+    {
+        if (offset == SIZE_MAX) {
+            return;
+        }
+        for (size_t i = 0; i * 256 < size && first + i < Pages; i++) {
+            if (written[(first + i) >> 6] >> ((first + i) & 63) & 1) {
+                continue;
+            }
+            auto begin = offset + i * 256;
+            auto length = std::min<size_t>(256, size - i * 256);
+            if (!out.empty() && out.back().offset + out.back().size == begin) {
+                out.back().size += length;
+            } else {
+                out.push_back({ begin, length });
+            }
+        }
+    }
+};
+
+// https://www.nesdev.org/wiki/CPU_interrupts
+// The CPU's /NMI and /IRQ inputs, active high here. The devices that drive
+// them set the flags when their output changes, and the CPU looks at them
+// every cycle, which is just a load. /IRQ is shared (open collector), so
+// every device that can pull it low has a bit and the line is the OR.
+struct Interrupts {
+    enum : uint8_t {
+        Mapper = 0x01,
+        FrameCounter = 0x02,
+        Dmc = 0x04,
+    };
+
+    bool nmi = false; // the PPU, vblank with NMI enabled
+    uint8_t irq = 0;
+
+    void raise(uint8_t source) { irq |= source; }
+    void clear(uint8_t source) { irq &= ~source; }
+    void set(uint8_t source, bool active) { active ? raise(source) : clear(source); }
+    bool test(uint8_t source) const { return irq & source; }
+};
+
 class Mem {
 public:
     virtual ~Mem() = default;
     virtual void set(uint16_t addr, uint8_t value) = 0;
     virtual uint8_t get(uint16_t addr) = 0;
+
+    // Devices that are just plain memory expose it, so the bus can
+    // access it directly instead of calling get and set
+    virtual size_t size() const { return 0; }
+    virtual const uint8_t* readPointer() const { return nullptr; }
+    virtual uint8_t* writePointer() { return nullptr; }
+    // The dirty bits of the memory behind writePointer(), if it keeps them
+    virtual uint64_t* dirtyBits() { return nullptr; }
 };
 
 template <size_t S>
 class Ram : public Mem {
 private:
-    std::array<uint8_t, S> a;
+    std::array<uint8_t, S> a {};
 
 public:
+    DirtyPages<(S + 255) / 256> dirty;
+
+    Ram() { dirty.markAll(); }
     virtual ~Ram() override = default;
-    virtual void set(uint16_t addr, uint8_t value) override { a[addr] = value; }
+    virtual void set(uint16_t addr, uint8_t value) override
+    {
+        a[addr] = value;
+        dirty.mark(addr);
+    }
     virtual uint8_t get(uint16_t addr) override { return a[addr]; }
-};
-
-class PrgRom : public Mem {
-private:
-    uint16_t size = 0;
-    const uint8_t* data = 0;
+    virtual size_t size() const override { return S; }
+    virtual const uint8_t* readPointer() const override { return a.data(); }
+    virtual uint8_t* writePointer() override { return a.data(); }
+    virtual uint64_t* dirtyBits() override { return dirty.bits.data(); }
+    void state(Serializer& s)
+    {
+        s(a);
+        if (s.loading()) {
+            dirty.markAll();
+        }
+    }
 
-public:
-    virtual ~PrgRom() override = default;
-    PrgRom(const uint8_t* data, uint16_t size)
-        : data(data)
-        , size(size)
+    // The pages of a snapshot not written since the last one (Console::snapshot)
+    void unwrittenPages(const StateLayout& layout, std::vector<StateRange>& out)
     {
+        dirty.unwritten(dirty.take(DirtyReader::Snapshots), 0, S, layout.offset(a.data()), out);
     }
-    virtual void set(uint16_t addr, uint8_t value) override { }
-    virtual uint8_t get(uint16_t addr) override { return data[addr]; }
 };
 
 // https://www.nesdev.org/wiki/CPU_memory_map
-class Bus : public Mem {
+// The address space is decoded through a table with one entry per 256 byte
+// page. Pages backed by plain memory (RAM and its mirrors, PRG ROM) hold a host
+// pointer and are accessed inline. Everything else (the PPU registers, I/O,
+// mapper registers) falls back to calling the device that is mapped there.
+// A write to a memory page also sets the page's bit in the memory's dirty
+// bits; pages of memory that doesn't keep any set a bit nobody reads.
+class Bus final : public Mem {
 private:
+    struct Io {
+        Mem* mem = nullptr;
+        uint16_t mask = 0xffff; // applied to the CPU address before calling the device
+    };
+    struct Dirty {
+        uint64_t* word;
+        uint64_t bit;
+    };
+
+    std::array<const uint8_t*, 256> readPages {};
+    std::array<uint8_t*, 256> writePages {};
+    std::array<Dirty, 256> dirtyPages;
+    uint64_t untracked = 0;
+    std::array<Io, 256> ioPages {};
+    std::vector<std::shared_ptr<Mem>> devices;
+
+    uint8_t ioGet(uint16_t addr)
+    {
+        auto& io = ioPages[addr >> 8];
+        if (io.mem) {
+            auto value = io.mem->get(addr & io.mask);
+            trace<Trace::Bus>("Reading from device at %04x (%02x)", addr, value);
+            return value;
+        }
+
+        // https://www.nesdev.org/wiki/Open_bus_behavior
+        // Nothing drives the data bus, so it still holds the last value on it
+        trace<Trace::Bus>("Reading from unknown at %04x (open bus %02x)", addr, data);
+        return data;
+    }
+
+    void ioSet(uint16_t addr, uint8_t value)
+    {
+        auto& io = ioPages[addr >> 8];
+        if (io.mem) {
+            trace<Trace::Bus>("Writing to device at %04x (%02x)", addr, value);
+            return io.mem->set(addr & io.mask, value);
+        }
+
+        trace<Trace::Bus>("Writing to unknown at %04x (%02x)", addr, value);
+        // exit(1);
+    }
+
+    Dirty dirtyPage(uint64_t* bits, size_t offset)
+    {
+        if (!bits) {
+            return { &untracked, 0 };
+        }
+        return { bits + (offset >> 14), uint64_t(1) << (offset >> 8 & 63) };
+    }
+
 public:
     static const bool READ = 1;
     static const bool WRITE = 0;
 
+    Bus()
+    {
+        dirtyPages.fill({ &untracked, 0 });
+    }
+
     uint16_t addr = 0;
     uint8_t data = 0;
     bool rw = READ;
+    Interrupts interrupts;
 
-    // TODO this need to be more generic
-    // probably a vector of memory mapped devices
-    std::shared_ptr<Mem> ram;
-    std::shared_ptr<Mem> prgRom;
-    std::shared_ptr<Mem> ppuMem;
-
-    virtual uint8_t get(uint16_t addr) override
+    // Map a device at [begin, end), both multiples of the page size. Memory
+    // backed devices are mirrored every size() bytes, the rest are called with
+    // the address masked by mask.
+    void map(uint16_t begin, uint32_t end, std::shared_ptr<Mem> mem, uint16_t mask = 0xffff)
     {
-        if (addr < 0x2000) {
-            std::fprintf(stderr, "Reading from RAM at %04x (%02x)\n", addr, ram->get(addr & 0x07ff));
-            return ram->get(addr & 0x07ff);
+        auto read = mem->readPointer();
+        auto write = mem->writePointer();
+        for (uint32_t page = begin >> 8; page < end >> 8; page++) {
+            auto offset = mem->size() ? ((page << 8) - begin) % mem->size() : 0;
+            readPages[page] = read ? read + offset : nullptr;
+            writePages[page] = write ? write + offset : nullptr;
+            dirtyPages[page] = dirtyPage(write ? mem->dirtyBits() : nullptr, offset);
+            ioPages[page] = { mem.get(), mask };
         }
-        if (addr >= 0x2000 && addr < 0x4000) {
-            // reading form ppu clears the vblank flag, so cache the value
-            auto v = ppuMem->get((addr - 0x2000) & 0x07);
-            std::fprintf(stderr, "Reading from PPU at %04x (%02x)\n", addr, v);
-            return v;
-        }
-        if (addr >= 0x8000) {
-            // std::fprintf(stderr, "Reading from CART at %04x (%02x)\n", addr, prgRom->get(addr - 0x8000));
-            return prgRom->get(addr - 0x8000);
+        devices.push_back(mem);
+    }
+
+    // Point the pages in [begin, end) at other host memory, or at nothing to
+    // send the accesses to the device mapped there. Mappers switch banks this
+    // way. If the memory keeps dirty bits, write is writeOffset bytes into it.
+    void remap(uint16_t begin, uint32_t end, const uint8_t* read, uint8_t* write, uint64_t* dirtyBits = nullptr, size_t writeOffset = 0)
+    {
+        for (uint32_t page = begin >> 8; page < end >> 8; page++) {
+            auto offset = (page << 8) - begin;
+            readPages[page] = read ? read + offset : nullptr;
+            writePages[page] = write ? write + offset : nullptr;
+            dirtyPages[page] = dirtyPage(write ? dirtyBits : nullptr, writeOffset + offset);
         }
+    }
+
+    // The memory behind the page addr is in, if it is memory
+    const uint8_t* readPage(uint16_t addr) const { return readPages[addr >> 8]; }
 
-        std::fprintf(stderr, "Reading from unknown at %04x\n", addr);
-        exit(1);
-        return 0;
+    virtual uint8_t get(uint16_t addr) override
+    {
+        if (auto page = readPages[addr >> 8]) {
+            trace<Trace::Bus>("Reading from memory at %04x (%02x)", addr, page[addr & 0xff]);
+            return page[addr & 0xff];
+        }
+        return ioGet(addr);
     }
 
     virtual void set(uint16_t addr, uint8_t value) override
     {
-        if (addr < 0x2000) {
-            std::fprintf(stderr, "Writing to RAM at %04x (%02x)\n", addr, value);
-            return ram->set(addr & 0x07ff, value);
-        }
-        if (addr >= 0x2000 && addr < 0x4000) {
-            std::fprintf(stderr, "Writing to PPU at %04x (%02x)\n", addr, value);
-            return ppuMem->set((addr - 0x2000) & 0x07, value);
+        if (auto page = writePages[addr >> 8]) {
+            trace<Trace::Bus>("Writing to memory at %04x (%02x)", addr, value);
+            page[addr & 0xff] = value;
+            *dirtyPages[addr >> 8].word |= dirtyPages[addr >> 8].bit;
+            return;
         }
-        std::fprintf(stderr, "Writing to unknown at %04x\n", addr);
-        // exit(1);
+        ioSet(addr, value);
+    }
+
+    // The last access, the CPU's micro-ops pick it up on the next cycle
+    void state(Serializer& s)
+    {
+        s(addr);
+        s(data);
+        s(rw);
+        s(interrupts.nmi);
+        s(interrupts.irq);
     }
 
     void clk()
@@ -0,0 +1,676 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "hash.hpp"
+#include "video.hpp"
+
+// Frame capture
+// Records every drawn frame to a file, for bug reports. Unlike VideoOutput,
+// which only ever wants the newest frame, a capture wants all of them: the
+// emulation thread copies each frame into a bounded queue and an encoder
+// thread takes them out, encodes them and writes them. When the encoder falls
+// behind and the queue is full, the policy decides: Drop skips the frame (the
+// emulation never waits), Stall waits for a free slot (no frame is lost).
+// Formats, by the file's extension:
+//   .y4m     raw YUV 4:4:4, which most players and ffmpeg take
+//   .png     a PNG per frame, name-000123.png with the PPU's frame number
+//   .nescap  palette indices, run-length coded and against the frame before
+//            (see NesCapEncoder), lossless and compact
+
+// Turns frames into bytes on disk. Called on the encoder thread only, with
+// Ppu::width * Ppu::height pixels as in Ppu::framebuffer. Returns false if
+// writing failed.
+class FrameEncoder {
+public:
+    virtual ~FrameEncoder() = default;
+    virtual bool write(uint64_t number, const uint16_t* pixels) = 0;
+};
+
+// https://wiki.multimedia.cx/index.php/YUV4MPEG2
+// The frame rate is the NTSC NES's, 236.25 MHz / 11 over 357366 master clocks
+// a frame, and the pixels are 8:7. Frames the capture didn't get (dropped or
+// not drawn) repeat the one before, so the video keeps the game's timing.
+class Y4mEncoder : public FrameEncoder {
+private:
+    std::ofstream file;
+    std::vector<uint8_t> planes;
+    uint64_t last = 0;
+
+    // https://en.wikipedia.org/wiki/YCbCr#ITU-R_BT.601_conversion
+    // Limited range BT.601
+    static constexpr auto ycbcrPalette = [] {
+        std::array<std::array<uint8_t, 3>, 512> table {};
+        for (int i = 0; i < 512; i++) {
+            auto c = emphasized(i);
+            float r = c[0], g = c[1], b = c[2];
+            table[i] = {
+                uint8_t(16 + (65.481f * r + 128.553f * g + 24.966f * b) / 255 + 0.5f),
+                uint8_t(128 + (-37.797f * r - 74.203f * g + 112.0f * b) / 255 + 0.5f),
+                uint8_t(128 + (112.0f * r - 93.786f * g - 18.214f * b) / 255 + 0.5f),
+            };
+        }
+        return table;
+    }();
+
+public:
+    explicit Y4mEncoder(const std::string& path)
+        : file(path, std::ios::binary | std::ios::trunc)
+    {
+        if (!file) {
+            std::fprintf(stderr, "%s: can't write\n", path.c_str());
+            return;
+        }
+        char header[64];
+        auto size = std::snprintf(header, sizeof(header), "YUV4MPEG2 W%d H%d F39375000:655171 Ip A8:7 C444\n", Ppu::width, Ppu::height);
+        file.write(header, size);
+    }
+
+    bool ok() const { return bool(file); }
+
+    virtual bool write(uint64_t number, const uint16_t* pixels) override
+    {
+        constexpr size_t plane = Ppu::width * Ppu::height;
+        if (planes.empty()) {
+            planes.resize(plane * 3);
+        } else {
+            for (; last + 1 < number; last++) {
+                file.write("FRAME\n", 6);
+                file.write((const char*)planes.data(), planes.size());
+            }
+        }
+        for (size_t i = 0; i < plane; i++) {
+            const auto& c = ycbcrPalette[pixels[i] & 0x1ff];
+            planes[i] = c[0];
+            planes[plane + i] = c[1];
+            planes[plane * 2 + i] = c[2];
+        }
+        file.write("FRAME\n", 6);
+        file.write((const char*)planes.data(), planes.size());
+        last = number;
+        return bool(file);
+    }
+};
+
+// https://www.rfc-editor.org/rfc/rfc1951
+// A deflate stream in one block with the fixed Huffman codes, matching each
+// position against the last one with the same 3 bytes. Nowhere near zlib's
+// ratio in general, but NES frames are long runs of a few colors and rows
+// that repeat, which this finds, at a few milliseconds a frame.
+class Deflate {
+private:
+    std::vector<uint8_t>& out;
+    uint64_t bits = 0;
+    int count = 0;
+
+    static constexpr uint16_t lengthBase[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+    static constexpr uint8_t lengthExtra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+    static constexpr uint16_t distanceBase[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+    static constexpr uint8_t distanceExtra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+    static constexpr int window = 32768;
+    static constexpr int maxMatch = 258;
+
+    explicit Deflate(std::vector<uint8_t>& out)
+        : out(out)
+    {
+    }
+
+    // Least significant bit first
+    void put(uint32_t value, int size)
+    {
+        bits |= uint64_t(value) << count;
+        for (count += size; count >= 8; count -= 8) {
+            out.push_back(uint8_t(bits));
+            bits >>= 8;
+        }
+    }
+
+    // Huffman codes go most significant bit first
+    void putCode(uint32_t code, int size)
+    {
+        uint32_t reversed = 0;
+        for (int i = 0; i < size; i++) {
+            reversed = reversed << 1 | (code >> i & 1);
+        }
+        put(reversed, size);
+    }
+
+    void symbol(int value)
+    {
+        if (value < 144) {
+            putCode(0x30 + value, 8);
+        } else if (value < 256) {
+            putCode(0x190 + value - 144, 9);
+        } else if (value < 280) {
+            putCode(value - 256, 7);
+        } else {
+            putCode(0xc0 + value - 280, 8);
+        }
+    }
+
+    void match(int length, int distance)
+    {
+        int i = 28;
+        while (lengthBase[i] > length) {
+            i--;
+        }
+        symbol(257 + i);
+        put(length - lengthBase[i], lengthExtra[i]);
+        int j = 29;
+        while (distanceBase[j] > distance) {
+            j--;
+        }
+        putCode(j, 5);
+        put(distance - distanceBase[j], distanceExtra[j]);
+    }
+
+public:
+    // Appends the compressed data to out
+    static void compress(const uint8_t* data, size_t size, std::vector<uint8_t>& out)
+    {
+        Deflate d(out);
+        d.put(1, 1); // the last block
+        d.put(1, 2); // fixed codes
+        std::vector<int32_t> last(1 << 15, -1);
+        auto hash = [&](size_t i) { return (data[i] << 10 ^ data[i + 1] << 5 ^ data[i + 2]) & 0x7fff; };
+        for (size_t i = 0; i < size;) {
+            int length = 0;
+            int distance = 0;
+            if (i + 3 <= size) {
+                auto& slot = last[hash(i)];
+                auto candidate = slot;
+                slot = int32_t(i);
+                if (candidate >= 0 && i - candidate <= window) {
+                    auto limit = std::min<size_t>(maxMatch, size - i);
+                    while (size_t(length) < limit && data[candidate + length] == data[i + length]) {
+                        length++;
+                    }
+                    distance = int(i - candidate);
+                }
+            }
+            if (length < 3) {
+                d.symbol(data[i++]);
+                continue;
+            }
+            d.match(length, distance);
+            for (auto end = i + length; ++i < end;) {
+                if (i + 3 <= size) {
+                    last[hash(i)] = int32_t(i);
+                }
+            }
+        }
+        d.symbol(256);
+        d.put(0, 7); // flush
+    }
+};
+
+// http://www.libpng.org/pub/png/spec/1.2/PNG-Contents.html
+// 8 bit RGB, no filtering, compressed with Deflate
+class PngEncoder : public FrameEncoder {
+private:
+    std::string stem;
+    std::vector<uint32_t> rgba;
+    std::vector<uint8_t> raw;
+    std::vector<uint8_t> png;
+
+    static void putBigEndian(std::vector<uint8_t>& out, uint32_t value)
+    {
+        for (int i = 3; i >= 0; i--) {
+            out.push_back(uint8_t(value >> (i * 8)));
+        }
+    }
+
+    void chunk(const char* type, const std::vector<uint8_t>& data)
+    {
+        putBigEndian(png, uint32_t(data.size()));
+        png.insert(png.end(), type, type + 4);
+        png.insert(png.end(), data.begin(), data.end());
+        putBigEndian(png, crc32(data.data(), data.size(), crc32(type, 4)));
+    }
+
+    // https://www.rfc-editor.org/rfc/rfc1950
+    static uint32_t adler32(const uint8_t* data, size_t size)
+    {
+        uint32_t a = 1, b = 0;
+        for (size_t i = 0; i < size;) {
+            // 5552 bytes is the most that can't overflow before the modulo
+            for (auto end = std::min(size, i + 5552); i < end; i++) {
+                a += data[i];
+                b += a;
+            }
+            a %= 65521;
+            b %= 65521;
+        }
+        return b << 16 | a;
+    }
+
+public:
+    // path is name.png, the frames go to name-000123.png
+    explicit PngEncoder(const std::string& path)
+        : stem(path.substr(0, path.size() - 4))
+    {
+    }
+
+    virtual bool write(uint64_t number, const uint16_t* pixels) override
+    {
+        rgba.resize(Ppu::width * Ppu::height);
+        toRgba8888(pixels, rgba.data(), rgba.size());
+        raw.clear();
+        for (int y = 0; y < Ppu::height; y++) {
+            raw.push_back(0); // no filter
+            for (int x = 0; x < Ppu::width; x++) {
+                auto c = rgba[y * Ppu::width + x];
+                raw.insert(raw.end(), { uint8_t(c), uint8_t(c >> 8), uint8_t(c >> 16) });
+            }
+        }
+
+        static constexpr uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+        png.assign(signature, signature + sizeof(signature));
+        std::vector<uint8_t> data;
+        putBigEndian(data, Ppu::width);
+        putBigEndian(data, Ppu::height);
+        data.insert(data.end(), { 8, 2, 0, 0, 0 }); // 8 bit RGB, deflate, no filters, not interlaced
+        chunk("IHDR", data);
+        data = { 0x78, 0x01 }; // zlib, 32K window, fastest
+        Deflate::compress(raw.data(), raw.size(), data);
+        putBigEndian(data, adler32(raw.data(), raw.size()));
+        chunk("IDAT", data);
+        chunk("IEND", {});
+
+        char name[32];
+        std::snprintf(name, sizeof(name), "-%06llu.png", (unsigned long long)number);
+        auto path = stem + name;
+        std::ofstream file(path, std::ios::binary | std::ios::trunc);
+        if (!file.write((const char*)png.data(), png.size())) {
+            std::fprintf(stderr, "%s: can't write\n", path.c_str());
+            return false;
+        }
+        return true;
+    }
+};
+
+// The frames as the PPU made them, palette indices with the emphasis bits, so
+// a player turns them into colors with rgbaPalette (NesCapReader reads them
+// back). After an 8 byte magic (the last byte is the version) and the width
+// and height (2 bytes each), every frame is its number (8 bytes), flags (1
+// byte, bit 0: keyframe) and the size of its data (4 bytes), then the data: a
+// list of spans in pixel order, each a varint of count << 2 | kind.
+//   Same     count pixels as in the frame before (not in keyframes)
+//   Run      count pixels of one value, which follows (2 bytes)
+//   Literal  count values follow, a byte each (all are below 256)
+//   Wide     count values follow, 2 bytes each
+// Flat backgrounds and frames that barely move come down to a few bytes. Fine
+// detail, with a color change every pixel or two, stays near a byte a pixel,
+// which is still half of the raw frame. There is a keyframe every
+// keyframeInterval frames to start playing from, and the file is valid up to
+// the last whole frame if the program never gets to close it.
+class NesCapEncoder : public FrameEncoder {
+public:
+    static constexpr uint8_t magic[8] = { 'N', 'E', 'S', 'C', 'A', 'P', 0, 2 };
+    enum Kind : uint8_t {
+        Same,
+        Run,
+        Literal,
+        Wide,
+    };
+
+private:
+    static constexpr int keyframeInterval = 60;
+
+    std::ofstream file;
+    std::vector<uint16_t> previous = std::vector<uint16_t>(Ppu::width * Ppu::height);
+    std::vector<uint8_t> out;
+    uint64_t frames = 0;
+
+    // Little endian
+    static void put(std::vector<uint8_t>& out, uint64_t value, int size)
+    {
+        for (int i = 0; i < size; i++) {
+            out.push_back(uint8_t(value >> (i * 8)));
+        }
+    }
+
+    static void span(std::vector<uint8_t>& out, Kind kind, size_t count)
+    {
+        for (count = count << 2 | kind; count >= 0x80; count >>= 7) {
+            out.push_back(uint8_t(count | 0x80));
+        }
+        out.push_back(uint8_t(count));
+    }
+
+public:
+    // Appends the spans for size pixels, against previous or, if it's null,
+    // as a keyframe
+    static void encode(const uint16_t* pixels, const uint16_t* previous, size_t size, std::vector<uint8_t>& out)
+    {
+        auto same = [&](size_t i) { return previous && i < size && pixels[i] == previous[i]; };
+        auto run = [&](size_t i) { return i + 2 < size && pixels[i] == pixels[i + 1] && pixels[i] == pixels[i + 2]; };
+        for (size_t i = 0; i < size;) {
+            auto start = i;
+            if (same(i)) {
+                while (same(i)) {
+                    i++;
+                }
+                span(out, Same, i - start);
+                continue;
+            }
+            if (run(i)) {
+                while (i < size && pixels[i] == pixels[start]) {
+                    i++;
+                }
+                span(out, Run, i - start);
+                put(out, pixels[start], 2);
+                continue;
+            }
+            // Literals until a run or two unchanged pixels, shorter ones are
+            // cheaper inline
+            do {
+                i++;
+            } while (i < size && !run(i) && !(same(i) && same(i + 1)));
+            bool wide = std::any_of(pixels + start, pixels + i, [](uint16_t p) { return p > 0xff; });
+            span(out, wide ? Wide : Literal, i - start);
+            for (auto j = start; j < i; j++) {
+                put(out, pixels[j], wide ? 2 : 1);
+            }
+        }
+    }
+
+    // Applies the spans encode() made to pixels, which holds the frame before
+    // (zeros for a keyframe). False if they're damaged or don't cover exactly
+    // size pixels.
+    static bool decode(const uint8_t* data, size_t bytes, uint16_t* pixels, size_t size)
+    {
+        const auto* end = data + bytes;
+        auto get16 = [&] {
+            uint16_t value = uint16_t(data[0] | data[1] << 8);
+            data += 2;
+            return value;
+        };
+        size_t i = 0;
+        while (data < end) {
+            uint64_t value = 0;
+            for (int shift = 0;; shift += 7) {
+                if (data == end || shift > 56) {
+                    return false;
+                }
+                auto byte = *data++;
+                value |= uint64_t(byte & 0x7f) << shift;
+                if (!(byte & 0x80)) {
+                    break;
+                }
+            }
+            auto count = value >> 2;
+            if (count > size - i) {
+                return false;
+            }
+            switch (value & 3) {
+            case Same:
+                break;
+            case Run:
+                if (end - data < 2) {
+                    return false;
+                }
+                std::fill(pixels + i, pixels + i + count, get16());
+                break;
+            case Literal:
+                if (uint64_t(end - data) < count) {
+                    return false;
+                }
+                std::copy(data, data + count, pixels + i);
+                data += count;
+                break;
+            case Wide:
+                if (uint64_t(end - data) < count * 2) {
+                    return false;
+                }
+                for (size_t j = 0; j < count; j++) {
+                    pixels[i + j] = get16();
+                }
+                break;
+            }
+            i += count;
+        }
+        return i == size;
+    }
+
+    explicit NesCapEncoder(const std::string& path)
+        : file(path, std::ios::binary | std::ios::trunc)
+    {
+        if (!file) {
+            std::fprintf(stderr, "%s: can't write\n", path.c_str());
+            return;
+        }
+        out.assign(magic, magic + sizeof(magic));
+        put(out, Ppu::width, 2);
+        put(out, Ppu::height, 2);
+        file.write((const char*)out.data(), out.size());
+    }
+
+    bool ok() const { return bool(file); }
+
+    virtual bool write(uint64_t number, const uint16_t* pixels) override
+    {
+        bool keyframe = frames++ % keyframeInterval == 0;
+        out.clear();
+        put(out, number, 8);
+        put(out, keyframe, 1);
+        put(out, 0, 4);
+        auto header = out.size();
+        encode(pixels, keyframe ? nullptr : previous.data(), previous.size(), out);
+        auto size = out.size() - header;
+        for (int i = 0; i < 4; i++) {
+            out[header - 4 + i] = uint8_t(size >> (i * 8));
+        }
+        std::copy(pixels, pixels + previous.size(), previous.begin());
+        return bool(file.write((const char*)out.data(), out.size()));
+    }
+};
+
+// Plays a .nescap back, a frame at a time
+class NesCapReader {
+private:
+    std::ifstream file;
+    std::string path;
+    std::vector<uint8_t> data;
+
+    static uint64_t get(const uint8_t* in, int size)
+    {
+        uint64_t value = 0;
+        for (int i = 0; i < size; i++) {
+            value |= uint64_t(in[i]) << (i * 8);
+        }
+        return value;
+    }
+
+public:
+    uint64_t number = 0; // the PPU's frame number of pixels
+    bool keyframe = false;
+    std::vector<uint16_t> pixels = std::vector<uint16_t>(Ppu::width * Ppu::height);
+
+    explicit NesCapReader(const std::string& path)
+        : file(path, std::ios::binary)
+        , path(path)
+    {
+        uint8_t header[12];
+        if (!file.read((char*)header, sizeof(header))) {
+            std::fprintf(stderr, "%s: can't read\n", path.c_str());
+            file.close();
+            return;
+        }
+        if (!std::equal(header, header + 8, NesCapEncoder::magic) || get(header + 8, 2) != Ppu::width || get(header + 10, 2) != Ppu::height) {
+            std::fprintf(stderr, "%s: not a version %d nescap of %dx%d\n", path.c_str(), NesCapEncoder::magic[7], Ppu::width, Ppu::height);
+            file.close();
+        }
+    }
+
+    bool ok() const { return file.is_open(); }
+
+    // The next frame into pixels. False at the end of the file, which can cut
+    // a frame short, or if a frame is damaged (after saying so).
+    bool next()
+    {
+        uint8_t header[13];
+        if (!ok() || !file.read((char*)header, sizeof(header))) {
+            return false;
+        }
+        number = get(header, 8);
+        keyframe = header[8] & 1;
+        // A pixel is at most 3 bytes, a one pixel Wide
+        auto size = get(header + 9, 4);
+        if (size > pixels.size() * 3) {
+            std::fprintf(stderr, "%s: frame %llu is damaged\n", path.c_str(), (unsigned long long)number);
+            file.close();
+            return false;
+        }
+        data.resize(size);
+        if (!file.read((char*)data.data(), data.size())) {
+            return false;
+        }
+        if (keyframe) {
+            std::fill(pixels.begin(), pixels.end(), 0);
+        }
+        if (!NesCapEncoder::decode(data.data(), data.size(), pixels.data(), pixels.size())) {
+            std::fprintf(stderr, "%s: frame %llu is damaged\n", path.c_str(), (unsigned long long)number);
+            file.close();
+            return false;
+        }
+        return true;
+    }
+};
+
+// By the extension of path, or null (after saying why) if it's none of them
+// or the file can't be written
+inline std::unique_ptr<FrameEncoder> openCapture(const std::string& path)
+{
+    auto extension = path.substr(std::min(path.size(), path.rfind('.')));
+    if (extension == ".y4m") {
+        auto encoder = std::make_unique<Y4mEncoder>(path);
+        return encoder->ok() ? std::move(encoder) : nullptr;
+    }
+    if (extension == ".png") {
+        return std::make_unique<PngEncoder>(path);
+    }
+    if (extension == ".nescap") {
+        auto encoder = std::make_unique<NesCapEncoder>(path);
+        return encoder->ok() ? std::move(encoder) : nullptr;
+    }
+    std::fprintf(stderr, "%s: capture to .y4m, .png or .nescap\n", path.c_str());
+    return nullptr;
+}
+
+class Capture {
+public:
+    enum class Policy {
+        Drop, // a frame that doesn't fit in the queue is lost
+        Stall, // the emulation thread waits for room
+    };
+
+    struct Metrics {
+        uint64_t pushed; // frames the emulation thread handed over
+        uint64_t written; // frames the encoder wrote
+        uint64_t dropped; // frames that didn't fit in the queue
+        uint64_t stalls; // times the emulation thread waited for room
+        uint64_t failed; // frames the encoder couldn't write
+    };
+
+private:
+    struct Indexed {
+        uint64_t number = 0;
+        std::array<uint16_t, Ppu::width * Ppu::height> pixels;
+    };
+
+    std::unique_ptr<FrameEncoder> encoder;
+    Policy policy;
+    std::vector<Indexed> queue; // single producer, single consumer ring
+    alignas(64) std::atomic<uint64_t> head = 0; // written by the emulation thread
+    alignas(64) std::atomic<uint64_t> tail = 0; // written by the encoder thread
+    std::atomic<uint64_t> pushed = 0;
+    std::atomic<uint64_t> written = 0;
+    std::atomic<uint64_t> dropped = 0;
+    std::atomic<uint64_t> stalls = 0;
+    std::atomic<uint64_t> failed = 0;
+    std::atomic<bool> running = true;
+    std::thread thread;
+
+    void encode()
+    {
+        for (;;) {
+            // Read running first: everything pushed before it was cleared is
+            // in head by then
+            bool last = !running;
+            auto t = tail.load(std::memory_order_relaxed);
+            if (t == head.load(std::memory_order_acquire)) {
+                if (last) {
+                    break;
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                continue;
+            }
+            const auto& frame = queue[t % queue.size()];
+            if (encoder->write(frame.number, frame.pixels.data())) {
+                written++;
+            } else {
+                failed++;
+            }
+            tail.store(t + 1, std::memory_order_release);
+        }
+    }
+
+public:
+    // queueFrames frames of 120 KB each can wait for the encoder
+    Capture(std::unique_ptr<FrameEncoder> encoder, Policy policy, size_t queueFrames = 16)
+        : encoder(std::move(encoder))
+        , policy(policy)
+        , queue(queueFrames)
+    {
+        thread = std::thread([this] { encode(); });
+    }
+
+    ~Capture() { finish(); }
+
+    // Writes the frames still queued and stops the encoder thread
+    void finish()
+    {
+        running = false;
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+
+    // A finished frame, from the emulation thread. Only blocks if the queue is
+    // full and the policy is Stall.
+    void push(const Ppu& ppu)
+    {
+        pushed++;
+        auto h = head.load(std::memory_order_relaxed);
+        if (h - tail.load(std::memory_order_acquire) == queue.size()) {
+            if (policy == Policy::Drop) {
+                dropped++;
+                return;
+            }
+            stalls++;
+            while (h - tail.load(std::memory_order_acquire) == queue.size()) {
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+            }
+        }
+        auto& frame = queue[h % queue.size()];
+        frame.number = ppu.frame;
+        frame.pixels = ppu.framebuffer;
+        head.store(h + 1, std::memory_order_release);
+    }
+
+    Metrics metrics() const
+    {
+        return { pushed, written, dropped, stalls, failed };
+    }
+};
@@ -1,79 +1,214 @@
 #pragma once
+#include <algorithm>
 #include <array>
-#include <cassert>
+#include <cstddef>
 #include <cstdint>
+#include <cstdio>
 #include <fstream>
+#include <iterator>
 #include <string>
 #include <vector>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "tile.hpp"
+
+// A read only run of bytes inside something else (std::span is C++20)
+struct View {
+    const uint8_t* ptr = nullptr;
+    size_t count = 0;
+
+    const uint8_t* data() const { return ptr; }
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    const uint8_t* begin() const { return ptr; }
+    const uint8_t* end() const { return ptr + count; }
+    uint8_t operator[](size_t i) const { return ptr[i]; }
+    View sub(size_t offset, size_t length) const { return { ptr + offset, length }; }
+};
+
 // http://fms.komkon.org/EMUL8/NES.html
+// https://www.nesdev.org/wiki/INES
+// https://www.nesdev.org/wiki/NES_2.0
+// The file is mapped read only rather than read, so opening is instant and
+// processes running the same ROM share its pages. PRG and CHR are views into
+// the mapping.
 class Rom {
 public:
-    std::vector<uint8_t> data;
-    bool open(const std::string& path)
-    {
-        std::ifstream file(path, std::ios::binary | std::ios::ate);
-        std::streamsize size = file.tellg();
-        file.seekg(0, std::ios::beg);
-        data.resize(size);
-        if (!file.read((char*)data.data(), data.size())) {
+    struct Header {
+        bool nes2 = false;
+        int mapper = 0;
+        int submapper = 0;
+        size_t prgRomSize = 0;
+        size_t chrRomSize = 0; // 0 means the board has CHR RAM
+        size_t prgRamSize = 0; // volatile and battery backed
+        size_t prgNvramSize = 0;
+        size_t chrRamSize = 0;
+        size_t chrNvramSize = 0;
+        bool verticalMirroring = false;
+        bool fourScreen = false;
+        bool battery = false;
+        bool trainer = false;
+    };
+
+    Header header;
+    View file;
+    View trainer; // 512 bytes loaded at $7000, if present
+    View prg;
+    View chr;
+
+    // Every CHR ROM tile, decoded once at load (unless opened without)
+    std::vector<DecodedTile> decodedChr;
+
+    Rom() = default;
+    Rom(const Rom&) = delete;
+    Rom& operator=(const Rom&) = delete;
+    ~Rom() { close(); }
+
+    // Without decodeChr only the header and the views are there, for reading
+    // the file rather than running it
+    bool open(const std::string& path, bool decodeChr = true)
+    {
+        close();
+        auto fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            std::fprintf(stderr, "%s: can't open\n", path.c_str());
             return false;
         }
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            auto mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapped != MAP_FAILED) {
+                mapping = mapped;
+                file = { (const uint8_t*)mapped, size_t(st.st_size) };
+            }
+        }
+        ::close(fd);
+
+        // Not something that can be mapped (a pipe for example), read it instead
+        if (!mapping) {
+            std::ifstream in(path, std::ios::binary);
+            buffer.assign(std::istreambuf_iterator<char>(in), {});
+            file = { buffer.data(), buffer.size() };
+        }
+        return load(path, decodeChr);
+    }
 
-        // TODO check mapper
-        assert(1 == data[5]);
+    // Parse the header and check the file holds everything it promises
+    static bool parse(View bytes, Header& out, std::string& error)
+    {
+        if (bytes.size() < 16 || bytes[0] != 'N' || bytes[1] != 'E' || bytes[2] != 'S' || bytes[3] != 0x1a) {
+            error = "not an iNES file";
+            return false;
+        }
+
+        Header h;
+        auto flags6 = bytes[6];
+        auto flags7 = bytes[7];
+        h.verticalMirroring = flags6 & 0x01;
+        h.battery = flags6 & 0x02;
+        h.trainer = flags6 & 0x04;
+        h.fourScreen = flags6 & 0x08;
+        h.nes2 = (flags7 & 0x0c) == 0x08;
+        if (h.nes2) {
+            h.mapper = flags6 >> 4 | (flags7 & 0xf0) | (bytes[8] & 0x0f) << 8;
+            h.submapper = bytes[8] >> 4;
+            h.prgRomSize = romSize(bytes[4], bytes[9] & 0x0f, 16384);
+            h.chrRomSize = romSize(bytes[5], bytes[9] >> 4, 8192);
+            h.prgRamSize = ramSize(bytes[10] & 0x0f);
+            h.prgNvramSize = ramSize(bytes[10] >> 4);
+            h.chrRamSize = ramSize(bytes[11] & 0x0f);
+            h.chrNvramSize = ramSize(bytes[11] >> 4);
+        } else {
+            // Old dumping tools left junk (like "DiskDude!") in bytes 7-15, if
+            // so the upper half of the mapper number is junk too
+            auto junk = bytes[12] | bytes[13] | bytes[14] | bytes[15];
+            h.mapper = flags6 >> 4 | (junk ? 0 : flags7 & 0xf0);
+            h.prgRomSize = bytes[4] * size_t(16384);
+            h.chrRomSize = bytes[5] * size_t(8192);
+            auto ram = (bytes[8] ? bytes[8] : 1) * size_t(8192);
+            (h.battery ? h.prgNvramSize : h.prgRamSize) = ram;
+            h.chrRamSize = h.chrRomSize ? 0 : 8192;
+        }
+
+        // The mappers switch PRG in 8KB banks and CHR in 1KB banks
+        if (h.prgRomSize == 0 || h.prgRomSize % 8192) {
+            error = h.prgRomSize ? "PRG ROM isn't whole 8KB banks" : "no PRG ROM";
+            return false;
+        }
+        if (h.chrRomSize % 1024) {
+            error = "CHR ROM isn't whole 1KB banks";
+            return false;
+        }
+        auto need = add(add(16 + (h.trainer ? 512 : 0), h.prgRomSize), h.chrRomSize);
+        if (bytes.size() < need) {
+            error = "file is " + std::to_string(bytes.size()) + " bytes, the header needs " + std::to_string(need);
+            return false;
+        }
+        out = h;
         return true;
     }
 
     int prgRomSize() const
     {
-        return 16384 * data[4];
+        return prg.size();
     }
 
     const uint8_t* prgRomBegin() const
     {
-        return data.data() + 16;
+        return prg.data();
     }
 
     int chrRomSize() const
     {
-        return 8192 * data[5];
+        return chr.size();
     }
 
     const uint8_t* chrRomBegin() const
     {
-        return prgRomBegin() + prgRomSize();
+        return chr.data();
+    }
+
+    bool verticalMirroring() const
+    {
+        return header.verticalMirroring;
+    }
+
+    bool fourScreen() const
+    {
+        return header.fourScreen;
+    }
+
+    // The 64 decoded tiles of a 1KB CHR ROM bank
+    const DecodedTile* decodedChrBank(int bank) const
+    {
+        return decodedChr.data() + bank * 64;
     }
 
+    // One byte per pixel, row by row. Blank past the decoded CHR ROM, which
+    // is none at all for CHR RAM or when it wasn't decoded.
     using tile = std::array<uint8_t, 8 * 8>;
     tile getTile(int x) const
     {
-        tile chr;
-        auto o = 16 + prgRomSize();
-        o += x * 16;
-        for (int x = 0; x < 8; x++, o++) {
-            chr[x] = (data[o] >> 7 & 1) | (data[o + 8] >> 6 & 2);
-            chr[x + 8] = (data[o] >> 6 & 1) | (data[o + 8] >> 5 & 2);
-            chr[x + 16] = (data[o] >> 5 & 1) | (data[o + 8] >> 4 & 2);
-            chr[x + 24] = (data[o] >> 4 & 1) | (data[o + 8] >> 3 & 2);
-            chr[x + 32] = (data[o] >> 3 & 1) | (data[o + 8] >> 2 & 2);
-            chr[x + 40] = (data[o] >> 2 & 1) | (data[o + 8] >> 1 & 2);
-            chr[x + 48] = (data[o] >> 1 & 1) | (data[o + 8] >> 0 & 2);
-            chr[x + 56] = (data[o] >> 0 & 1) | (data[o + 8] << 1 & 2);
+        tile pixels {};
+        if (x >= 0 && size_t(x) < decodedChr.size()) {
+            std::copy(std::begin(decodedChr[x].pixels), std::end(decodedChr[x].pixels), pixels.begin());
         }
-        return chr;
+        return pixels;
     }
 
-    void dumpCharacterRom(const std::string& file) const
+    void dumpCharacterRom(const std::string& path) const
     {
-        std::ofstream out(file, std::ios::binary);
+        std::ofstream out(path, std::ios::binary);
         std::vector<tile> tiles;
-        // TODO use characterRomSize!
-        for (int i = 0; i < 256; i++) {
-            tiles.push_back(getTile(i));
+        for (size_t i = 0; i < decodedChr.size(); i++) {
+            tiles.push_back(getTile(int(i)));
         }
         out << "/* XPM */\nstatic char * XFACE[] = {\n";
-        out << "\"8 2048 4 1\",\n";
+        out << "\"8 " << tiles.size() * 8 << " 4 1\",\n";
         out << "\"a c None\",\n";
         out << "\"b c #ff0000\",\n";
         out << "\"c c #00ff00\",\n";
@@ -90,4 +225,73 @@ public:
 
         out << "};\n";
     }
-};
\ No newline at end of file
+
+private:
+    void* mapping = nullptr;
+    std::vector<uint8_t> buffer; // when the file couldn't be mapped
+
+    void close()
+    {
+        if (mapping) {
+            munmap(mapping, file.size());
+            mapping = nullptr;
+        }
+        buffer.clear();
+        file = trainer = prg = chr = {};
+        decodedChr.clear();
+    }
+
+    bool load(const std::string& path, bool decodeChr)
+    {
+        std::string error;
+        if (!parse(file, header, error)) {
+            std::fprintf(stderr, "%s: %s\n", path.c_str(), error.c_str());
+            close();
+            return false;
+        }
+
+        size_t offset = 16;
+        if (header.trainer) {
+            trainer = file.sub(offset, 512);
+            offset += 512;
+        }
+        prg = file.sub(offset, header.prgRomSize);
+        chr = file.sub(offset + header.prgRomSize, header.chrRomSize);
+
+        if (!decodeChr) {
+            return true;
+        }
+        decodedChr.resize(chr.size() / 16);
+        for (size_t i = 0; i < decodedChr.size(); i++) {
+            decodeTile(chr.data() + i * 16, decodedChr[i].pixels);
+        }
+        return true;
+    }
+
+    // a + b, or SIZE_MAX if it doesn't fit (which no file is as big as)
+    static size_t add(size_t a, size_t b)
+    {
+        return a > SIZE_MAX - b ? SIZE_MAX : a + b;
+    }
+
+    // NES 2.0 ROM sizes are a count of units, or if the top nibble is all ones,
+    // 2^E * (M*2+1) bytes with the low byte EEEEEEMM. E goes up to 63, sizes
+    // that don't fit in a size_t are SIZE_MAX.
+    static size_t romSize(uint8_t lsb, uint8_t msb, size_t unit)
+    {
+        if (msb == 0x0f) {
+            auto exponent = lsb >> 2;
+            if (exponent >= int(sizeof(size_t) * 8 - 3)) {
+                return SIZE_MAX;
+            }
+            return (size_t(1) << exponent) * ((lsb & 3) * 2 + 1);
+        }
+        return (msb << 8 | lsb) * unit;
+    }
+
+    // RAM sizes are 64 << shift bytes, or nothing
+    static size_t ramSize(uint8_t shift)
+    {
+        return shift ? size_t(64) << shift : 0;
+    }
+};
@@ -0,0 +1,279 @@
+#pragma once
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include "cart.hpp"
+#include "hash.hpp"
+
+// An index of a directory of ROMs: the parsed header and the CRC-32 and SHA-1
+// of the PRG and CHR payloads of every .nes file under it. It is kept in a
+// small binary file and rescanning only opens files whose size or modification
+// time changed, so picking ROMs by mapper or hash from a large library doesn't
+// mean reading it all again.
+class Catalog {
+public:
+    struct Entry {
+        std::string path;
+        uint64_t size = 0;
+        int64_t mtime = 0;
+        Rom::Header header;
+        uint32_t prgCrc = 0;
+        uint32_t chrCrc = 0;
+        Sha1Digest prgSha1 {};
+        Sha1Digest chrSha1 {};
+    };
+    std::vector<Entry> entries; // sorted by path
+
+    struct ScanStats {
+        size_t kept = 0; // unchanged since the index was written
+        size_t added = 0; // new or changed, so parsed and hashed
+        size_t removed = 0;
+        size_t failed = 0; // not ROMs, or couldn't be read
+    };
+
+    // A missing, old or damaged index just loads as empty
+    bool load(const std::string& indexPath)
+    {
+        entries.clear();
+        std::ifstream in(indexPath, std::ios::binary);
+        std::vector<uint8_t> bytes { std::istreambuf_iterator<char>(in), {} };
+        Reader r { bytes.data(), bytes.data() + bytes.size() };
+        if (!r.magic()) {
+            return false;
+        }
+        auto count = r.u32();
+        for (uint32_t i = 0; i < count && r.ok; i++) {
+            Entry e;
+            e.path.resize(r.u16());
+            r.bytes(e.path.data(), e.path.size());
+            e.size = r.u64();
+            e.mtime = r.u64();
+            auto flags = r.u8();
+            e.header.nes2 = flags & 0x01;
+            e.header.verticalMirroring = flags & 0x02;
+            e.header.fourScreen = flags & 0x04;
+            e.header.battery = flags & 0x08;
+            e.header.trainer = flags & 0x10;
+            e.header.mapper = r.u16();
+            e.header.submapper = r.u8();
+            e.header.prgRomSize = r.u32();
+            e.header.chrRomSize = r.u32();
+            e.header.prgRamSize = r.u32();
+            e.header.prgNvramSize = r.u32();
+            e.header.chrRamSize = r.u32();
+            e.header.chrNvramSize = r.u32();
+            e.prgCrc = r.u32();
+            e.chrCrc = r.u32();
+            r.bytes(e.prgSha1.data(), e.prgSha1.size());
+            r.bytes(e.chrSha1.data(), e.chrSha1.size());
+            entries.push_back(e);
+        }
+        if (!r.ok) {
+            entries.clear();
+        }
+        return r.ok;
+    }
+
+    // Written to a temporary file and renamed over the old one, so a crash
+    // never leaves a half written index
+    bool save(const std::string& indexPath) const
+    {
+        std::vector<uint8_t> out(magic, magic + sizeof(magic));
+        put(out, uint32_t(entries.size()), 4);
+        for (const auto& e : entries) {
+            put(out, e.path.size(), 2);
+            out.insert(out.end(), e.path.begin(), e.path.end());
+            put(out, e.size, 8);
+            put(out, e.mtime, 8);
+            put(out, e.header.nes2 | e.header.verticalMirroring << 1 | e.header.fourScreen << 2 | e.header.battery << 3 | e.header.trainer << 4, 1);
+            put(out, e.header.mapper, 2);
+            put(out, e.header.submapper, 1);
+            put(out, e.header.prgRomSize, 4);
+            put(out, e.header.chrRomSize, 4);
+            put(out, e.header.prgRamSize, 4);
+            put(out, e.header.prgNvramSize, 4);
+            put(out, e.header.chrRamSize, 4);
+            put(out, e.header.chrNvramSize, 4);
+            put(out, e.prgCrc, 4);
+            put(out, e.chrCrc, 4);
+            out.insert(out.end(), e.prgSha1.begin(), e.prgSha1.end());
+            out.insert(out.end(), e.chrSha1.begin(), e.chrSha1.end());
+        }
+
+        auto temp = indexPath + ".tmp";
+        {
+            std::ofstream file(temp, std::ios::binary | std::ios::trunc);
+            if (!file.write((const char*)out.data(), out.size())) {
+                std::fprintf(stderr, "%s: can't write\n", temp.c_str());
+                return false;
+            }
+        }
+        std::error_code ec;
+        std::filesystem::rename(temp, indexPath, ec);
+        return !ec;
+    }
+
+    // Bring the entries up to date with the .nes files under directory
+    ScanStats scan(const std::string& directory)
+    {
+        namespace fs = std::filesystem;
+        ScanStats stats;
+        std::vector<Entry> found;
+        std::error_code ec;
+        for (fs::recursive_directory_iterator it(directory, fs::directory_options::skip_permission_denied, ec), end; !ec && it != end; it.increment(ec)) {
+            auto ext = it->path().extension().string();
+            std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c) { return std::tolower(c); });
+            if (ext != ".nes" || !it->is_regular_file(ec)) {
+                continue;
+            }
+
+            Entry e;
+            e.path = it->path().string();
+            e.size = it->file_size(ec);
+            e.mtime = it->last_write_time(ec).time_since_epoch().count();
+            auto old = std::lower_bound(entries.begin(), entries.end(), e.path, byPath);
+            if (old != entries.end() && old->path == e.path && old->size == e.size && old->mtime == e.mtime) {
+                found.push_back(*old);
+                stats.kept++;
+            } else if (hash(e)) {
+                found.push_back(e);
+                stats.added++;
+            } else {
+                stats.failed++;
+            }
+        }
+
+        std::sort(found.begin(), found.end(), [](const Entry& a, const Entry& b) { return a.path < b.path; });
+        for (const auto& e : entries) {
+            auto now = std::lower_bound(found.begin(), found.end(), e.path, byPath);
+            if (now == found.end() || now->path != e.path) {
+                stats.removed++;
+            }
+        }
+        entries = std::move(found);
+        return stats;
+    }
+
+    std::vector<const Entry*> withMapper(int mapper) const
+    {
+        std::vector<const Entry*> result;
+        for (const auto& e : entries) {
+            if (e.header.mapper == mapper) {
+                result.push_back(&e);
+            }
+        }
+        return result;
+    }
+
+    // hex is the CRC-32 or SHA-1 of either payload
+    std::vector<const Entry*> withHash(std::string hex) const
+    {
+        std::transform(hex.begin(), hex.end(), hex.begin(), [](unsigned char c) { return std::tolower(c); });
+        std::vector<const Entry*> result;
+        for (const auto& e : entries) {
+            if (hex == toHex(e.prgCrc) || hex == toHex(e.chrCrc) || hex == toHex(e.prgSha1) || hex == toHex(e.chrSha1)) {
+                result.push_back(&e);
+            }
+        }
+        return result;
+    }
+
+    static std::string toHex(uint32_t crc)
+    {
+        char text[9];
+        std::snprintf(text, sizeof(text), "%08x", crc);
+        return text;
+    }
+
+    static std::string toHex(const Sha1Digest& digest)
+    {
+        std::string text;
+        for (auto b : digest) {
+            text += "0123456789abcdef"[b >> 4];
+            text += "0123456789abcdef"[b & 15];
+        }
+        return text;
+    }
+
+private:
+    static constexpr uint8_t magic[8] = { 'N', 'E', 'S', 'C', 'A', 'T', 0, 1 }; // last byte is the version
+
+    static bool byPath(const Entry& e, const std::string& path) { return e.path < path; }
+
+    // The payloads are hashed straight from the mapping, without decoding
+    // CHR. Whatever goes wrong with one file only fails that file.
+    static bool hash(Entry& e)
+    {
+        try {
+            Rom rom;
+            if (!rom.open(e.path, false)) {
+                return false;
+            }
+            e.header = rom.header;
+            e.prgCrc = crc32(rom.prg.data(), rom.prg.size());
+            e.chrCrc = crc32(rom.chr.data(), rom.chr.size());
+            e.prgSha1 = sha1(rom.prg.data(), rom.prg.size());
+            e.chrSha1 = sha1(rom.chr.data(), rom.chr.size());
+            return true;
+        } catch (const std::exception& error) {
+            std::fprintf(stderr, "%s: %s\n", e.path.c_str(), error.what());
+            return false;
+        }
+    }
+
+    // Little endian
+    static void put(std::vector<uint8_t>& out, uint64_t value, int size)
+    {
+        for (int i = 0; i < size; i++) {
+            out.push_back(uint8_t(value >> (i * 8)));
+        }
+    }
+
+    struct Reader {
+        const uint8_t* p;
+        const uint8_t* end;
+        bool ok = true;
+
+        uint64_t get(int size)
+        {
+            if (end - p < size) {
+                ok = false;
+                return 0;
+            }
+            uint64_t value = 0;
+            for (int i = 0; i < size; i++) {
+                value |= uint64_t(*p++) << (i * 8);
+            }
+            return value;
+        }
+        uint8_t u8() { return get(1); }
+        uint16_t u16() { return get(2); }
+        uint32_t u32() { return get(4); }
+        uint64_t u64() { return get(8); }
+        void bytes(void* out, size_t size)
+        {
+            if (size_t(end - p) < size) {
+                ok = false;
+                return;
+            }
+            std::copy(p, p + size, static_cast<uint8_t*>(out));
+            p += size;
+        }
+        bool magic()
+        {
+            uint8_t m[sizeof(Catalog::magic)];
+            bytes(m, sizeof(m));
+            ok = ok && std::equal(m, m + sizeof(m), Catalog::magic);
+            return ok;
+        }
+    };
+};
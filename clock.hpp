@@ -1,4 +1,5 @@
 #pragma once
+#include <algorithm>
 #include <chrono>
 #include <cstddef>
 #include <cstdint>
@@ -6,38 +7,111 @@
 #include <thread>
 #include <vector>
 
+#include "state.hpp"
+
 // https://www.nesdev.org/wiki/Cycle_reference_chart
+// The NTSC master clock is 236.25 MHz / 11 (~21.477 MHz). The CPU runs at
+// master / 12 and the PPU at master / 4, so nothing ever happens on most master
+// ticks. Instead of visiting every tick, run() jumps straight to the next tick a
+// device is due on, and only lines emulated time back up with the wall clock
+// once per scanline or frame (or never, to run as fast as possible).
 class Clock {
+public:
+    enum class Sync {
+        None, // Run as fast as the host allows
+        Scanline,
+        Frame,
+    };
+
+    static constexpr int64_t ticksPerScanline = 341 * 4;
+    static constexpr int64_t ticksPerFrame = 262 * ticksPerScanline;
+
+    Sync sync = Sync::Frame;
+
 private:
-    using freq = std::ratio<1, 236'250'000>;
+    using freq = std::ratio<11, 236'250'000>;
     using duration = std::chrono::duration<int64_t, freq>;
-    std::chrono::time_point<std::chrono::high_resolution_clock> lastTime;
 
-    std::vector<std::pair<int, std::function<void()>>> divizors;
+    struct Divizor {
+        int64_t div;
+        int64_t next; // master tick this device is due on next
+        std::function<int()> callback; // returns how many of its own cycles it ran
+    };
+    std::vector<Divizor> divizors;
+
+    int64_t ticks = 0;
+    bool stopped = false;
+
+    int64_t syncInterval() const
+    {
+        return sync == Sync::Scanline ? ticksPerScanline : ticksPerFrame;
+    }
 
 public:
     Clock()
     {
     }
 
+    // Master ticks emulated so far
+    int64_t now() const { return ticks; }
+
+    // Where every device is in its cycle. The devices themselves must be the
+    // same ones, added in the same order.
+    void state(Serializer& s)
+    {
+        s(ticks);
+        for (auto& div : divizors) {
+            s(div.next);
+        }
+    }
+
     void run()
     {
-        auto startTime = std::chrono::high_resolution_clock::now();
-        for (int64_t ticks = 0;; ++ticks) {
+        auto startTime = std::chrono::steady_clock::now();
+        auto startTicks = ticks;
+        do {
+            step(syncInterval());
+            if (sync != Sync::None) {
+                std::this_thread::sleep_until(startTime + duration(ticks - startTicks));
+            }
+        } while (!stopped);
+    }
+
+    // Can be called from a device callback to make step() and run() return
+    // once the current tick has been handled
+    void stop() { stopped = true; }
+
+    // Advance the master clock by count ticks, firing every device that falls due
+    // on the way. Devices due on the same tick fire in the order they were added.
+    void step(int64_t count)
+    {
+        auto end = ticks + count;
+        stopped = false;
+        while (!stopped) {
+            auto next = end;
             for (auto& div : divizors) {
-                if (ticks % div.first == 0) {
-                    div.second();
-                }
+                next = std::min(next, div.next);
+            }
+            if (next >= end) {
+                break;
             }
 
-            auto nextTick = startTime + duration(ticks + 11);
-            std::this_thread::sleep_until(nextTick);
-            // std::fprintf(stderr, "Tick %ld\n", nextTick.time_since_epoch().count());
+            ticks = next;
+            for (auto& div : divizors) {
+                if (div.next == next) {
+                    div.next += div.div * div.callback();
+                }
+            }
+        }
+        if (!stopped) {
+            ticks = end;
         }
     }
 
-    void addDivizor(int div, std::function<void()> callback)
+    // The callback can run several device cycles at once (a whole CPU
+    // instruction for example) and returns how many it ran
+    void addDivizor(int div, std::function<int()> callback)
     {
-        divizors.push_back({ div, callback });
+        divizors.push_back({ div, ticks, callback });
     }
-};
\ No newline at end of file
+};
@@ -0,0 +1,328 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "apu.hpp"
+#include "bus.hpp"
+#include "cart.hpp"
+#include "clock.hpp"
+#include "cpu.hpp"
+#include "hash.hpp"
+#include "input.hpp"
+#include "mapper.hpp"
+#include "ppu.hpp"
+#include "state.hpp"
+
+// https://www.nesdev.org/wiki/2A03
+// $4000-$401F are the APU, OAM DMA and the controller ports, mixed together
+// ($4016 writes strobe the controllers, $4017 writes go to the APU's frame
+// counter while reads are controller 2). The rest of the page belongs to the
+// cartridge.
+class Ports : public Mem {
+private:
+    Bus& bus;
+    Apu& apu;
+    Controllers& controllers;
+    Mem& cart;
+
+public:
+    // A write to $4014, the page to copy to OAM
+    std::function<void(uint8_t)> onOamDma;
+
+    Ports(Bus& bus, Apu& apu, Controllers& controllers, Mem& cart)
+        : bus(bus)
+        , apu(apu)
+        , controllers(controllers)
+        , cart(cart)
+    {
+    }
+
+    // Addresses are relative to $4000
+    virtual uint8_t get(uint16_t addr) override
+    {
+        if (addr == 0x15) {
+            return apu.get(addr) | (bus.data & 0x20);
+        }
+        if (addr == 0x16 || addr == 0x17) {
+            return controllers.get(addr);
+        }
+        if (addr >= 0x20) {
+            return cart.get(0x4000 | addr);
+        }
+        return bus.data; // write only, open bus
+    }
+
+    virtual void set(uint16_t addr, uint8_t value) override
+    {
+        if (addr == 0x16) {
+            controllers.set(addr, value);
+        } else if (addr == 0x14) {
+            onOamDma(value);
+        } else if (addr < 0x18) {
+            apu.set(addr, value);
+        } else if (addr >= 0x20) {
+            cart.set(0x4000 | addr, value);
+        }
+    }
+};
+
+// Everything that makes up one NES. All state lives in the instance, and the
+// only thing consoles share is the (read only) ROM, so any number of them can
+// run side by side, one per thread.
+class Console {
+private:
+    bool stopAtFrame = false;
+    std::array<uint64_t, 8> ramPageHashes {};
+    StateLayout snapshotLayout; // of snapshot(), the same every time
+
+    // The PPU runs behind the CPU: this is the master tick of its next cycle.
+    // It is caught up to the current tick when the CPU or the cartridge
+    // touches it (Ppu::onAccess), and on its own at the cycles that do
+    // something the CPU could notice without asking, the end of a frame and
+    // the NMI for example (Ppu::eventCycles). In between the clock only runs
+    // the CPU.
+    int64_t ppuTime = 0;
+
+    // Run the PPU cycles before tick until
+    void runPpu(int64_t until)
+    {
+        auto frame = ppu->frame;
+        if (ppuTime < until) {
+            auto cycles = (until - ppuTime + 3) / 4;
+            ppu->run(int(cycles));
+            ppuTime += cycles * 4;
+        }
+        if (ppu->frame != frame) {
+            apu->endFrame();
+            if (onFrame) {
+                onFrame();
+            }
+            if (stopAtFrame) {
+                clock.stop();
+            }
+        }
+    }
+
+    // https://www.nesdev.org/wiki/DMA#OAM_DMA
+    // 513 cycles, or 514 if the write was on an odd cycle. The cycle core
+    // copies a byte every other cycle like the hardware, the instruction core
+    // copies the page in one go (straight from memory if it is memory) and
+    // stalls for the same number of cycles.
+    void oamDma(uint8_t page)
+    {
+        bool odd = clock.now() / 12 & 1;
+        if (cpu.core == Cpu::Core::Cycle) {
+            cpu.oamDma(page, odd);
+            return;
+        }
+        if (auto* p = bus.readPage(page << 8)) {
+            ppu->oamDma(p);
+        } else {
+            for (int i = 0; i < 256; i++) {
+                ppu->set(4, bus.get(page << 8 | i));
+            }
+        }
+        cpu.stall(513 + odd);
+    }
+
+    void state(Serializer& s)
+    {
+        uint32_t magic = 0x5353454e; // "NESS"
+        auto version = stateVersion;
+        auto crc = romCrc;
+        uint8_t withFramebuffer = s.withFramebuffer;
+        s(magic);
+        s(version);
+        s(crc);
+        s(withFramebuffer);
+        if (!s.ok() || magic != 0x5353454e || version != stateVersion || crc != romCrc) {
+            s.fail();
+            return;
+        }
+        s.withFramebuffer = withFramebuffer;
+
+        if (!s.loading()) {
+            runPpu(clock.now());
+        }
+        cpu.state(s);
+        bus.state(s);
+        ram->state(s);
+        ppu->state(s);
+        apu->state(s);
+        controllers->state(s);
+        mapper->state(s);
+        clock.state(s);
+        s(ppuTime);
+        if (s.loading()) {
+            mapper->update();
+        }
+    }
+
+public:
+    std::shared_ptr<const Rom> cart;
+    uint32_t romCrc = 0; // of PRG and CHR, states and movies are tagged with it
+    Bus bus;
+    std::shared_ptr<Ram<2048>> ram = std::make_shared<Ram<2048>>();
+    std::shared_ptr<Ppu> ppu = std::make_shared<Ppu>();
+    std::shared_ptr<Controllers> controllers = std::make_shared<Controllers>();
+    std::shared_ptr<Apu> apu;
+    std::shared_ptr<Ports> ports;
+    std::shared_ptr<Mapper> mapper;
+    Cpu cpu { bus };
+    Clock clock;
+
+    // Called after every frame, once the APU has made the frame's samples
+    std::function<void()> onFrame;
+
+    Console(std::shared_ptr<const Rom> rom)
+        : cart(rom)
+    {
+        romCrc = crc32(cart->prg.data(), cart->prg.size(), crc32(cart->chr.data(), cart->chr.size()));
+        mapper = Mapper::create(cart, bus, *ppu);
+        if (!mapper) {
+            std::fprintf(stderr, "Mapper %d is not supported, trying NROM\n", cart->header.mapper);
+            mapper = std::make_shared<Nrom>(cart, bus, *ppu);
+        }
+        bus.map(0x0000, 0x2000, ram);
+        bus.map(0x2000, 0x4000, ppu, 0x0007);
+        apu = std::make_shared<Apu>(bus, clock);
+        ports = std::make_shared<Ports>(bus, *apu, *controllers, *mapper);
+        ports->onOamDma = [this](uint8_t page) {
+            oamDma(page);
+        };
+        bus.map(0x4000, 0x4100, ports, 0x00ff);
+        bus.map(0x4100, 0x10000, mapper);
+        mapper->cpuCycle = [this] { return clock.now() / 12; };
+        mapper->update();
+        if (mapper->countsScanlines()) {
+            ppu->onScanline = [this]() {
+                mapper->scanline();
+            };
+        }
+        ppu->interrupts = &bus.interrupts;
+        ppu->onAccess = [this]() {
+            runPpu(clock.now());
+        };
+
+        // The APU runs behind, so catch it up before the CPU could see
+        // something it did: a DMC read or the frame counter's IRQ
+        clock.addDivizor(12, [this]() {
+            auto now = clock.now() / 12;
+            if (now > apu->dmcReadCycle() || now > apu->irqCycle()) {
+                apu->sync();
+            }
+            if (apu->stolen) {
+                cpu.stall(apu->stolen);
+                apu->stolen = 0;
+            }
+            return cpu.tick();
+        });
+        clock.addDivizor(4, [this]() {
+            runPpu(clock.now() + 1);
+            return ppu->eventCycles();
+        });
+    }
+
+    // The devices hold on to each other (the CPU to the bus, the clock to all
+    // of them), so a console can't be copied or moved
+    Console(const Console&) = delete;
+    Console& operator=(const Console&) = delete;
+
+    // Run in real time, forever
+    void run()
+    {
+        stopAtFrame = false;
+        clock.run();
+    }
+
+    // Run as fast as possible until the PPU starts a new frame, or for at most
+    // the given number of master clock ticks
+    void runFrame(int64_t maxTicks = INT64_MAX / 2)
+    {
+        stopAtFrame = true;
+        clock.step(maxTicks);
+        runPpu(clock.now());
+    }
+
+    // https://www.nesdev.org/wiki/Save_state
+    // A snapshot of the whole machine, precise to the master clock tick (so
+    // also mid instruction), tagged with the ROM it belongs to. Saving into a
+    // buffer that is reused doesn't allocate. Only save or load between calls
+    // to run and runFrame. A state without the framebuffer loads with the
+    // picture the console has, until it draws the next frame.
+    static constexpr uint32_t stateVersion = 8;
+
+    void save(std::vector<uint8_t>& out, bool withFramebuffer = true)
+    {
+        out.clear();
+        Serializer s(out);
+        s.withFramebuffer = withFramebuffer;
+        state(s);
+    }
+
+    // A state without the framebuffer, for snapshots taken frame after frame
+    // (Rewind). unchanged gets the ranges of it that hold pages of RAM, PPU
+    // memory and PRG RAM not written since the previous snapshot, so they are
+    // the same bytes as in that one: none the first time, or after a load
+    // (which marks every page). The pages are taken from the console, so only
+    // one thing at a time should take snapshots of it.
+    void snapshot(std::vector<uint8_t>& out, std::vector<StateRange>& unchanged)
+    {
+        bool first = snapshotLayout.blocks.empty();
+        out.clear();
+        Serializer s(out);
+        s.withFramebuffer = false;
+        s.layout = first ? &snapshotLayout : nullptr;
+        state(s);
+        unchanged.clear();
+        ram->unwrittenPages(snapshotLayout, unchanged);
+        ppu->unwrittenPages(snapshotLayout, unchanged);
+        mapper->unwrittenPages(snapshotLayout, unchanged);
+        if (first) {
+            unchanged.clear();
+        }
+        std::sort(unchanged.begin(), unchanged.end(), [](const StateRange& a, const StateRange& b) {
+            return a.offset < b.offset;
+        });
+    }
+
+    // Returns false, leaving the console as it was, if the state is for
+    // another version or ROM. Past the header a damaged state leaves it
+    // half loaded.
+    bool load(const uint8_t* data, size_t size)
+    {
+        Serializer s(data, size);
+        state(s);
+        return s.ok();
+    }
+
+    uint64_t frame() const { return ppu->frame; }
+    bool jammed() const { return cpu.jammed; }
+    uint64_t cycles() const { return clock.now() / 12; }
+
+    struct Hashes {
+        uint64_t framebuffer;
+        uint64_t ram;
+        uint64_t ppu;
+    };
+    // RAM and PPU memory are hashed a page at a time, and only the pages
+    // written since the last call are hashed again. Cheap enough to check
+    // every frame of a movie.
+    Hashes hashes()
+    {
+        runPpu(clock.now());
+        ram->dirty.take(DirtyReader::Hashes, [this](size_t page) {
+            ramPageHashes[page] = fnv1a(ram->readPointer() + page * 256, 256);
+        });
+        return {
+            wordHash(ppu->framebuffer.data(), sizeof(ppu->framebuffer)),
+            fnv1a(ramPageHashes.data(), sizeof(ramPageHashes)),
+            ppu->hash(),
+        };
+    }
+};
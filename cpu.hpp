@@ -1,9 +1,582 @@
+#pragma once
 #include <array>
-#include <functional>
-#include <iostream>
-#include <queue>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
 
 #include "bus.hpp"
+#include "state.hpp"
+#include "trace.hpp"
+
+// Microcode
+// Every instruction is broken down into the micro-ops the 6502 performs on each
+// cycle. A micro-op consumes the result of the previous cycle's bus access
+// (bus.data) and sets up the access for the current one (bus.addr, bus.data and
+// bus.rw). The sequences are built once, at compile time, from the addressing
+// mode and the operation of each opcode, so stepping the CPU is a table lookup
+// and a switch with no allocation or indirect call.
+// https://www.nesdev.org/6502_cpu.txt
+
+// https://www.masswerk.at/6502/6502_instruction_set.html
+enum class Op : uint8_t {
+    ADC, AND, ASL, BCC, BCS, BEQ, BIT, BMI, BNE, BPL, BRK, BVC, BVS, CLC,
+    CLD, CLI, CLV, CMP, CPX, CPY, DEC, DEX, DEY, EOR, INC, INX, INY, JMP,
+    JSR, LDA, LDX, LDY, LSR, NOP, ORA, PHA, PHP, PLA, PLP, ROL, ROR, RTI,
+    RTS, SBC, SEC, SED, SEI, STA, STX, STY, TAX, TAY, TSX, TXA, TXS, TYA,
+    Illegal,
+    Reset,
+    Interrupt,
+};
+
+enum class Mode : uint8_t {
+    Implied,
+    Accumulator,
+    Immediate,
+    ZeroPage,
+    ZeroPageX,
+    ZeroPageY,
+    Absolute,
+    AbsoluteX,
+    AbsoluteY,
+    Indirect,
+    IndirectX,
+    IndirectY,
+    Relative,
+};
+
+// What an instruction does with its effective address
+enum class Kind : uint8_t {
+    Read,
+    Write,
+    Modify,
+};
+
+enum class Step : uint8_t {
+    Decode, // fetch the operand (or dummy read) and select the program for the opcode
+    Fetch, // fetch the next opcode
+    Halt,
+
+    // Single cycle operations, ending in an opcode fetch
+    Implied,
+    Accumulator,
+    Immediate,
+    Execute,
+
+    // Effective address calculation
+    ZeroPage,
+    ZeroPageBase,
+    ZeroPageX,
+    ZeroPageY,
+    AbsoluteLo,
+    AbsoluteHi,
+    AbsoluteHiX,
+    AbsoluteHiY,
+    Pointer,
+    PointerX,
+    PointerLo,
+    PointerHi,
+    PointerHiY,
+    Fixup, // redo an indexed access that crossed a page (or always for writes)
+
+    // Read-modify-write
+    DummyWrite,
+    Modify,
+
+    // Branches
+    Branch,
+    BranchTaken,
+    BranchFix,
+
+    // Jumps, subroutines and the stack
+    JumpAbsolute,
+    JumpPointer,
+    JumpPointerLo,
+    JumpIndirect,
+    JsrStack,
+    JsrHi,
+    StackDummy,
+    Pop,
+    PopPcl,
+    PullStatus,
+    Pull,
+    Push,
+    PushPch,
+    PushPcl,
+    PushStatus,
+    RtsInc,
+    ResetStack,
+    VectorLo,
+    VectorHi,
+};
+
+struct Program {
+    std::array<Step, 8> steps {};
+    Op op = Op::Illegal;
+    Kind kind = Kind::Read;
+};
+
+constexpr Kind kindOf(Op op)
+{
+    switch (op) {
+    case Op::STA:
+    case Op::STX:
+    case Op::STY:
+        return Kind::Write;
+    case Op::ASL:
+    case Op::LSR:
+    case Op::ROL:
+    case Op::ROR:
+    case Op::INC:
+    case Op::DEC:
+        return Kind::Modify;
+    default:
+        return Kind::Read;
+    }
+}
+
+constexpr Program makeProgram(Mode mode, Op op)
+{
+    Program p;
+    p.op = op;
+    p.kind = kindOf(op);
+    int n = 0;
+    auto add = [&](Step step) { p.steps[n++] = step; };
+
+    add(Step::Decode);
+    switch (op) {
+    case Op::Illegal:
+        add(Step::Halt);
+        return p;
+    case Op::Reset:
+        // Same sequence as BRK, but the stack writes are turned into reads
+        add(Step::ResetStack);
+        add(Step::ResetStack);
+        add(Step::ResetStack);
+        add(Step::VectorLo);
+        add(Step::VectorHi);
+        add(Step::JumpAbsolute);
+        return p;
+    case Op::BRK:
+    case Op::Interrupt:
+        add(Step::PushPch);
+        add(Step::PushPcl);
+        add(Step::PushStatus);
+        add(Step::VectorLo);
+        add(Step::VectorHi);
+        add(Step::JumpAbsolute);
+        return p;
+    case Op::JSR:
+        add(Step::JsrStack);
+        add(Step::PushPch);
+        add(Step::PushPcl);
+        add(Step::JsrHi);
+        add(Step::JumpAbsolute);
+        return p;
+    case Op::RTS:
+        add(Step::StackDummy);
+        add(Step::Pop);
+        add(Step::PopPcl);
+        add(Step::JumpPointer);
+        add(Step::RtsInc);
+        return p;
+    case Op::RTI:
+        add(Step::StackDummy);
+        add(Step::Pop);
+        add(Step::PullStatus);
+        add(Step::PopPcl);
+        add(Step::JumpAbsolute);
+        return p;
+    case Op::PHA:
+    case Op::PHP:
+        add(Step::Push);
+        add(Step::Fetch);
+        return p;
+    case Op::PLA:
+    case Op::PLP:
+        add(Step::StackDummy);
+        add(Step::Pop);
+        add(Step::Pull);
+        return p;
+    case Op::JMP:
+        add(Step::AbsoluteLo);
+        if (mode == Mode::Indirect) {
+            add(Step::JumpPointer);
+            add(Step::JumpPointerLo);
+            add(Step::JumpIndirect);
+        } else {
+            add(Step::JumpAbsolute);
+        }
+        return p;
+    default:
+        break;
+    }
+
+    switch (mode) {
+    case Mode::Implied:
+        add(Step::Implied);
+        return p;
+    case Mode::Accumulator:
+        add(Step::Accumulator);
+        return p;
+    case Mode::Immediate:
+        add(Step::Immediate);
+        return p;
+    case Mode::Relative:
+        add(Step::Branch);
+        add(Step::BranchTaken);
+        add(Step::BranchFix);
+        return p;
+    case Mode::ZeroPage:
+        add(Step::ZeroPage);
+        break;
+    case Mode::ZeroPageX:
+        add(Step::ZeroPageBase);
+        add(Step::ZeroPageX);
+        break;
+    case Mode::ZeroPageY:
+        add(Step::ZeroPageBase);
+        add(Step::ZeroPageY);
+        break;
+    case Mode::Absolute:
+        add(Step::AbsoluteLo);
+        add(Step::AbsoluteHi);
+        break;
+    case Mode::AbsoluteX:
+        add(Step::AbsoluteLo);
+        add(Step::AbsoluteHiX);
+        add(Step::Fixup);
+        break;
+    case Mode::AbsoluteY:
+        add(Step::AbsoluteLo);
+        add(Step::AbsoluteHiY);
+        add(Step::Fixup);
+        break;
+    case Mode::IndirectX:
+        add(Step::Pointer);
+        add(Step::PointerX);
+        add(Step::PointerLo);
+        add(Step::PointerHi);
+        break;
+    case Mode::IndirectY:
+        add(Step::Pointer);
+        add(Step::PointerLo);
+        add(Step::PointerHiY);
+        add(Step::Fixup);
+        break;
+    case Mode::Indirect:
+        add(Step::Halt);
+        return p;
+    }
+
+    switch (p.kind) {
+    case Kind::Read:
+        add(Step::Execute);
+        break;
+    case Kind::Write:
+        add(Step::Fetch);
+        break;
+    case Kind::Modify:
+        add(Step::DummyWrite);
+        add(Step::Modify);
+        add(Step::Fetch);
+        break;
+    }
+    return p;
+}
+
+struct Opcode {
+    Mode mode;
+    Op op;
+};
+
+// https://www.masswerk.at/6502/6502_instruction_set.html
+// Only the official opcodes are implemented, everything else halts the CPU
+inline constexpr std::array<Opcode, 256> opcodes = { {
+    /* 00 */ { Mode::Implied, Op::BRK },
+    /* 01 */ { Mode::IndirectX, Op::ORA },
+    /* 02 */ { Mode::Implied, Op::Illegal },
+    /* 03 */ { Mode::Implied, Op::Illegal },
+    /* 04 */ { Mode::Implied, Op::Illegal },
+    /* 05 */ { Mode::ZeroPage, Op::ORA },
+    /* 06 */ { Mode::ZeroPage, Op::ASL },
+    /* 07 */ { Mode::Implied, Op::Illegal },
+    /* 08 */ { Mode::Implied, Op::PHP },
+    /* 09 */ { Mode::Immediate, Op::ORA },
+    /* 0a */ { Mode::Accumulator, Op::ASL },
+    /* 0b */ { Mode::Implied, Op::Illegal },
+    /* 0c */ { Mode::Implied, Op::Illegal },
+    /* 0d */ { Mode::Absolute, Op::ORA },
+    /* 0e */ { Mode::Absolute, Op::ASL },
+    /* 0f */ { Mode::Implied, Op::Illegal },
+
+    /* 10 */ { Mode::Relative, Op::BPL },
+    /* 11 */ { Mode::IndirectY, Op::ORA },
+    /* 12 */ { Mode::Implied, Op::Illegal },
+    /* 13 */ { Mode::Implied, Op::Illegal },
+    /* 14 */ { Mode::Implied, Op::Illegal },
+    /* 15 */ { Mode::ZeroPageX, Op::ORA },
+    /* 16 */ { Mode::ZeroPageX, Op::ASL },
+    /* 17 */ { Mode::Implied, Op::Illegal },
+    /* 18 */ { Mode::Implied, Op::CLC },
+    /* 19 */ { Mode::AbsoluteY, Op::ORA },
+    /* 1a */ { Mode::Implied, Op::Illegal },
+    /* 1b */ { Mode::Implied, Op::Illegal },
+    /* 1c */ { Mode::Implied, Op::Illegal },
+    /* 1d */ { Mode::AbsoluteX, Op::ORA },
+    /* 1e */ { Mode::AbsoluteX, Op::ASL },
+    /* 1f */ { Mode::Implied, Op::Illegal },
+
+    /* 20 */ { Mode::Absolute, Op::JSR },
+    /* 21 */ { Mode::IndirectX, Op::AND },
+    /* 22 */ { Mode::Implied, Op::Illegal },
+    /* 23 */ { Mode::Implied, Op::Illegal },
+    /* 24 */ { Mode::ZeroPage, Op::BIT },
+    /* 25 */ { Mode::ZeroPage, Op::AND },
+    /* 26 */ { Mode::ZeroPage, Op::ROL },
+    /* 27 */ { Mode::Implied, Op::Illegal },
+    /* 28 */ { Mode::Implied, Op::PLP },
+    /* 29 */ { Mode::Immediate, Op::AND },
+    /* 2a */ { Mode::Accumulator, Op::ROL },
+    /* 2b */ { Mode::Implied, Op::Illegal },
+    /* 2c */ { Mode::Absolute, Op::BIT },
+    /* 2d */ { Mode::Absolute, Op::AND },
+    /* 2e */ { Mode::Absolute, Op::ROL },
+    /* 2f */ { Mode::Implied, Op::Illegal },
+
+    /* 30 */ { Mode::Relative, Op::BMI },
+    /* 31 */ { Mode::IndirectY, Op::AND },
+    /* 32 */ { Mode::Implied, Op::Illegal },
+    /* 33 */ { Mode::Implied, Op::Illegal },
+    /* 34 */ { Mode::Implied, Op::Illegal },
+    /* 35 */ { Mode::ZeroPageX, Op::AND },
+    /* 36 */ { Mode::ZeroPageX, Op::ROL },
+    /* 37 */ { Mode::Implied, Op::Illegal },
+    /* 38 */ { Mode::Implied, Op::SEC },
+    /* 39 */ { Mode::AbsoluteY, Op::AND },
+    /* 3a */ { Mode::Implied, Op::Illegal },
+    /* 3b */ { Mode::Implied, Op::Illegal },
+    /* 3c */ { Mode::Implied, Op::Illegal },
+    /* 3d */ { Mode::AbsoluteX, Op::AND },
+    /* 3e */ { Mode::AbsoluteX, Op::ROL },
+    /* 3f */ { Mode::Implied, Op::Illegal },
+
+    /* 40 */ { Mode::Implied, Op::RTI },
+    /* 41 */ { Mode::IndirectX, Op::EOR },
+    /* 42 */ { Mode::Implied, Op::Illegal },
+    /* 43 */ { Mode::Implied, Op::Illegal },
+    /* 44 */ { Mode::Implied, Op::Illegal },
+    /* 45 */ { Mode::ZeroPage, Op::EOR },
+    /* 46 */ { Mode::ZeroPage, Op::LSR },
+    /* 47 */ { Mode::Implied, Op::Illegal },
+    /* 48 */ { Mode::Implied, Op::PHA },
+    /* 49 */ { Mode::Immediate, Op::EOR },
+    /* 4a */ { Mode::Accumulator, Op::LSR },
+    /* 4b */ { Mode::Implied, Op::Illegal },
+    /* 4c */ { Mode::Absolute, Op::JMP },
+    /* 4d */ { Mode::Absolute, Op::EOR },
+    /* 4e */ { Mode::Absolute, Op::LSR },
+    /* 4f */ { Mode::Implied, Op::Illegal },
+
+    /* 50 */ { Mode::Relative, Op::BVC },
+    /* 51 */ { Mode::IndirectY, Op::EOR },
+    /* 52 */ { Mode::Implied, Op::Illegal },
+    /* 53 */ { Mode::Implied, Op::Illegal },
+    /* 54 */ { Mode::Implied, Op::Illegal },
+    /* 55 */ { Mode::ZeroPageX, Op::EOR },
+    /* 56 */ { Mode::ZeroPageX, Op::LSR },
+    /* 57 */ { Mode::Implied, Op::Illegal },
+    /* 58 */ { Mode::Implied, Op::CLI },
+    /* 59 */ { Mode::AbsoluteY, Op::EOR },
+    /* 5a */ { Mode::Implied, Op::Illegal },
+    /* 5b */ { Mode::Implied, Op::Illegal },
+    /* 5c */ { Mode::Implied, Op::Illegal },
+    /* 5d */ { Mode::AbsoluteX, Op::EOR },
+    /* 5e */ { Mode::AbsoluteX, Op::LSR },
+    /* 5f */ { Mode::Implied, Op::Illegal },
+
+    /* 60 */ { Mode::Implied, Op::RTS },
+    /* 61 */ { Mode::IndirectX, Op::ADC },
+    /* 62 */ { Mode::Implied, Op::Illegal },
+    /* 63 */ { Mode::Implied, Op::Illegal },
+    /* 64 */ { Mode::Implied, Op::Illegal },
+    /* 65 */ { Mode::ZeroPage, Op::ADC },
+    /* 66 */ { Mode::ZeroPage, Op::ROR },
+    /* 67 */ { Mode::Implied, Op::Illegal },
+    /* 68 */ { Mode::Implied, Op::PLA },
+    /* 69 */ { Mode::Immediate, Op::ADC },
+    /* 6a */ { Mode::Accumulator, Op::ROR },
+    /* 6b */ { Mode::Implied, Op::Illegal },
+    /* 6c */ { Mode::Indirect, Op::JMP },
+    /* 6d */ { Mode::Absolute, Op::ADC },
+    /* 6e */ { Mode::Absolute, Op::ROR },
+    /* 6f */ { Mode::Implied, Op::Illegal },
+
+    /* 70 */ { Mode::Relative, Op::BVS },
+    /* 71 */ { Mode::IndirectY, Op::ADC },
+    /* 72 */ { Mode::Implied, Op::Illegal },
+    /* 73 */ { Mode::Implied, Op::Illegal },
+    /* 74 */ { Mode::Implied, Op::Illegal },
+    /* 75 */ { Mode::ZeroPageX, Op::ADC },
+    /* 76 */ { Mode::ZeroPageX, Op::ROR },
+    /* 77 */ { Mode::Implied, Op::Illegal },
+    /* 78 */ { Mode::Implied, Op::SEI },
+    /* 79 */ { Mode::AbsoluteY, Op::ADC },
+    /* 7a */ { Mode::Implied, Op::Illegal },
+    /* 7b */ { Mode::Implied, Op::Illegal },
+    /* 7c */ { Mode::Implied, Op::Illegal },
+    /* 7d */ { Mode::AbsoluteX, Op::ADC },
+    /* 7e */ { Mode::AbsoluteX, Op::ROR },
+    /* 7f */ { Mode::Implied, Op::Illegal },
+
+    /* 80 */ { Mode::Implied, Op::Illegal },
+    /* 81 */ { Mode::IndirectX, Op::STA },
+    /* 82 */ { Mode::Implied, Op::Illegal },
+    /* 83 */ { Mode::Implied, Op::Illegal },
+    /* 84 */ { Mode::ZeroPage, Op::STY },
+    /* 85 */ { Mode::ZeroPage, Op::STA },
+    /* 86 */ { Mode::ZeroPage, Op::STX },
+    /* 87 */ { Mode::Implied, Op::Illegal },
+    /* 88 */ { Mode::Implied, Op::DEY },
+    /* 89 */ { Mode::Implied, Op::Illegal },
+    /* 8a */ { Mode::Implied, Op::TXA },
+    /* 8b */ { Mode::Implied, Op::Illegal },
+    /* 8c */ { Mode::Absolute, Op::STY },
+    /* 8d */ { Mode::Absolute, Op::STA },
+    /* 8e */ { Mode::Absolute, Op::STX },
+    /* 8f */ { Mode::Implied, Op::Illegal },
+
+    /* 90 */ { Mode::Relative, Op::BCC },
+    /* 91 */ { Mode::IndirectY, Op::STA },
+    /* 92 */ { Mode::Implied, Op::Illegal },
+    /* 93 */ { Mode::Implied, Op::Illegal },
+    /* 94 */ { Mode::ZeroPageX, Op::STY },
+    /* 95 */ { Mode::ZeroPageX, Op::STA },
+    /* 96 */ { Mode::ZeroPageY, Op::STX },
+    /* 97 */ { Mode::Implied, Op::Illegal },
+    /* 98 */ { Mode::Implied, Op::TYA },
+    /* 99 */ { Mode::AbsoluteY, Op::STA },
+    /* 9a */ { Mode::Implied, Op::TXS },
+    /* 9b */ { Mode::Implied, Op::Illegal },
+    /* 9c */ { Mode::Implied, Op::Illegal },
+    /* 9d */ { Mode::AbsoluteX, Op::STA },
+    /* 9e */ { Mode::Implied, Op::Illegal },
+    /* 9f */ { Mode::Implied, Op::Illegal },
+
+    /* a0 */ { Mode::Immediate, Op::LDY },
+    /* a1 */ { Mode::IndirectX, Op::LDA },
+    /* a2 */ { Mode::Immediate, Op::LDX },
+    /* a3 */ { Mode::Implied, Op::Illegal },
+    /* a4 */ { Mode::ZeroPage, Op::LDY },
+    /* a5 */ { Mode::ZeroPage, Op::LDA },
+    /* a6 */ { Mode::ZeroPage, Op::LDX },
+    /* a7 */ { Mode::Implied, Op::Illegal },
+    /* a8 */ { Mode::Implied, Op::TAY },
+    /* a9 */ { Mode::Immediate, Op::LDA },
+    /* aa */ { Mode::Implied, Op::TAX },
+    /* ab */ { Mode::Implied, Op::Illegal },
+    /* ac */ { Mode::Absolute, Op::LDY },
+    /* ad */ { Mode::Absolute, Op::LDA },
+    /* ae */ { Mode::Absolute, Op::LDX },
+    /* af */ { Mode::Implied, Op::Illegal },
+
+    /* b0 */ { Mode::Relative, Op::BCS },
+    /* b1 */ { Mode::IndirectY, Op::LDA },
+    /* b2 */ { Mode::Implied, Op::Illegal },
+    /* b3 */ { Mode::Implied, Op::Illegal },
+    /* b4 */ { Mode::ZeroPageX, Op::LDY },
+    /* b5 */ { Mode::ZeroPageX, Op::LDA },
+    /* b6 */ { Mode::ZeroPageY, Op::LDX },
+    /* b7 */ { Mode::Implied, Op::Illegal },
+    /* b8 */ { Mode::Implied, Op::CLV },
+    /* b9 */ { Mode::AbsoluteY, Op::LDA },
+    /* ba */ { Mode::Implied, Op::TSX },
+    /* bb */ { Mode::Implied, Op::Illegal },
+    /* bc */ { Mode::AbsoluteX, Op::LDY },
+    /* bd */ { Mode::AbsoluteX, Op::LDA },
+    /* be */ { Mode::AbsoluteY, Op::LDX },
+    /* bf */ { Mode::Implied, Op::Illegal },
+
+    /* c0 */ { Mode::Immediate, Op::CPY },
+    /* c1 */ { Mode::IndirectX, Op::CMP },
+    /* c2 */ { Mode::Implied, Op::Illegal },
+    /* c3 */ { Mode::Implied, Op::Illegal },
+    /* c4 */ { Mode::ZeroPage, Op::CPY },
+    /* c5 */ { Mode::ZeroPage, Op::CMP },
+    /* c6 */ { Mode::ZeroPage, Op::DEC },
+    /* c7 */ { Mode::Implied, Op::Illegal },
+    /* c8 */ { Mode::Implied, Op::INY },
+    /* c9 */ { Mode::Immediate, Op::CMP },
+    /* ca */ { Mode::Implied, Op::DEX },
+    /* cb */ { Mode::Implied, Op::Illegal },
+    /* cc */ { Mode::Absolute, Op::CPY },
+    /* cd */ { Mode::Absolute, Op::CMP },
+    /* ce */ { Mode::Absolute, Op::DEC },
+    /* cf */ { Mode::Implied, Op::Illegal },
+
+    /* d0 */ { Mode::Relative, Op::BNE },
+    /* d1 */ { Mode::IndirectY, Op::CMP },
+    /* d2 */ { Mode::Implied, Op::Illegal },
+    /* d3 */ { Mode::Implied, Op::Illegal },
+    /* d4 */ { Mode::Implied, Op::Illegal },
+    /* d5 */ { Mode::ZeroPageX, Op::CMP },
+    /* d6 */ { Mode::ZeroPageX, Op::DEC },
+    /* d7 */ { Mode::Implied, Op::Illegal },
+    /* d8 */ { Mode::Implied, Op::CLD },
+    /* d9 */ { Mode::AbsoluteY, Op::CMP },
+    /* da */ { Mode::Implied, Op::Illegal },
+    /* db */ { Mode::Implied, Op::Illegal },
+    /* dc */ { Mode::Implied, Op::Illegal },
+    /* dd */ { Mode::AbsoluteX, Op::CMP },
+    /* de */ { Mode::AbsoluteX, Op::DEC },
+    /* df */ { Mode::Implied, Op::Illegal },
+
+    /* e0 */ { Mode::Immediate, Op::CPX },
+    /* e1 */ { Mode::IndirectX, Op::SBC },
+    /* e2 */ { Mode::Implied, Op::Illegal },
+    /* e3 */ { Mode::Implied, Op::Illegal },
+    /* e4 */ { Mode::ZeroPage, Op::CPX },
+    /* e5 */ { Mode::ZeroPage, Op::SBC },
+    /* e6 */ { Mode::ZeroPage, Op::INC },
+    /* e7 */ { Mode::Implied, Op::Illegal },
+    /* e8 */ { Mode::Implied, Op::INX },
+    /* e9 */ { Mode::Immediate, Op::SBC },
+    /* ea */ { Mode::Implied, Op::NOP },
+    /* eb */ { Mode::Implied, Op::Illegal },
+    /* ec */ { Mode::Absolute, Op::CPX },
+    /* ed */ { Mode::Absolute, Op::SBC },
+    /* ee */ { Mode::Absolute, Op::INC },
+    /* ef */ { Mode::Implied, Op::Illegal },
+
+    /* f0 */ { Mode::Relative, Op::BEQ },
+    /* f1 */ { Mode::IndirectY, Op::SBC },
+    /* f2 */ { Mode::Implied, Op::Illegal },
+    /* f3 */ { Mode::Implied, Op::Illegal },
+    /* f4 */ { Mode::Implied, Op::Illegal },
+    /* f5 */ { Mode::ZeroPageX, Op::SBC },
+    /* f6 */ { Mode::ZeroPageX, Op::INC },
+    /* f7 */ { Mode::Implied, Op::Illegal },
+    /* f8 */ { Mode::Implied, Op::SED },
+    /* f9 */ { Mode::AbsoluteY, Op::SBC },
+    /* fa */ { Mode::Implied, Op::Illegal },
+    /* fb */ { Mode::Implied, Op::Illegal },
+    /* fc */ { Mode::Implied, Op::Illegal },
+    /* fd */ { Mode::AbsoluteX, Op::SBC },
+    /* fe */ { Mode::AbsoluteX, Op::INC },
+    /* ff */ { Mode::Implied, Op::Illegal },
+} };
+
+// One program per opcode, followed by the programs the CPU runs on its own
+inline constexpr uint16_t ResetProgram = 256;
+inline constexpr uint16_t InterruptProgram = 257; // NMI and IRQ
+inline constexpr std::array<Program, 258> programs = [] {
+    std::array<Program, 258> p {};
+    for (int i = 0; i < 256; i++) {
+        p[i] = makeProgram(opcodes[i].mode, opcodes[i].op);
+    }
+    p[ResetProgram] = makeProgram(Mode::Implied, Op::Reset);
+    p[InterruptProgram] = makeProgram(Mode::Implied, Op::Interrupt);
+    return p;
+}();
 
 class Cpu {
 public:
@@ -53,687 +626,755 @@ public:
     };
     bool getFlag(uint8_t flag) { return !!(Status & flag); }
     void setFlag(uint8_t flag, bool value) { Status = value ? Status | flag : Status & ~flag; }
-
-    // void setFlags(uint16_t value)
-    // {
-    //     setFlag(Negative, value & 0x80);
-    //     setFlag(Zero, (value & 0xff) == 0);
-    //     setFlag(Carry, value > 255);
-    //     // setFlaf(Overflow );// TODO
-    // }
+    void setZeroNegative(uint8_t value)
+    {
+        setFlag(Zero, value == 0);
+        setFlag(Negative, value & 0b10000000);
+    }
 
     const uint16_t stackBase = 0x0100;
 
 public:
-    // Microcode
-    // This queue is used to store the microcode that will be executed
-    // by the CPU. The microcode is a sequence of functions that will be
-    // executed one per cycle to perform the instruction. Each microcode
-    // instructiontakes exactly 1 cycle to execute.
-    // TODO use faster primitives than std::function and std::queue
-    using inst = std::function<void()>;
-    std::queue<inst> microcode;
-
-    // The ISA is implemented as a sequence of functions that
-    // expand the microcode queue with the steps for each
-    // instruction. The instruction fetch and decode
-    // consumes 1 cycle, so the number microcode instructions
-    // added to the queue is the number of cycles the
-    // instruction takes execute minus 1.
-
-    // https://www.masswerk.at/6502/6502_instruction_set.html
-    std::array<std::function<void()>, 256> isa = {
-        /* 00 */ [&] { std::fprintf(stderr, "Instruction 00 not implemented\n"); printState(); exit(1); },
-        /* 01 */ [&] { std::fprintf(stderr, "Instruction 01 not implemented\n"); printState(); exit(1); },
-        /* 02 */ [&] { std::fprintf(stderr, "Instruction 02 not implemented\n"); printState(); exit(1); },
-        /* 03 */ [&] { std::fprintf(stderr, "Instruction 03 not implemented\n"); printState(); exit(1); },
-        /* 04 */ [&] { std::fprintf(stderr, "Instruction 04 not implemented\n"); printState(); exit(1); },
-        /* 05 */ [&] { std::fprintf(stderr, "Instruction 05 not implemented\n"); printState(); exit(1); },
-        /* 06 */ [&] { std::fprintf(stderr, "Instruction 06 not implemented\n"); printState(); exit(1); },
-        /* 07 */ [&] { std::fprintf(stderr, "Instruction 07 not implemented\n"); printState(); exit(1); },
-        /* 08 */ [&] { std::fprintf(stderr, "Instruction 08 not implemented\n"); printState(); exit(1); },
-        /* 09 */ [&] { std::fprintf(stderr, "Instruction 09 not implemented\n"); printState(); exit(1); },
-        /* 0a */ [&] { std::fprintf(stderr, "Instruction 0a not implemented\n"); printState(); exit(1); },
-        /* 0b */ [&] { std::fprintf(stderr, "Instruction 0b not implemented\n"); printState(); exit(1); },
-        /* 0c */ [&] { std::fprintf(stderr, "Instruction 0c not implemented\n"); printState(); exit(1); },
-        /* 0d */ [&] { std::fprintf(stderr, "Instruction 0d not implemented\n"); printState(); exit(1); },
-        /* 0e */ [&] { std::fprintf(stderr, "Instruction 0e not implemented\n"); printState(); exit(1); },
-        /* 0f */ [&] { std::fprintf(stderr, "Instruction 0f not implemented\n"); printState(); exit(1); },
-
-        /* 10 */ [&] {
-            // BPL - Branch on PLus
-            // branch on N = 0
-            // N	Z	C	I	D	V
-            // -	-	-	-	-	-
-            // addressing	assembler	opc	bytes	cycles
-            // relative	BPL oper	    10	2	    Branching2**
-            // ** add 1 to cycles if branch occurs on same page
-            // ** add 2 to cycles if branch occurs to different page
-
-            microcode.emplace([&] { bus.addr = ProgramCounter++; });
-            if (!getFlag(Negative)) {
-                microcode.emplace([&] { ProgramCounter += int8_t(bus.data);
-                std::fprintf(stderr, "Branching to %04x\n", ProgramCounter);
-                });
-                // if (bus.addr & 0xff00 != ProgramCounter & 0xff00) { // TODO this is almost certainly wrong!
-                //     microcode.emplace([] {}); // add 2 to cycles if branch occurs to different page
-                // }
+    // Microcode state
+    // program is the opcode being executed (or one of the programs the CPU
+    // runs on its own, like reset), and step the next micro-op in it. The
+    // remaining members are the internal latches the micro-ops use to carry
+    // values from one cycle to the next.
+    uint16_t program = ResetProgram;
+    uint8_t step = 1;
+    uint16_t address = 0; // effective address
+    uint16_t vector = 0xfffc;
+    uint8_t pointer = 0; // zero page pointer
+    uint8_t value = 0;
+
+    // https://www.nesdev.org/wiki/Visual6502wiki/6502_Timing_States
+    // An opcode that isn't implemented jams the CPU, like the 6502's KIL
+    // opcodes: it stops fetching and ignores interrupts, until power off. The
+    // rest of the machine keeps running.
+    bool jammed = false;
+
+    // https://www.nesdev.org/wiki/CPU_interrupts
+    // /NMI is edge sensitive: the detector samples it every cycle and
+    // remembers a new assertion until the NMI is taken. /IRQ is level
+    // sensitive and masked by the I flag. Both are polled on the cycle before
+    // the last of every instruction, and if one is pending the next opcode
+    // fetch is thrown away and the interrupt sequence runs instead.
+    bool nmiLine = false; // /NMI as of the last sample
+    bool nmiPending = false;
+    bool polled = false; // the poll of the previous cycle
+    bool interrupt = false; // the next instruction is replaced
+
+    // Execution cores
+    // Cycle runs one micro-op per CPU cycle, with every bus access visible to
+    // the rest of the system. Instruction runs a whole instruction at a time,
+    // which is much faster but only lines up with the other devices between
+    // instructions. Both share all of the state above, and the core can be
+    // changed at any time; a new core takes over at the next instruction.
+    // On plain memory the two agree on every register, memory byte and cycle
+    // count (test.cpp checks it). With devices on the bus they drift apart:
+    // - Interrupts: the instruction core polls the lines as they were when
+    //   the instruction started, not on its next to last cycle, so an NMI or
+    //   IRQ raised during an instruction is taken an instruction later, and
+    //   the flags it pushes can differ.
+    // - Bus timing: every access of an instruction happens before the other
+    //   devices run its cycles, so a register read or write lands up to 6
+    //   cycles early. The dummy reads (of operands, the stack and the wrong
+    //   page of an indexed access) aren't done at all, only the dummy write of
+    //   read-modify-write instructions, which mappers can see.
+    enum class Core {
+        Cycle,
+        Instruction,
+    };
+    Core core = Core::Cycle;
+
+    // https://www.nesdev.org/wiki/DMA
+    // DMA takes the bus away from the CPU. A stall is cycles the CPU just
+    // loses. An OAM DMA run by the cycle core also does the copy: a wait
+    // cycle, one more to get the reads onto even cycles, then a read of the
+    // page and a write to OAMDATA for each byte.
+    void stall(int cycles) { stallCycles += cycles; }
+    void oamDma(uint8_t page, bool oddCycle)
+    {
+        dmaPage = page;
+        dmaCycles = 513 + oddCycle;
+    }
+
+    // Everything but the core choice, including the position inside the
+    // current instruction, so a state can be restored between any two cycles
+    void state(Serializer& s)
+    {
+        s(ProgramCounter);
+        s(Accumulator);
+        s(Xregister);
+        s(Yregister);
+        s(StackPointer);
+        s(Status);
+        s(program);
+        s(step);
+        s(address);
+        s(vector);
+        s(pointer);
+        s(value);
+        s(jammed);
+        s(nmiLine);
+        s(nmiPending);
+        s(polled);
+        s(interrupt);
+        s(stallCycles);
+        s(dmaCycles);
+        s(dmaPage);
+        s(dmaValue);
+    }
+
+private:
+    int stallCycles = 0;
+    uint16_t dmaCycles = 0; // left of an OAM DMA
+    uint8_t dmaPage = 0;
+    uint8_t dmaValue = 0;
+
+    void dmaCycle()
+    {
+        if (dmaCycles <= 512) {
+            auto i = 512 - dmaCycles;
+            if (i & 1) {
+                bus.set(0x2004, dmaValue);
+            } else {
+                dmaValue = bus.get(dmaPage << 8 | i >> 1);
             }
-            microcode.emplace([&] { bus.addr = ProgramCounter; bus.rw = Bus::READ; }); },
-        /* 11 */ [&] { std::fprintf(stderr, "Instruction 11 not implemented\n"); printState(); exit(1); },
-        /* 12 */ [&] { std::fprintf(stderr, "Instruction 12 not implemented\n"); printState(); exit(1); },
-        /* 13 */ [&] { std::fprintf(stderr, "Instruction 13 not implemented\n"); printState(); exit(1); },
-        /* 14 */ [&] { std::fprintf(stderr, "Instruction 14 not implemented\n"); printState(); exit(1); },
-        /* 15 */ [&] { std::fprintf(stderr, "Instruction 15 not implemented\n"); printState(); exit(1); },
-        /* 16 */ [&] { std::fprintf(stderr, "Instruction 16 not implemented\n"); printState(); exit(1); },
-        /* 17 */ [&] { std::fprintf(stderr, "Instruction 17 not implemented\n"); printState(); exit(1); },
-        /* 18 */ [&] { std::fprintf(stderr, "Instruction 18 not implemented\n"); printState(); exit(1); },
-        /* 19 */ [&] { std::fprintf(stderr, "Instruction 19 not implemented\n"); printState(); exit(1); },
-        /* 1a */ [&] { std::fprintf(stderr, "Instruction 1a not implemented\n"); printState(); exit(1); },
-        /* 1b */ [&] { std::fprintf(stderr, "Instruction 1b not implemented\n"); printState(); exit(1); },
-        /* 1c */ [&] { std::fprintf(stderr, "Instruction 1c not implemented\n"); printState(); exit(1); },
-        /* 1d */ [&] { std::fprintf(stderr, "Instruction 1d not implemented\n"); printState(); exit(1); },
-        /* 1e */ [&] { std::fprintf(stderr, "Instruction 1e not implemented\n"); printState(); exit(1); },
-        /* 1f */ [&] { std::fprintf(stderr, "Instruction 1f not implemented\n"); printState(); exit(1); },
-
-        /* 20 */ [&] {
-            // JSR - Jump to New Location Saving Return Address
-            // push (PC+2),
-            // (PC+1) -> PCL
-            // (PC+2) -> PCH
-            // N	Z	C	I	D	V
-            // -	-	-	-	-	-
-            // addressing	assembler	opc	bytes	cycles
-            // absolute	JSR oper	    20	3	    6
-            static uint16_t addr = 0;
-            microcode.emplace([&] { bus.addr = ProgramCounter++; });
-            microcode.emplace([&] { bus.addr = ProgramCounter++; addr = bus.data; });
-            microcode.emplace([&] { addr += bus.data << 8; });
-            microcode.emplace([&] { bus.addr = stackBase + StackPointer--; bus.data = ProgramCounter >> 8; bus.rw = Bus::WRITE; });
-            microcode.emplace([&] { bus.addr = stackBase + StackPointer--; bus.data = ProgramCounter; bus.rw = Bus::WRITE;; });
-            microcode.emplace([&] { bus.addr = ProgramCounter = addr; bus.rw = Bus::READ;}); },
-        /* 21 */ [&] { std::fprintf(stderr, "Instruction 21 not implemented\n"); printState(); exit(1); },
-        /* 22 */ [&] { std::fprintf(stderr, "Instruction 22 not implemented\n"); printState(); exit(1); },
-        /* 23 */ [&] { std::fprintf(stderr, "Instruction 23 not implemented\n"); printState(); exit(1); },
-        /* 24 */ [&] { std::fprintf(stderr, "Instruction 24 not implemented\n"); printState(); exit(1); },
-        /* 25 */ [&] { std::fprintf(stderr, "Instruction 25 not implemented\n"); printState(); exit(1); },
-        /* 26 */ [&] { std::fprintf(stderr, "Instruction 26 not implemented\n"); printState(); exit(1); },
-        /* 27 */ [&] { std::fprintf(stderr, "Instruction 27 not implemented\n"); printState(); exit(1); },
-        /* 28 */ [&] { std::fprintf(stderr, "Instruction 28 not implemented\n"); printState(); exit(1); },
-        /* 29 */ [&] { std::fprintf(stderr, "Instruction 29 not implemented\n"); printState(); exit(1); },
-        /* 2a */ [&] { std::fprintf(stderr, "Instruction 2a not implemented\n"); printState(); exit(1); },
-        /* 2b */ [&] { std::fprintf(stderr, "Instruction 2b not implemented\n"); printState(); exit(1); },
-        /* 2c */ [&] { std::fprintf(stderr, "Instruction 2c not implemented\n"); printState(); exit(1); },
-        /* 2d */ [&] { std::fprintf(stderr, "Instruction 2d not implemented\n"); printState(); exit(1); },
-        /* 2e */ [&] { std::fprintf(stderr, "Instruction 2e not implemented\n"); printState(); exit(1); },
-        /* 2f */ [&] { std::fprintf(stderr, "Instruction 2f not implemented\n"); printState(); exit(1); },
-
-        /* 30 */ [&] { std::fprintf(stderr, "Instruction 30 not implemented\n"); printState(); exit(1); },
-        /* 31 */ [&] { std::fprintf(stderr, "Instruction 31 not implemented\n"); printState(); exit(1); },
-        /* 32 */ [&] { std::fprintf(stderr, "Instruction 32 not implemented\n"); printState(); exit(1); },
-        /* 33 */ [&] { std::fprintf(stderr, "Instruction 33 not implemented\n"); printState(); exit(1); },
-        /* 34 */ [&] { std::fprintf(stderr, "Instruction 34 not implemented\n"); printState(); exit(1); },
-        /* 35 */ [&] { std::fprintf(stderr, "Instruction 35 not implemented\n"); printState(); exit(1); },
-        /* 36 */ [&] { std::fprintf(stderr, "Instruction 36 not implemented\n"); printState(); exit(1); },
-        /* 37 */ [&] { std::fprintf(stderr, "Instruction 37 not implemented\n"); printState(); exit(1); },
-        /* 38 */ [&] { std::fprintf(stderr, "Instruction 38 not implemented\n"); printState(); exit(1); },
-        /* 39 */ [&] { std::fprintf(stderr, "Instruction 39 not implemented\n"); printState(); exit(1); },
-        /* 3a */ [&] { std::fprintf(stderr, "Instruction 3a not implemented\n"); printState(); exit(1); },
-        /* 3b */ [&] { std::fprintf(stderr, "Instruction 3b not implemented\n"); printState(); exit(1); },
-        /* 3c */ [&] { std::fprintf(stderr, "Instruction 3c not implemented\n"); printState(); exit(1); },
-        /* 3d */ [&] { std::fprintf(stderr, "Instruction 3d not implemented\n"); printState(); exit(1); },
-        /* 3e */ [&] { std::fprintf(stderr, "Instruction 3e not implemented\n"); printState(); exit(1); },
-        /* 3f */ [&] { std::fprintf(stderr, "Instruction 3f not implemented\n"); printState(); exit(1); },
-
-        /* 40 */ [&] { std::fprintf(stderr, "Instruction 40 not implemented\n"); printState(); exit(1); },
-        /* 41 */ [&] { std::fprintf(stderr, "Instruction 41 not implemented\n"); printState(); exit(1); },
-        /* 42 */ [&] { std::fprintf(stderr, "Instruction 42 not implemented\n"); printState(); exit(1); },
-        /* 43 */ [&] { std::fprintf(stderr, "Instruction 43 not implemented\n"); printState(); exit(1); },
-        /* 44 */ [&] { std::fprintf(stderr, "Instruction 44 not implemented\n"); printState(); exit(1); },
-        /* 45 */ [&] { std::fprintf(stderr, "Instruction 45 not implemented\n"); printState(); exit(1); },
-        /* 46 */ [&] { std::fprintf(stderr, "Instruction 46 not implemented\n"); printState(); exit(1); },
-        /* 47 */ [&] { std::fprintf(stderr, "Instruction 47 not implemented\n"); printState(); exit(1); },
-        /* 48 */ [&] { std::fprintf(stderr, "Instruction 48 not implemented\n"); printState(); exit(1); },
-        /* 49 */ [&] { std::fprintf(stderr, "Instruction 49 not implemented\n"); printState(); exit(1); },
-        /* 4a */ [&] { std::fprintf(stderr, "Instruction 4a not implemented\n"); printState(); exit(1); },
-        /* 4b */ [&] { std::fprintf(stderr, "Instruction 4b not implemented\n"); printState(); exit(1); },
-        /* 4c */ [&] { std::fprintf(stderr, "Instruction 4c not implemented\n"); printState(); exit(1); },
-        /* 4d */ [&] { std::fprintf(stderr, "Instruction 4d not implemented\n"); printState(); exit(1); },
-        /* 4e */ [&] { std::fprintf(stderr, "Instruction 4e not implemented\n"); printState(); exit(1); },
-        /* 4f */ [&] { std::fprintf(stderr, "Instruction 4f not implemented\n"); printState(); exit(1); },
-
-        /* 50 */ [&] { std::fprintf(stderr, "Instruction 50 not implemented\n"); printState(); exit(1); },
-        /* 51 */ [&] { std::fprintf(stderr, "Instruction 51 not implemented\n"); printState(); exit(1); },
-        /* 52 */ [&] { std::fprintf(stderr, "Instruction 52 not implemented\n"); printState(); exit(1); },
-        /* 53 */ [&] { std::fprintf(stderr, "Instruction 53 not implemented\n"); printState(); exit(1); },
-        /* 54 */ [&] { std::fprintf(stderr, "Instruction 54 not implemented\n"); printState(); exit(1); },
-        /* 55 */ [&] { std::fprintf(stderr, "Instruction 55 not implemented\n"); printState(); exit(1); },
-        /* 56 */ [&] { std::fprintf(stderr, "Instruction 56 not implemented\n"); printState(); exit(1); },
-        /* 57 */ [&] { std::fprintf(stderr, "Instruction 57 not implemented\n"); printState(); exit(1); },
-        /* 58 */ [&] { std::fprintf(stderr, "Instruction 58 not implemented\n"); printState(); exit(1); },
-        /* 59 */ [&] { std::fprintf(stderr, "Instruction 59 not implemented\n"); printState(); exit(1); },
-        /* 5a */ [&] { std::fprintf(stderr, "Instruction 5a not implemented\n"); printState(); exit(1); },
-        /* 5b */ [&] { std::fprintf(stderr, "Instruction 5b not implemented\n"); printState(); exit(1); },
-        /* 5c */ [&] { std::fprintf(stderr, "Instruction 5c not implemented\n"); printState(); exit(1); },
-        /* 5d */ [&] { std::fprintf(stderr, "Instruction 5d not implemented\n"); printState(); exit(1); },
-        /* 5e */ [&] { std::fprintf(stderr, "Instruction 5e not implemented\n"); printState(); exit(1); },
-        /* 5f */ [&] { std::fprintf(stderr, "Instruction 5f not implemented\n"); printState(); exit(1); },
-
-        /* 60 */ [&] {
-            // RTS - Return from Subroutine
-            // pull PC, PC+1 -> PC
-            // N	Z	C	I	D	V
-            // -	-	-	-	-	-
-            // addressing	assembler	opc	bytes	cycles
-            // implied	    RTS	        60	1	    6
-            static uint8_t lo = 0;
-            microcode.emplace([&] { bus.addr = stackBase + (++StackPointer); });
-            microcode.emplace([&] { bus.addr = stackBase + (++StackPointer); lo = bus.data; });
-            microcode.emplace([&] { ProgramCounter = (bus.data << 8) + lo; });
-            microcode.emplace([&] {  });
-            microcode.emplace([&] {  });
-            microcode.emplace([&] { bus.addr = ProgramCounter; }); },
-        /* 61 */ [&] { std::fprintf(stderr, "Instruction 61 not implemented\n"); printState(); exit(1); },
-        /* 62 */ [&] { std::fprintf(stderr, "Instruction 62 not implemented\n"); printState(); exit(1); },
-        /* 63 */ [&] { std::fprintf(stderr, "Instruction 63 not implemented\n"); printState(); exit(1); },
-        /* 64 */ [&] { std::fprintf(stderr, "Instruction 64 not implemented\n"); printState(); exit(1); },
-        /* 65 */ [&] {
-            // ADC - Add Memory to Accumulator with Carry
-            // A + M + C -> A, C
-            // N Z	C	I	D	V
-            // + +	+	-	-	+
-            // addressing	assembler	opc	bytes	cycles
-            // zeropage	ADC oper	    65	2	    3
-            microcode.emplace([&] { bus.addr = ProgramCounter++; });
-            microcode.emplace([&] { bus.addr = bus.data; });
-            microcode.emplace([&] {
-                uint16_t temp = Accumulator + bus.data + getFlag(Carry);
-                setFlag(Carry, temp > 255);
-                setFlag(Zero, (temp & 0xff) == 0);
-                setFlag(Negative, temp & 0b10000000);
-                setFlag(Overflow, (Accumulator ^ bus.data) & 0x80 && (Accumulator ^ temp) & 0x80); // TODO double check this!
-                Accumulator = temp & 0xff;
-                bus.addr = ProgramCounter, bus.rw = Bus::READ;
-            }); },
-        /* 66 */ [&] { std::fprintf(stderr, "Instruction 66 not implemented\n"); printState(); exit(1); },
-        /* 67 */ [&] { std::fprintf(stderr, "Instruction 67 not implemented\n"); printState(); exit(1); },
-        /* 68 */ [&] { std::fprintf(stderr, "Instruction 68 not implemented\n"); printState(); exit(1); },
-        /* 69 */ [&] {
-            // ADC - Add Memory to Accumulator with Carry
-            // A + M + C -> A, C
-            // N	Z	C	I	D	V
-            // +	+	+	-	-	+
-            // addressing	assembler	opc	bytes	cycles
-            // immediate	ADC #oper	69	2	    2
-            microcode.emplace([&] { bus.addr = ProgramCounter++; });
-            microcode.emplace([&] {
-                uint16_t temp = Accumulator + bus.data + getFlag(Carry);
-                setFlag(Carry, temp > 255);
-                setFlag(Zero, (temp & 0xff) == 0);
-                setFlag(Negative, temp & 0b10000000);
-                setFlag(Overflow, (Accumulator ^ bus.data) & 0x80 && (Accumulator ^ temp) & 0x80); // TODO double check this!
-                Accumulator = temp & 0xff;
-                bus.addr = ProgramCounter; bus.rw = Bus::READ;
-            }); },
-        /* 6a */ [&] { std::fprintf(stderr, "Instruction 6a not implemented\n"); printState(); exit(1); },
-        /* 6b */ [&] { std::fprintf(stderr, "Instruction 6b not implemented\n"); printState(); exit(1); },
-        /* 6c */ [&] { std::fprintf(stderr, "Instruction 6c not implemented\n"); printState(); exit(1); },
-        /* 6d */ [&] { std::fprintf(stderr, "Instruction 6d not implemented\n"); printState(); exit(1); },
-        /* 6e */ [&] { std::fprintf(stderr, "Instruction 6e not implemented\n"); printState(); exit(1); },
-        /* 6f */ [&] { std::fprintf(stderr, "Instruction 6f not implemented\n"); printState(); exit(1); },
-
-        /* 70 */ [&] { std::fprintf(stderr, "Instruction 70 not implemented\n"); printState(); exit(1); },
-        /* 71 */ [&] { std::fprintf(stderr, "Instruction 71 not implemented\n"); printState(); exit(1); },
-        /* 72 */ [&] { std::fprintf(stderr, "Instruction 72 not implemented\n"); printState(); exit(1); },
-        /* 73 */ [&] { std::fprintf(stderr, "Instruction 73 not implemented\n"); printState(); exit(1); },
-        /* 74 */ [&] { std::fprintf(stderr, "Instruction 74 not implemented\n"); printState(); exit(1); },
-        /* 75 */ [&] { std::fprintf(stderr, "Instruction 75 not implemented\n"); printState(); exit(1); },
-        /* 76 */ [&] { std::fprintf(stderr, "Instruction 76 not implemented\n"); printState(); exit(1); },
-        /* 77 */ [&] { std::fprintf(stderr, "Instruction 77 not implemented\n"); printState(); exit(1); },
-        /* 78 */ [&] {
-            // SEI - Set Interrupt Disable Status
-            // 1 -> I
-            // N	Z	C	I	D	V
-            // -	-	-	1	-	-
-            // addressing	assembler	opc	bytes	cycles
-            // implied	    SEI	        78	1	    2
-            microcode.emplace([&] { setFlag(InterruptDisable, 1); });
-            microcode.emplace([&] { bus.addr = ProgramCounter; bus.rw = Bus::READ; }); },
-        /* 79 */ [&] { std::fprintf(stderr, "Instruction 79 not implemented\n"); printState(); exit(1); },
-        /* 7a */ [&] { std::fprintf(stderr, "Instruction 7a not implemented\n"); printState(); exit(1); },
-        /* 7b */ [&] { std::fprintf(stderr, "Instruction 7b not implemented\n"); printState(); exit(1); },
-        /* 7c */ [&] { std::fprintf(stderr, "Instruction 7c not implemented\n"); printState(); exit(1); },
-        /* 7d */ [&] { std::fprintf(stderr, "Instruction 7d not implemented\n"); printState(); exit(1); },
-        /* 7e */ [&] { std::fprintf(stderr, "Instruction 7e not implemented\n"); printState(); exit(1); },
-        /* 7f */ [&] { std::fprintf(stderr, "Instruction 7f not implemented\n"); printState(); exit(1); },
-
-        /* 80 */ [&] { std::fprintf(stderr, "Instruction 80 not implemented\n"); printState(); exit(1); },
-        /* 81 */ [&] { std::fprintf(stderr, "Instruction 81 not implemented\n"); printState(); exit(1); },
-        /* 82 */ [&] { std::fprintf(stderr, "Instruction 82 not implemented\n"); printState(); exit(1); },
-        /* 83 */ [&] { std::fprintf(stderr, "Instruction 83 not implemented\n"); printState(); exit(1); },
-        /* 84 */ [&] { std::fprintf(stderr, "Instruction 84 not implemented\n"); printState(); exit(1); },
-        /* 85 */ [&] {
-            // STA - Store Accumulator in Memory
-            //  A -> M
-            //  N	Z	C	I	D	V
-            //  -	-	-	-	-	-
-            //  addressing	assembler	opc	bytes	cycles
-            //  zeropage	STA oper	85	2	    3
-            microcode.emplace([&] { bus.addr = ProgramCounter++; });
-            microcode.emplace([&] { bus.addr = bus.data; bus.data = Accumulator; bus.rw = Bus::WRITE; });
-            microcode.emplace([&] { bus.addr = ProgramCounter; bus.rw = Bus::READ; }); },
-        /* 86 */ [&] {
-            // STX - Store Index X in Memory
-            // X -> M
-            // N	Z	C	I	D	V
-            // -	-	-	-	-	-
-            // addressing	assembler	opc	bytes	cycles
-            // zeropage	STX oper	    86	2	    3
-            microcode.emplace([&] { bus.addr = ProgramCounter++; });
-            microcode.emplace([&] { bus.addr = bus.data; bus.data = Xregister; bus.rw = Bus::WRITE; });
-            microcode.emplace([&] { bus.addr = ProgramCounter; bus.rw = Bus::READ; }); },
-        /* 87 */ [&] { std::fprintf(stderr, "Instruction 87 not implemented\n"); printState(); exit(1); },
-        /* 88 */ [&] {
-            // DEY - Decrement Index Y by One
-            // Y - 1 -> Y
-            // N	Z	C	I	D	V
-            // +	+	-	-	-	-
-            // addressing	assembler	opc	bytes	cycles
-            // implied	    DEY	        88	1	    2
-            microcode.emplace([&] {
-                Yregister--;
-                setFlag(Zero, Yregister == 0);
-                setFlag(Negative, Yregister & 0b10000000);
-            });
-            microcode.emplace([&] { bus.addr = ProgramCounter; bus.rw = Bus::READ; }); },
-        /* 89 */ [&] { std::fprintf(stderr, "Instruction 89 not implemented\n"); printState(); exit(1); },
-        /* 8a */ [&] { std::fprintf(stderr, "Instruction 8a not implemented\n"); printState(); exit(1); },
-        /* 8b */ [&] { std::fprintf(stderr, "Instruction 8b not implemented\n"); printState(); exit(1); },
-        /* 8c */ [&] { std::fprintf(stderr, "Instruction 8c not implemented\n"); printState(); exit(1); },
-        /* 8d */ [&] {
-            // STA - Store Accumulator in Memory
-            // A -> M
-            // N	Z	C	I	D	V
-            // -	-	-	-	-	-
-            // addressing	assembler	opc	bytes	cycles
-            // absolute	    STA oper	8D	3	    4
-            static uint8_t lo = 0;
-            microcode.emplace([&] { bus.addr = ProgramCounter++; });
-            microcode.emplace([&] { bus.addr = ProgramCounter++; lo = bus.data; });
-            microcode.emplace([&] { bus.addr = (bus.data << 8) + lo; bus.data = Accumulator; bus.rw = Bus::WRITE; });
-            microcode.emplace([&] { bus.addr = ProgramCounter; bus.rw = Bus::READ; }); },
-        /* 8e */ [&] { std::fprintf(stderr, "Instruction 8e not implemented\n"); printState(); exit(1); },
-        /* 8f */ [&] { std::fprintf(stderr, "Instruction 8f not implemented\n"); printState(); exit(1); },
-
-        /* 90 */ [&] { std::fprintf(stderr, "Instruction 90 not implemented\n"); printState(); exit(1); },
-        /* 91 */ [&] {
-            // STA - Store Accumulator in Memory
-            // A -> M
-            // N	Z	C	I	D	V
-            // -	-	-	-	-	-
-            // addressing	assembler	   opc	bytes	cycles
-            // (indirect),Y	STA (oper),Y	91	2	    6
-            static uint16_t addr = 0;
-            microcode.emplace([&] { bus.addr = ProgramCounter++; });
-            microcode.emplace([&] { addr = bus.data; });
-            microcode.emplace([&] { }); // 2 cycle (for 16 bit addation?)
-            microcode.emplace([&] { addr += uint8_t(Yregister); });
-            microcode.emplace([&] { bus.addr = addr; bus.data = Accumulator; bus.rw = Bus::WRITE; });
-            microcode.emplace([&] { bus.addr = ProgramCounter; bus.rw = Bus::READ; }); },
-
-        /* 92 */ [&] { std::fprintf(stderr, "Instruction 92 not implemented\n"); printState(); exit(1); },
-        /* 93 */ [&] { std::fprintf(stderr, "Instruction 93 not implemented\n"); printState(); exit(1); },
-        /* 94 */ [&] { std::fprintf(stderr, "Instruction 94 not implemented\n"); printState(); exit(1); },
-        /* 95 */ [&] { std::fprintf(stderr, "Instruction 95 not implemented\n"); printState(); exit(1); },
-        /* 96 */ [&] { std::fprintf(stderr, "Instruction 96 not implemented\n"); printState(); exit(1); },
-        /* 97 */ [&] { std::fprintf(stderr, "Instruction 97 not implemented\n"); printState(); exit(1); },
-        /* 98 */ [&] { std::fprintf(stderr, "Instruction 98 not implemented\n"); printState(); exit(1); },
-        /* 99 */ [&] { std::fprintf(stderr, "Instruction 99 not implemented\n"); printState(); exit(1); },
-        /* 9a */ [&] {
-            // TXS - Transfer X to Stack Register
-            // X -> SP
-            // N	Z	C	I	D	V
-            // -	-	-	-	-	-
-            // addressing	assembler	opc	bytes	cycles
-            // implied	    TXS	        9A	1	    2
-            microcode.emplace([&] { StackPointer = Xregister; });
-            microcode.emplace([&] { bus.addr = ProgramCounter; }); },
-        /* 9b */ [&] { std::fprintf(stderr, "Instruction 9b not implemented\n"); printState(); exit(1); },
-        /* 9c */ [&] { std::fprintf(stderr, "Instruction 9c not implemented\n"); printState(); exit(1); },
-        /* 9d */ [&] { std::fprintf(stderr, "Instruction 9d not implemented\n"); printState(); exit(1); },
-        /* 9e */ [&] { std::fprintf(stderr, "Instruction 9e not implemented\n"); printState(); exit(1); },
-        /* 9f */ [&] { std::fprintf(stderr, "Instruction 9f not implemented\n"); printState(); exit(1); },
-
-        /* a0 */ [&] {
-            // LDY - Load Index Y with Memory
-            // M -> Y
-            // N	Z	C	I	D	V
-            // +	+	-	-	-	-
-            // addressing	assembler	opc	bytes	cycles
-            // immediate	LDY #oper	A0	2	    2
-            microcode.emplace([&] { bus.addr = ProgramCounter++; });
-            microcode.emplace([&] {
-                Yregister = bus.data;
-                setFlag(Zero, Yregister == 0);
-                setFlag(Negative, Yregister & 0b10000000);
-                bus.addr = ProgramCounter;
-            }); },
-        /* a1 */ [&] { std::fprintf(stderr, "Instruction a1 not implemented\n"); printState(); exit(1); },
-        /* a2 */ [&] {
-            // LDX - Load Index X with Memory
-            // M -> X
-            // N	Z	C	I	D	V
-            // +	+	-	-	-	-
-            // addressing      assembler       opc	bytes	cycles
-            // immediate       LDX #oper	    A2	2	    2
-            microcode.emplace([&] { bus.addr = ProgramCounter++; });
-            microcode.emplace([&] {
-                Xregister = bus.data;
-                setFlag(Zero, Xregister == 0);
-                setFlag(Negative, Xregister & 0b10000000);
-                bus.addr = ProgramCounter;
-            }); },
-        /* a3 */ [&] { std::fprintf(stderr, "Instruction a3 not implemented\n"); printState(); exit(1); },
-        /* a4 */ [&] { std::fprintf(stderr, "Instruction a4 not implemented\n"); printState(); exit(1); },
-        /* a5 */ [&] { std::fprintf(stderr, "Instruction a5 not implemented\n"); printState(); exit(1); },
-        /* a6 */ [&] { std::fprintf(stderr, "Instruction a6 not implemented\n"); printState(); exit(1); },
-        /* a7 */ [&] { std::fprintf(stderr, "Instruction a7 not implemented\n"); printState(); exit(1); },
-        /* a8 */ [&] { std::fprintf(stderr, "Instruction a8 not implemented\n"); printState(); exit(1); },
-        /* a9 */ [&] {
-            // LDA - Load Accumulator with Memory
-            // M -> A
-            // N	Z	C	I	D	V
-            // +	+	-	-	-	-
-            // addressing      assembler       opc	bytes	cycles
-            // immediate       LDA #oper	    A9	2	    2
-            microcode.emplace([&] { bus.addr = ProgramCounter++; });
-            microcode.emplace([&] {
-                Accumulator = bus.data;
-                setFlag(Zero, Accumulator == 0);
-                setFlag(Negative, Accumulator & 0b10000000);
+        }
+        dmaCycles--;
+    }
+
+    void fetch()
+    {
+        bus.addr = ProgramCounter;
+        bus.rw = Bus::READ;
+        step = 0;
+        interrupt = polled;
+    }
+
+    // Sample the lines, returns whether an interrupt is pending
+    bool poll(bool irqMasked)
+    {
+        if (bus.interrupts.nmi && !nmiLine) {
+            nmiPending = true;
+        }
+        nmiLine = bus.interrupts.nmi;
+        return nmiPending || (bus.interrupts.irq && !irqMasked);
+    }
+
+    // An NMI that comes in before the vector is read takes the sequence over,
+    // even a BRK's or an IRQ's
+    uint16_t interruptVector()
+    {
+        if (nmiPending) {
+            nmiPending = false;
+            return 0xfffa;
+        }
+        return 0xfffe;
+    }
+
+    // Access the effective address, the way the current instruction needs it
+    void access()
+    {
+        bus.addr = address;
+        if (programs[program].kind == Kind::Write) {
+            bus.data = store(programs[program].op);
+            bus.rw = Bus::WRITE;
+        } else {
+            bus.rw = Bus::READ;
+        }
+    }
+
+    // Add an index to a base address. The 6502 first accesses the address with
+    // only the low byte fixed up, which is the right address unless the addition
+    // crossed a page. Reads can stop there, writes always redo the access.
+    void index(uint16_t base, uint8_t index)
+    {
+        address = base + index;
+        bus.addr = (base & 0xff00) | (address & 0x00ff);
+        bus.rw = Bus::READ;
+        if (programs[program].kind == Kind::Read && bus.addr == address) {
+            ++step; // skip Fixup
+        }
+    }
+
+    void push(uint8_t value)
+    {
+        bus.addr = stackBase + StackPointer--;
+        bus.data = value;
+        bus.rw = Bus::WRITE;
+    }
+
+    void pop()
+    {
+        bus.addr = stackBase + ++StackPointer;
+        bus.rw = Bus::READ;
+    }
+
+    void adc(uint8_t value)
+    {
+        uint16_t temp = Accumulator + value + getFlag(Carry);
+        setFlag(Carry, temp > 255);
+        setFlag(Overflow, ~(Accumulator ^ value) & (Accumulator ^ temp) & 0x80);
+        Accumulator = temp & 0xff;
+        setZeroNegative(Accumulator);
+    }
+
+    void compare(uint8_t reg, uint8_t value)
+    {
+        setFlag(Carry, reg >= value);
+        setZeroNegative(reg - value);
+    }
+
+    bool branchTaken(Op op)
+    {
+        switch (op) {
+        case Op::BPL: return !getFlag(Negative);
+        case Op::BMI: return getFlag(Negative);
+        case Op::BVC: return !getFlag(Overflow);
+        case Op::BVS: return getFlag(Overflow);
+        case Op::BCC: return !getFlag(Carry);
+        case Op::BCS: return getFlag(Carry);
+        case Op::BNE: return !getFlag(Zero);
+        case Op::BEQ: return getFlag(Zero);
+        default: return false;
+        }
+    }
+
+    void read(Op op, uint8_t value)
+    {
+        switch (op) {
+        case Op::LDA: setZeroNegative(Accumulator = value); break;
+        case Op::LDX: setZeroNegative(Xregister = value); break;
+        case Op::LDY: setZeroNegative(Yregister = value); break;
+        case Op::AND: setZeroNegative(Accumulator &= value); break;
+        case Op::ORA: setZeroNegative(Accumulator |= value); break;
+        case Op::EOR: setZeroNegative(Accumulator ^= value); break;
+        case Op::ADC: adc(value); break;
+        case Op::SBC: adc(~value); break;
+        case Op::CMP: compare(Accumulator, value); break;
+        case Op::CPX: compare(Xregister, value); break;
+        case Op::CPY: compare(Yregister, value); break;
+        case Op::BIT:
+            setFlag(Zero, (Accumulator & value) == 0);
+            setFlag(Overflow, value & 0b01000000);
+            setFlag(Negative, value & 0b10000000);
+            break;
+        default: break;
+        }
+    }
+
+    uint8_t store(Op op)
+    {
+        switch (op) {
+        case Op::STX: return Xregister;
+        case Op::STY: return Yregister;
+        default: return Accumulator;
+        }
+    }
+
+    uint8_t modify(Op op, uint8_t value)
+    {
+        bool carry = getFlag(Carry);
+        switch (op) {
+        case Op::ASL: setFlag(Carry, value & 0x80); value <<= 1; break;
+        case Op::LSR: setFlag(Carry, value & 0x01); value >>= 1; break;
+        case Op::ROL: setFlag(Carry, value & 0x80); value = value << 1 | carry; break;
+        case Op::ROR: setFlag(Carry, value & 0x01); value = value >> 1 | carry << 7; break;
+        case Op::INC: ++value; break;
+        case Op::DEC: --value; break;
+        default: break;
+        }
+        setZeroNegative(value);
+        return value;
+    }
+
+    void implied(Op op)
+    {
+        switch (op) {
+        case Op::TAX: setZeroNegative(Xregister = Accumulator); break;
+        case Op::TAY: setZeroNegative(Yregister = Accumulator); break;
+        case Op::TXA: setZeroNegative(Accumulator = Xregister); break;
+        case Op::TYA: setZeroNegative(Accumulator = Yregister); break;
+        case Op::TSX: setZeroNegative(Xregister = StackPointer); break;
+        case Op::TXS: StackPointer = Xregister; break;
+        case Op::INX: setZeroNegative(++Xregister); break;
+        case Op::INY: setZeroNegative(++Yregister); break;
+        case Op::DEX: setZeroNegative(--Xregister); break;
+        case Op::DEY: setZeroNegative(--Yregister); break;
+        case Op::CLC: setFlag(Carry, 0); break;
+        case Op::SEC: setFlag(Carry, 1); break;
+        case Op::CLI: setFlag(InterruptDisable, 0); break;
+        case Op::SEI: setFlag(InterruptDisable, 1); break;
+        case Op::CLV: setFlag(Overflow, 0); break;
+        case Op::CLD: setFlag(DecimalMode, 0); break;
+        case Op::SED: setFlag(DecimalMode, 1); break;
+        default: break;
+        }
+    }
+
+    uint8_t fetchOperand() { return bus.get(ProgramCounter++); }
+    uint16_t fetchAddress()
+    {
+        uint16_t lo = fetchOperand();
+        return fetchOperand() << 8 | lo;
+    }
+
+    void pushByte(uint8_t value) { bus.set(stackBase + StackPointer--, value); }
+    uint8_t popByte() { return bus.get(stackBase + ++StackPointer); }
+
+    // Index an address, adding a cycle when a read crosses a page
+    uint16_t indexed(uint16_t base, uint8_t index, Kind kind, int& cycles)
+    {
+        uint16_t address = base + index;
+        cycles += kind != Kind::Read || (base ^ address) & 0xff00 ? 1 : 0;
+        return address;
+    }
+
+public:
+    // Run the instruction whose opcode is on the bus, without the cycle by
+    // cycle bus traffic. Leaves the CPU at the next opcode fetch, where the
+    // cycle core would be on plain memory (see Core), and returns the number
+    // of cycles it took.
+    int instruction()
+    {
+        const auto opcode = opcodes[bus.data];
+        trace<Trace::Cpu>("Executing instruction %02x at %04x", bus.data, ProgramCounter);
+        int cycles = 2;
+        ++ProgramCounter;
+        bool irqMasked = getFlag(InterruptDisable);
+
+        switch (opcode.op) {
+        case Op::Illegal:
+            program = bus.data;
+            step = 1;
+            clk(); // halt
+            return 1;
+        case Op::BRK:
+            pushByte((ProgramCounter + 1) >> 8);
+            pushByte(ProgramCounter + 1);
+            pushByte(Status | Break | 0x20);
+            setFlag(InterruptDisable, 1);
+            vector = interruptVector();
+            ProgramCounter = bus.get(vector) | bus.get(vector + 1) << 8;
+            cycles = 7;
+            break;
+        case Op::JSR:
+            address = fetchOperand();
+            pushByte(ProgramCounter >> 8);
+            pushByte(ProgramCounter);
+            ProgramCounter = bus.get(ProgramCounter) << 8 | address;
+            cycles = 6;
+            break;
+        case Op::RTS:
+            address = popByte();
+            ProgramCounter = (popByte() << 8 | address) + 1;
+            cycles = 6;
+            break;
+        case Op::RTI:
+            Status = popByte() & ~(Break | 0x20);
+            address = popByte();
+            ProgramCounter = popByte() << 8 | address;
+            cycles = 6;
+            break;
+        case Op::PHA:
+            pushByte(Accumulator);
+            cycles = 3;
+            break;
+        case Op::PHP:
+            pushByte(Status | Break | 0x20);
+            cycles = 3;
+            break;
+        case Op::PLA:
+            setZeroNegative(Accumulator = popByte());
+            cycles = 4;
+            break;
+        case Op::PLP:
+            Status = popByte() & ~(Break | 0x20);
+            cycles = 4;
+            break;
+        case Op::JMP:
+            address = fetchAddress();
+            if (opcode.mode == Mode::Indirect) {
+                value = bus.get(address);
+                address = bus.get((address & 0xff00) | ((address + 1) & 0x00ff)) << 8 | value;
+                cycles = 5;
+            } else {
+                cycles = 3;
+            }
+            ProgramCounter = address;
+            break;
+        default:
+            auto kind = kindOf(opcode.op);
+            switch (opcode.mode) {
+            case Mode::Implied:
+                implied(opcode.op);
+                break;
+            case Mode::Accumulator:
+                Accumulator = modify(opcode.op, Accumulator);
+                break;
+            case Mode::Immediate:
+                read(opcode.op, fetchOperand());
+                break;
+            case Mode::Relative:
+                value = fetchOperand();
+                if (branchTaken(opcode.op)) {
+                    address = ProgramCounter + int8_t(value);
+                    cycles += (address ^ ProgramCounter) & 0xff00 ? 2 : 1;
+                    ProgramCounter = address;
+                }
+                break;
+            default:
+                switch (opcode.mode) {
+                case Mode::ZeroPage:
+                    address = fetchOperand();
+                    cycles = 3;
+                    break;
+                case Mode::ZeroPageX:
+                    address = uint8_t(fetchOperand() + Xregister);
+                    cycles = 4;
+                    break;
+                case Mode::ZeroPageY:
+                    address = uint8_t(fetchOperand() + Yregister);
+                    cycles = 4;
+                    break;
+                case Mode::Absolute:
+                    address = fetchAddress();
+                    cycles = 4;
+                    break;
+                case Mode::AbsoluteX:
+                    cycles = 4;
+                    address = indexed(fetchAddress(), Xregister, kind, cycles);
+                    break;
+                case Mode::AbsoluteY:
+                    cycles = 4;
+                    address = indexed(fetchAddress(), Yregister, kind, cycles);
+                    break;
+                case Mode::IndirectX:
+                    pointer = fetchOperand() + Xregister;
+                    address = bus.get(pointer) | bus.get(uint8_t(pointer + 1)) << 8;
+                    cycles = 6;
+                    break;
+                case Mode::IndirectY:
+                    pointer = fetchOperand();
+                    cycles = 5;
+                    address = indexed(bus.get(pointer) | bus.get(uint8_t(pointer + 1)) << 8, Yregister, kind, cycles);
+                    break;
+                default:
+                    break;
+                }
+
+                switch (kind) {
+                case Kind::Read:
+                    read(opcode.op, bus.get(address));
+                    break;
+                case Kind::Write:
+                    bus.set(address, store(opcode.op));
+                    break;
+                case Kind::Modify:
+                    // Keep the dummy write, mappers can see it
+                    value = bus.get(address);
+                    bus.set(address, value);
+                    bus.set(address, modify(opcode.op, value));
+                    cycles += 2;
+                    break;
+                }
+            }
+        }
+
+        // The lines haven't moved since the instruction started, but the I
+        // flag may have, and CLI, SEI and PLP change it after the poll. BRK
+        // doesn't poll, the handler's first instruction always runs.
+        if (opcode.op != Op::CLI && opcode.op != Op::SEI && opcode.op != Op::PLP) {
+            irqMasked = getFlag(InterruptDisable);
+        }
+        polled = poll(irqMasked) && opcode.op != Op::BRK;
+        fetchOpcode();
+        return cycles;
+    }
+
+    // The interrupt sequence, in one go like an instruction
+    int interruptSequence()
+    {
+        trace<Trace::Cpu>("Interrupt at %04x", ProgramCounter);
+        pushByte(ProgramCounter >> 8);
+        pushByte(ProgramCounter);
+        pushByte(Status | 0x20);
+        setFlag(InterruptDisable, 1);
+        vector = interruptVector();
+        ProgramCounter = bus.get(vector) | bus.get(vector + 1) << 8;
+        polled = false;
+        fetchOpcode();
+        return 7;
+    }
+
+    // Fetch the next opcode, like the last cycle of the cycle core does
+    void fetchOpcode()
+    {
+        bus.addr = ProgramCounter;
+        bus.rw = Bus::READ;
+        bus.data = bus.get(ProgramCounter);
+        step = 0;
+        interrupt = polled;
+    }
+
+    // Advance the CPU (and the bus) by one scheduler slot, returns the number
+    // of CPU cycles used. Between instructions the instruction core takes
+    // over if it is selected.
+    int tick()
+    {
+        if (stallCycles) {
+            auto cycles = stallCycles;
+            stallCycles = 0;
+            return cycles;
+        }
+        if (dmaCycles) {
+            dmaCycle();
+            return 1;
+        }
+        if (core == Core::Instruction && step == 0) {
+            return interrupt ? interruptSequence() : instruction();
+        }
+        clk();
+        bus.clk();
+        return 1;
+    }
+
+    void clk()
+    {
+        const auto& p = programs[program];
+        // The lines as the previous cycle left them. The sequences that jump
+        // through a vector don't poll, the handler's first instruction always
+        // runs.
+        bool pending = poll(getFlag(InterruptDisable)) && p.op != Op::BRK && p.op != Op::Reset && p.op != Op::Interrupt;
+        switch (p.steps[step++]) {
+        case Step::Decode:
+            if (interrupt) {
+                // The opcode is dropped and the program counter isn't incremented
+                trace<Trace::Cpu>("Interrupt at %04x", ProgramCounter);
+                program = InterruptProgram;
                 bus.addr = ProgramCounter;
-            }); },
-        /* aa */ [&] { std::fprintf(stderr, "Instruction aa not implemented\n"); printState(); exit(1); },
-        /* ab */ [&] { std::fprintf(stderr, "Instruction ab not implemented\n"); printState(); exit(1); },
-        /* ac */ [&] { std::fprintf(stderr, "Instruction ac not implemented\n"); printState(); exit(1); },
-        /* ad */ [&] {
-            // LDA - Load Accumulator with Memory
-            // M -> A
-            // N	Z	C	I	D	V
-            // +	+	-	-	-	-
-            // addressing      assembler       opc	bytes	cycles
-            // absolute        LDA oper	       AD	3	    4
-            static uint8_t lo = 0;
-            microcode.emplace([&] { bus.addr = ProgramCounter++; });
-            microcode.emplace([&] { bus.addr = ProgramCounter++; lo = bus.data; });
-            microcode.emplace([&] { bus.addr = (bus.data << 8) + lo; });
-            microcode.emplace([&] {
-                Accumulator = bus.data;
-                setFlag(Zero, Accumulator == 0);
-                setFlag(Negative, Accumulator & 0b10000000);
-                std::fprintf(stderr, "LDA: %02x\n", Accumulator);
+                bus.rw = Bus::READ;
+                break;
+            }
+            program = bus.data;
+            trace<Trace::Cpu>("Executing instruction %02x at %04x", bus.data, ProgramCounter);
+            bus.addr = ++ProgramCounter;
+            bus.rw = Bus::READ;
+            break;
+        case Step::Fetch:
+            fetch();
+            break;
+        case Step::Halt:
+            if (!jammed) {
+                std::fprintf(stderr, "Instruction %02x not implemented, the CPU is jammed\n", program);
                 printState();
-                bus.addr = ProgramCounter;
-            }); },
-        /* ae */ [&] { std::fprintf(stderr, "Instruction ae not implemented\n"); printState(); exit(1); },
-        /* af */ [&] { std::fprintf(stderr, "Instruction af not implemented\n"); printState(); exit(1); },
-
-        /* b0 */ [&] {
-            // BCS - Branch on Carry Set
-            // branch on C = 1
-            // N	Z	C	I	D	V
-            // -	-	-	-	-	-
-            // addressing	assembler	opc	bytes	cycles
-            // relative  	BCS oper	B0	2	    2**
-            // ** add 1 to cycles if branch occurs on same page
-            // ** add 2 to cycles if branch occurs to different page
-            microcode.emplace([&] { bus.addr = ProgramCounter++; });
-            if (getFlag(Carry)) {
-                microcode.emplace([&] { ProgramCounter += int8_t(bus.data); });
-                // if (bus.addr & 0xff00 != ProgramCounter & 0xff00) { // TODO this is almost certainly wrong!
-                //     microcode.emplace([] {}); // add 2 to cycles if branch occurs to different page
-                // }
+                jammed = true;
             }
-            microcode.emplace([&] { bus.addr = ProgramCounter; }); },
-        /* b1 */ [&] { std::fprintf(stderr, "Instruction b1 not implemented\n"); printState(); exit(1); },
-        /* b2 */ [&] { std::fprintf(stderr, "Instruction b2 not implemented\n"); printState(); exit(1); },
-        /* b3 */ [&] { std::fprintf(stderr, "Instruction b3 not implemented\n"); printState(); exit(1); },
-        /* b4 */ [&] { std::fprintf(stderr, "Instruction b4 not implemented\n"); printState(); exit(1); },
-        /* b5 */ [&] { std::fprintf(stderr, "Instruction b5 not implemented\n"); printState(); exit(1); },
-        /* b6 */ [&] { std::fprintf(stderr, "Instruction b6 not implemented\n"); printState(); exit(1); },
-        /* b7 */ [&] { std::fprintf(stderr, "Instruction b7 not implemented\n"); printState(); exit(1); },
-        /* b8 */ [&] { std::fprintf(stderr, "Instruction b8 not implemented\n"); printState(); exit(1); },
-        /* b9 */ [&] { std::fprintf(stderr, "Instruction b9 not implemented\n"); printState(); exit(1); },
-        /* ba */ [&] { std::fprintf(stderr, "Instruction ba not implemented\n"); printState(); exit(1); },
-        /* bb */ [&] { std::fprintf(stderr, "Instruction bb not implemented\n"); printState(); exit(1); },
-        /* bc */ [&] { std::fprintf(stderr, "Instruction bc not implemented\n"); printState(); exit(1); },
-        /* bd */ [&] {
-            // LDA - Load Accumulator with Memory
-            // M -> A
-            // N	Z	C	I	D	V
-            // +	+	-	-	-	-
-            // addressing      assembler       opc	bytes	cycles
-            // absolute,X      LDA oper,X	    BD	3	    4*
-            // * add 1 to cycles if page boundary is crossed
-            static uint8_t lo = 0;
-            microcode.emplace([&] { bus.addr = ProgramCounter++; });
-            microcode.emplace([&] { bus.addr = ProgramCounter++; lo = bus.data; });
-            microcode.emplace([&] { bus.addr = Xregister + (bus.data << 8) + lo; });
-            // TODO add 1 to cycles if page boundary is crossed
-            microcode.emplace([&] {
-                Accumulator = bus.data;
-                setFlag(Zero, Accumulator == 0);
-                setFlag(Negative, Accumulator & 0b10000000);
-                bus.addr = ProgramCounter;
-            }); },
-        /* be */ [&] { std::fprintf(stderr, "Instruction be not implemented\n"); printState(); exit(1); },
-        /* bf */ [&] { std::fprintf(stderr, "Instruction bf not implemented\n"); printState(); exit(1); },
-
-        /* c0 */ [&] {
-            // CPY - Compare Memory and Index Y
-            // Y - M
-            // N	Z	C	I	D	V
-            // +	+	+	-	-	-
-            // addressing	assembler	opc	bytes	cycles
-            // immediate	CPY #oper	C0	2	    2
-            microcode.emplace([&] { bus.addr = ProgramCounter++; });
-            microcode.emplace([&] {
-                uint16_t temp = Yregister - bus.data;
-                setFlag(Carry, Yregister >= bus.data);
-                setFlag(Zero, (temp & 0xff) == 0);
-                setFlag(Negative, temp & 0b10000000);
-                bus.addr = ProgramCounter;
-            }); },
-        /* c1 */ [&] { std::fprintf(stderr, "Instruction c1 not implemented\n"); printState(); exit(1); },
-        /* c2 */ [&] { std::fprintf(stderr, "Instruction c2 not implemented\n"); printState(); exit(1); },
-        /* c3 */ [&] { std::fprintf(stderr, "Instruction c3 not implemented\n"); printState(); exit(1); },
-        /* c4 */ [&] { std::fprintf(stderr, "Instruction c4 not implemented\n"); printState(); exit(1); },
-        /* c5 */ [&] { std::fprintf(stderr, "Instruction c5 not implemented\n"); printState(); exit(1); },
-        /* c6 */ [&] { std::fprintf(stderr, "Instruction c6 not implemented\n"); printState(); exit(1); },
-        /* c7 */ [&] { std::fprintf(stderr, "Instruction c7 not implemented\n"); printState(); exit(1); },
-        /* c8 */ [&] { std::fprintf(stderr, "Instruction c8 not implemented\n"); printState(); exit(1); },
-        /* c9 */ [&] {
-            // CMP - Compare Memory with Accumulator
-            // A - M
-            // N	Z	C	I	D	V
-            // +	+	+	-	-	-
-            // addressing	assembler	opc	bytes	cycles
-            // immediate	CMP #oper	C9	2	2
-            microcode.emplace([&] { bus.addr = ProgramCounter++; });
-            microcode.emplace([&] {
-                uint16_t temp = Accumulator - bus.data;
-                setFlag(Carry, Accumulator >= bus.data);
-                setFlag(Zero, (temp & 0xff) == 0);
-                setFlag(Negative, temp & 0b10000000);
-                bus.addr = ProgramCounter;
-            }); },
-        /* ca */ [&] {
-            // DEX - Decrement Index X by One
-            // X - 1 -> X
-            // N	Z	C	I	D	V
-            // +	+	-	-	-	-
-            // addressing	assembler	opc	bytes	cycles
-            // implied	    DEX	        CA	1	    2
-            microcode.emplace([&] {
-                --Xregister;
-                setFlag(Zero, Xregister == 0);
-                setFlag(Negative, Xregister & 0b10000000);
-            });
-            microcode.emplace([&] { bus.addr = ProgramCounter; }); },
-        /* cb */ [&] { std::fprintf(stderr, "Instruction cb not implemented\n"); printState(); exit(1); },
-        /* cc */ [&] { std::fprintf(stderr, "Instruction cc not implemented\n"); printState(); exit(1); },
-        /* cd */ [&] { std::fprintf(stderr, "Instruction cd not implemented\n"); printState(); exit(1); },
-        /* ce */ [&] { std::fprintf(stderr, "Instruction ce not implemented\n"); printState(); exit(1); },
-        /* cf */ [&] { std::fprintf(stderr, "Instruction cf not implemented\n"); printState(); exit(1); },
-
-        /* d0 */ [&] {
-            // BNE - Branch on Result not Zero
-            // branch on Z=0
-            // N	Z	C	I	D	V
-            // -	-	-	-	-	-
-            // addressing	assembler	opc	bytes	cycles
-            // relative	BNE oper	D0	2	2**
-            // ** add 1 to cycles if branch occurs on same page
-            // ** add 2 to cycles if branch occurs to different page
-            microcode.emplace([&] { bus.addr = ProgramCounter++; });
-            if (getFlag(Zero)) {
-                microcode.emplace([&] { ProgramCounter += int8_t(bus.data); });
-                // if (bus.addr & 0xff00 != ProgramCounter & 0xff00) { // TODO this is almost certainly wrong!
-                //     microcode.emplace([] {}); // add 2 to cycles if branch occurs to different page
-                // }
+            step--;
+            break;
+
+        case Step::Implied:
+            implied(p.op);
+            fetch();
+            break;
+        case Step::Accumulator:
+            Accumulator = modify(p.op, Accumulator);
+            fetch();
+            break;
+        case Step::Immediate:
+            ++ProgramCounter;
+            read(p.op, bus.data);
+            fetch();
+            break;
+        case Step::Execute:
+            read(p.op, bus.data);
+            fetch();
+            break;
+
+        case Step::ZeroPage:
+            ++ProgramCounter;
+            address = bus.data;
+            access();
+            break;
+        case Step::ZeroPageBase:
+            ++ProgramCounter;
+            bus.addr = address = bus.data;
+            break;
+        case Step::ZeroPageX:
+            address = uint8_t(address + Xregister);
+            access();
+            break;
+        case Step::ZeroPageY:
+            address = uint8_t(address + Yregister);
+            access();
+            break;
+        case Step::AbsoluteLo:
+            address = bus.data;
+            bus.addr = ++ProgramCounter;
+            break;
+        case Step::AbsoluteHi:
+            ++ProgramCounter;
+            address |= bus.data << 8;
+            access();
+            break;
+        case Step::AbsoluteHiX:
+            ++ProgramCounter;
+            index(bus.data << 8 | address, Xregister);
+            break;
+        case Step::AbsoluteHiY:
+            ++ProgramCounter;
+            index(bus.data << 8 | address, Yregister);
+            break;
+        case Step::Pointer:
+            ++ProgramCounter;
+            bus.addr = pointer = bus.data;
+            break;
+        case Step::PointerX:
+            bus.addr = pointer += Xregister;
+            break;
+        case Step::PointerLo:
+            address = bus.data;
+            bus.addr = uint8_t(pointer + 1);
+            break;
+        case Step::PointerHi:
+            address |= bus.data << 8;
+            access();
+            break;
+        case Step::PointerHiY:
+            index(bus.data << 8 | address, Yregister);
+            break;
+        case Step::Fixup:
+            access();
+            break;
+
+        case Step::DummyWrite:
+            value = bus.data;
+            bus.rw = Bus::WRITE;
+            break;
+        case Step::Modify:
+            bus.data = modify(p.op, value);
+            break;
+
+        case Step::Branch:
+            value = bus.data;
+            ++ProgramCounter;
+            if (!branchTaken(p.op)) {
+                fetch();
+                break;
             }
-            microcode.emplace([&] { bus.addr = ProgramCounter; }); },
-        /* d1 */ [&] { std::fprintf(stderr, "Instruction d1 not implemented\n"); printState(); exit(1); },
-        /* d2 */ [&] { std::fprintf(stderr, "Instruction d2 not implemented\n"); printState(); exit(1); },
-        /* d3 */ [&] { std::fprintf(stderr, "Instruction d3 not implemented\n"); printState(); exit(1); },
-        /* d4 */ [&] { std::fprintf(stderr, "Instruction d4 not implemented\n"); printState(); exit(1); },
-        /* d5 */ [&] { std::fprintf(stderr, "Instruction d5 not implemented\n"); printState(); exit(1); },
-        /* d6 */ [&] { std::fprintf(stderr, "Instruction d6 not implemented\n"); printState(); exit(1); },
-        /* d7 */ [&] { std::fprintf(stderr, "Instruction d7 not implemented\n"); printState(); exit(1); },
-        /* d8 */ [&] {
-            // CLD - Clear Decimal Mode
-            // 0 -> D
-            // N	Z	C	I	D	V
-            // -	-	-	-	0	-
-            // addressing	assembler	opc	bytes	cycles
-            // implied	    CLD	        D8	1	    2
-            microcode.emplace([&] { setFlag(DecimalMode, 0); });
-            microcode.emplace([&] { bus.addr = ProgramCounter; }); },
-        /* d9 */ [&] { std::fprintf(stderr, "Instruction d9 not implemented\n"); printState(); exit(1); },
-        /* da */ [&] { std::fprintf(stderr, "Instruction da not implemented\n"); printState(); exit(1); },
-        /* db */ [&] { std::fprintf(stderr, "Instruction db not implemented\n"); printState(); exit(1); },
-        /* dc */ [&] { std::fprintf(stderr, "Instruction dc not implemented\n"); printState(); exit(1); },
-        /* dd */ [&] { std::fprintf(stderr, "Instruction dd not implemented\n"); printState(); exit(1); },
-        /* de */ [&] { std::fprintf(stderr, "Instruction de not implemented\n"); printState(); exit(1); },
-        /* df */ [&] { std::fprintf(stderr, "Instruction df not implemented\n"); printState(); exit(1); },
-
-        /* e0 */ [&] {
-            // CPX - Compare Memory and Index X
-            // X - M
-            // N	Z	C	I	D	V
-            // +	+	+	-	-	-
-            // addressing	assembler	opc	bytes	cycles
-            // immediate	CPX #oper	E0	2	2
-            microcode.emplace([&] { bus.addr = ProgramCounter++; });
-            microcode.emplace([&] {
-                uint16_t temp = Xregister - bus.data;
-                setFlag(Carry, Xregister >= bus.data);
-                setFlag(Zero, (temp & 0xff) == 0);
-                setFlag(Negative, temp & 0b10000000);
-                bus.addr = ProgramCounter;
-            }); },
-        /* e1 */ [&] { std::fprintf(stderr, "Instruction e1 not implemented\n"); printState(); exit(1); },
-        /* e2 */ [&] { std::fprintf(stderr, "Instruction e2 not implemented\n"); printState(); exit(1); },
-        /* e3 */ [&] { std::fprintf(stderr, "Instruction e3 not implemented\n"); printState(); exit(1); },
-        /* e4 */ [&] { std::fprintf(stderr, "Instruction e4 not implemented\n"); printState(); exit(1); },
-        /* e5 */ [&] { std::fprintf(stderr, "Instruction e5 not implemented\n"); printState(); exit(1); },
-        /* e6 */ [&] { std::fprintf(stderr, "Instruction e6 not implemented\n"); printState(); exit(1); },
-        /* e7 */ [&] { std::fprintf(stderr, "Instruction e7 not implemented\n"); printState(); exit(1); },
-        /* e8 */ [&] { std::fprintf(stderr, "Instruction e8 not implemented\n"); printState(); exit(1); },
-        /* e9 */ [&] { std::fprintf(stderr, "Instruction e9 not implemented\n"); printState(); exit(1); },
-        /* ea */ [&] { std::fprintf(stderr, "Instruction ea not implemented\n"); printState(); exit(1); },
-        /* eb */ [&] { std::fprintf(stderr, "Instruction eb not implemented\n"); printState(); exit(1); },
-        /* ec */ [&] { std::fprintf(stderr, "Instruction ec not implemented\n"); printState(); exit(1); },
-        /* ed */ [&] { std::fprintf(stderr, "Instruction ed not implemented\n"); printState(); exit(1); },
-        /* ee */ [&] { std::fprintf(stderr, "Instruction ee not implemented\n"); printState(); exit(1); },
-        /* ef */ [&] { std::fprintf(stderr, "Instruction ef not implemented\n"); printState(); exit(1); },
-
-        /* f0 */ [&] {
-            // BEQ - Branch on Result Zero
-            // branch on Z=1
-            // N	Z	C	I	D	V
-            // -	-	-	-	-	-
-            // addressing	assembler	opc	bytes	cycles
-            // relative	BEQ oper	    F0	2	    2**
-            // ** add 1 to cycles if branch occurs on same page
-            // ** add 2 to cycles if branch occurs to different page
-            microcode.emplace([&] { bus.addr = ProgramCounter++; });
-            if (getFlag(Zero)) {
-                microcode.emplace([&] { ProgramCounter += int8_t(bus.addr); });
-                // if (bus.addr & 0xff00 != ProgramCounter & 0xff00) { // TODO this is almost certainly wrong!
-                //     microcode.emplace([] {}); // add 2 to cycles if branch occurs to different page
-                // }
+            bus.addr = ProgramCounter;
+            break;
+        case Step::BranchTaken:
+            address = ProgramCounter + int8_t(value);
+            ProgramCounter = (ProgramCounter & 0xff00) | (address & 0x00ff);
+            if (ProgramCounter == address) {
+                fetch();
+                break;
             }
-            microcode.emplace([&] { bus.addr = ProgramCounter; }); },
-        /* f1 */ [&] { std::fprintf(stderr, "Instruction f1 not implemented\n"); printState(); exit(1); },
-        /* f2 */ [&] { std::fprintf(stderr, "Instruction f2 not implemented\n"); printState(); exit(1); },
-        /* f3 */ [&] { std::fprintf(stderr, "Instruction f3 not implemented\n"); printState(); exit(1); },
-        /* f4 */ [&] { std::fprintf(stderr, "Instruction f4 not implemented\n"); printState(); exit(1); },
-        /* f5 */ [&] { std::fprintf(stderr, "Instruction f5 not implemented\n"); printState(); exit(1); },
-        /* f6 */ [&] { std::fprintf(stderr, "Instruction f6 not implemented\n"); printState(); exit(1); },
-        /* f7 */ [&] { std::fprintf(stderr, "Instruction f7 not implemented\n"); printState(); exit(1); },
-        /* f8 */ [&] { std::fprintf(stderr, "Instruction f8 not implemented\n"); printState(); exit(1); },
-        /* f9 */ [&] { std::fprintf(stderr, "Instruction f9 not implemented\n"); printState(); exit(1); },
-        /* fa */ [&] { std::fprintf(stderr, "Instruction fa not implemented\n"); printState(); exit(1); },
-        /* fb */ [&] { std::fprintf(stderr, "Instruction fb not implemented\n"); printState(); exit(1); },
-        /* fc */ [&] { std::fprintf(stderr, "Instruction fc not implemented\n"); printState(); exit(1); },
-        /* fd */ [&] { std::fprintf(stderr, "Instruction fd not implemented\n"); printState(); exit(1); },
-        /* fe */ [&] {
-            // INC - Increment Memory by One
-            // M + 1 -> M
-            // N	Z	C	I	D	V
-            // +	+	-	-	-	-
-            // addressing	assembler	opc	bytes	cycles
-            // absolute,X	INC oper,X	FE	3	    7
-            static uint16_t addr = 0;
-            microcode.emplace([&] { bus.addr = ProgramCounter++; });
-            microcode.emplace([&] { bus.addr = ProgramCounter++; addr = bus.data;});
-            microcode.emplace([&] { addr += bus.data << 8; });
-            microcode.emplace([&] { addr += Xregister; });
-            microcode.emplace([&] { bus.data++; });
-            microcode.emplace([&] { bus.addr = addr; bus.rw = Bus::WRITE; });
-            microcode.emplace([&] { bus.addr = ProgramCounter; bus.rw = Bus::READ; }); },
-        /* ff */ [&] { std::fprintf(stderr, "Instruction ff not implemented\n"); printState(); exit(1); },
-    };
+            bus.addr = ProgramCounter;
+            break;
+        case Step::BranchFix:
+            ProgramCounter = address;
+            fetch();
+            break;
 
-    void clk()
-    {
-        if (microcode.empty()) {
-            ProgramCounter++;
-            std::fprintf(stderr, "Executing instruction %02x\n", bus.data);
-            isa[bus.data]();
-            return;
+        case Step::JumpAbsolute:
+            ProgramCounter = bus.data << 8 | (address & 0x00ff);
+            fetch();
+            break;
+        case Step::JumpPointer:
+            address |= bus.data << 8;
+            bus.addr = address;
+            bus.rw = Bus::READ;
+            break;
+        case Step::JumpPointerLo:
+            // The pointer never crosses a page, JMP ($10ff) reads $10ff and $1000
+            value = bus.data;
+            bus.addr = (address & 0xff00) | ((address + 1) & 0x00ff);
+            break;
+        case Step::JumpIndirect:
+            ProgramCounter = bus.data << 8 | value;
+            fetch();
+            break;
+        case Step::JsrStack:
+            address = bus.data;
+            ++ProgramCounter;
+            bus.addr = stackBase + StackPointer;
+            break;
+        case Step::JsrHi:
+            bus.addr = ProgramCounter;
+            bus.rw = Bus::READ;
+            break;
+        case Step::StackDummy:
+            bus.addr = stackBase + StackPointer;
+            break;
+        case Step::Pop:
+            pop();
+            break;
+        case Step::PopPcl:
+            address = bus.data;
+            pop();
+            break;
+        case Step::PullStatus:
+            Status = bus.data & ~(Break | 0x20);
+            pop();
+            break;
+        case Step::Pull:
+            if (p.op == Op::PLA) {
+                setZeroNegative(Accumulator = bus.data);
+            } else {
+                Status = bus.data & ~(Break | 0x20);
+            }
+            fetch();
+            break;
+        case Step::Push:
+            push(p.op == Op::PHA ? Accumulator : Status | Break | 0x20);
+            break;
+        case Step::PushPch:
+            if (p.op == Op::BRK) {
+                ++ProgramCounter; // BRK skips a padding byte
+            }
+            push(ProgramCounter >> 8);
+            break;
+        case Step::PushPcl:
+            push(ProgramCounter & 0xff);
+            break;
+        case Step::PushStatus:
+            // The B flag only exists on the stack, it tells a BRK from an IRQ
+            push(Status | (p.op == Op::BRK ? Break : 0) | 0x20);
+            break;
+        case Step::RtsInc:
+            ProgramCounter = address + 1;
+            fetch();
+            break;
+        case Step::ResetStack:
+            bus.addr = stackBase + StackPointer--;
+            bus.rw = Bus::READ;
+            break;
+        case Step::VectorLo:
+            vector = p.op == Op::Reset ? 0xfffc : interruptVector();
+            setFlag(InterruptDisable, 1);
+            bus.addr = vector;
+            bus.rw = Bus::READ;
+            break;
+        case Step::VectorHi:
+            address = bus.data;
+            bus.addr = vector + 1;
+            break;
         }
-        microcode.front()();
-        microcode.pop();
+        polled = pending;
     }
 
-public:
 public:
     Cpu(Bus& bus)
         : bus(bus)
     {
-        bus.rw = Bus::READ;
-        bus.addr = 0xfffc;
         // TODO https://www.nesdev.org/wiki/CPU_power_up_state
-        // TODO I think is is the same as a reset?
-        // TODO the bus should be clocked of the CPU clock pin, not the global clock
-        static uint16_t addr = 0;
-        microcode.emplace([] {}); // Do one cycle in case the bus got the clock tick first
-        microcode.emplace([&] { bus.addr = 0xfffc; });
-        microcode.emplace([&] { ++bus.addr; addr = bus.data; });
-        microcode.emplace([&] { ProgramCounter = (bus.data << 8) + addr; });
-        microcode.emplace([&] { bus.addr = ProgramCounter; bus.rw = Bus::READ; });
+        // Power up runs the reset sequence, which loads the program counter from $fffc
+        bus.rw = Bus::READ;
+        bus.addr = ProgramCounter;
     }
 
     void
@@ -760,4 +1401,4 @@ public:
             (Status & Break) ? 'B' : '-',
             (Status & 0b00000001) ? '1' : '-');
     }
-};
\ No newline at end of file
+};
@@ -0,0 +1,115 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// https://en.wikipedia.org/wiki/Fowler%E2%80%93Noll%E2%80%93Vo_hash_function
+// Used to fingerprint machine state (framebuffer, RAM, PPU) for regression runs
+inline uint64_t fnv1a(const void* data, size_t size, uint64_t hash = 0xcbf29ce484222325)
+{
+    auto p = static_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ p[i]) * 0x100000001b3;
+    }
+    return hash;
+}
+
+// The same idea 8 bytes at a time, with a rotate so the high bits of a word
+// reach the low bits of the hash. About 8 times faster than fnv1a on large
+// buffers (the framebuffer), but a different hash.
+inline uint64_t wordHash(const void* data, size_t size, uint64_t hash = 0xcbf29ce484222325)
+{
+    auto p = static_cast<const uint8_t*>(data);
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        std::memcpy(&word, p + i, 8);
+        hash = ((hash << 23 | hash >> 41) ^ word) * 0x100000001b3;
+    }
+    return fnv1a(p + i, size - i, hash);
+}
+
+// https://en.wikipedia.org/wiki/Cyclic_redundancy_check
+// The zlib / PNG CRC-32, the one ROM databases list. Pass the previous result
+// to continue a running CRC.
+inline constexpr auto crc32Table = [] {
+    std::array<uint32_t, 256> table {};
+    for (uint32_t i = 0; i < 256; i++) {
+        auto c = i;
+        for (int k = 0; k < 8; k++) {
+            c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+        }
+        table[i] = c;
+    }
+    return table;
+}();
+
+inline uint32_t crc32(const void* data, size_t size, uint32_t crc = 0)
+{
+    auto p = static_cast<const uint8_t*>(data);
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++) {
+        crc = crc32Table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+// https://en.wikipedia.org/wiki/SHA-1
+using Sha1Digest = std::array<uint8_t, 20>;
+inline Sha1Digest sha1(const void* data, size_t size)
+{
+    uint32_t h[5] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0 };
+    auto rotl = [](uint32_t x, int n) { return x << n | x >> (32 - n); };
+    auto block = [&](const uint8_t* p) {
+        uint32_t w[80];
+        for (int i = 0; i < 16; i++) {
+            w[i] = uint32_t(p[i * 4]) << 24 | p[i * 4 + 1] << 16 | p[i * 4 + 2] << 8 | p[i * 4 + 3];
+        }
+        for (int i = 16; i < 80; i++) {
+            w[i] = rotl(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+        }
+        auto a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for (int i = 0; i < 80; i++) {
+            uint32_t f, k;
+            if (i < 20) {
+                f = (b & c) | (~b & d), k = 0x5a827999;
+            } else if (i < 40) {
+                f = b ^ c ^ d, k = 0x6ed9eba1;
+            } else if (i < 60) {
+                f = (b & c) | (b & d) | (c & d), k = 0x8f1bbcdc;
+            } else {
+                f = b ^ c ^ d, k = 0xca62c1d6;
+            }
+            auto t = rotl(a, 5) + f + e + k + w[i];
+            e = d, d = c, c = rotl(b, 30), b = a, a = t;
+        }
+        h[0] += a, h[1] += b, h[2] += c, h[3] += d, h[4] += e;
+    };
+
+    auto p = static_cast<const uint8_t*>(data);
+    size_t i = 0;
+    for (; i + 64 <= size; i += 64) {
+        block(p + i);
+    }
+    // The tail, a one bit, zeros and the length in bits
+    uint8_t last[128] = {};
+    auto rest = size - i;
+    std::copy(p + i, p + size, last);
+    last[rest] = 0x80;
+    auto blocks = rest < 56 ? 1 : 2;
+    uint64_t bits = uint64_t(size) * 8;
+    for (int j = 0; j < 8; j++) {
+        last[blocks * 64 - 1 - j] = uint8_t(bits >> (j * 8));
+    }
+    for (int j = 0; j < blocks; j++) {
+        block(last + j * 64);
+    }
+
+    Sha1Digest digest;
+    for (int j = 0; j < 20; j++) {
+        digest[j] = uint8_t(h[j / 4] >> (24 - (j % 4) * 8));
+    }
+    return digest;
+}
@@ -0,0 +1,64 @@
+#pragma once
+#include <array>
+#include <cstdint>
+
+#include "bus.hpp"
+#include "state.hpp"
+
+// https://www.nesdev.org/wiki/Standard_controller
+// https://www.nesdev.org/wiki/Controller_reading
+// Two standard controllers on $4016 and $4017. Writing 1 to bit 0 of $4016
+// (strobe) continuously reloads the shift registers from the buttons, writing 0
+// latches them, and each read then returns the next button in bit 0.
+class Controllers : public Mem {
+private:
+    std::array<uint8_t, 2> shift {};
+    bool strobe = false;
+
+public:
+    // One byte per controller, bit 0 first: A, B, Select, Start, Up, Down, Left, Right
+    enum {
+        A = 0x01,
+        B = 0x02,
+        Select = 0x04,
+        Start = 0x08,
+        Up = 0x10,
+        Down = 0x20,
+        Left = 0x40,
+        Right = 0x80,
+    };
+    std::array<uint8_t, 2> buttons {};
+
+    void state(Serializer& s)
+    {
+        s(shift);
+        s(strobe);
+        s(buttons);
+    }
+
+    // Addresses are relative to $4000
+    virtual void set(uint16_t addr, uint8_t value) override
+    {
+        if (addr == 0x16) {
+            strobe = value & 1;
+            if (strobe) {
+                shift = buttons;
+            }
+        }
+    }
+
+    virtual uint8_t get(uint16_t addr) override
+    {
+        if (addr != 0x16 && addr != 0x17) {
+            return 0;
+        }
+
+        auto port = addr - 0x16;
+        if (strobe) {
+            shift[port] = buttons[port];
+        }
+        uint8_t bit = shift[port] & 1;
+        shift[port] = shift[port] >> 1 | 0x80; // official controllers read 1 after the 8th button
+        return 0x40 | bit; // the upper bits are open bus, usually $40 from the address
+    }
+};
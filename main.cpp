@@ -1,40 +1,443 @@
+#include <chrono>
 #include <cstdint>
+#include <cstdio>
+#include <cstdlib>
 #include <fstream>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
 #include <string>
 #include <vector>
 
-#include "bus.hpp"
+#include "audio.hpp"
 #include "cart.hpp"
-#include "clock.hpp"
-#include "cpu.hpp"
-#include "ppu.hpp"
+#include "capture.hpp"
+#include "catalog.hpp"
+#include "console.hpp"
+#include "movie.hpp"
+#include "runner.hpp"
+#include "video.hpp"
+
+// Usage: nes2040 rom.nes [options]
+//        nes2040 --batch list.txt [options]
+// With no options the ROM runs forever in real time and prints how well the
+// sound keeps up every 10 seconds.
+//   --audio command  play the sound by piping it to command (see PipeSink in
+//                  audio.hpp). Without it the sound is paced like a sound card
+//                  would and thrown away, and a note says so at the start.
+//   --video command  show the picture by piping it to command (see
+//                  PipeVideoSink in video.hpp). Without it the frames are
+//                  converted and thrown away, and a note says so too.
+// Any other option switches to a headless run, as fast as possible and
+// without sound, that prints a line of hashes per frame:
+//   --frames N     stop after N frames
+//   --cycles N     stop after N CPU cycles
+//   --input file   play back a movie (see movie.hpp) or bare controller input,
+//                  one byte per controller per frame. Either runs to its end
+//                  (unless --frames says otherwise), and a movie stops with
+//                  an error on the first frame whose hash doesn't match the
+//                  recording.
+//   --record file  save the run, with the input it got, as a movie with hashes
+//   --wav file     write the sound to a WAV file after all
+//   --capture file record the drawn frames to file.y4m, file-000123.png for
+//                  each frame of file.png, or file.nescap (see capture.hpp)
+//   --capture-policy drop|stall
+//                  when the encoder falls behind, lose frames (the default)
+//                  or wait for it
+//   --render mode  "dot" runs the PPU dot by dot, "scanline" (the default) a line at a time
+//   --draw-every N only draw every Nth frame (0 for none). The hashes of the
+//                  other frames have the last drawn picture, and movies only
+//                  check the drawn ones.
+//   --core mode    "cycle" (the default) runs the CPU cycle by cycle, "instruction"
+//                  an instruction at a time
+// nes2040 --catalog dir [--mapper N] [--hash H] lists the ROMs under dir (path,
+// mapper.submapper, PRG and CHR KB, CRC-32s and SHA-1s, tab separated), keeping
+// an index in dir/.nes2040-catalog so only new or changed files get read.
+// `cut -f1` of it makes a --batch list.
+// --batch runs every line of list.txt ("rom.nes [input]") headless, spread
+// over all cores (or --jobs N threads), and prints the final hashes of each. A
+// list of recorded movies is a determinism regression suite: the exit status
+// is 1 if any of them goes out of sync, jams the CPU or can't run, or if the
+// list itself can't be opened.
+static constexpr int sampleRate = 48000;
+
+struct Options {
+    std::string rom;
+    std::string input;
+    std::string record;
+    std::string wav;
+    std::string audio;
+    std::string video;
+    std::string capture;
+    Capture::Policy capturePolicy = Capture::Policy::Drop;
+    std::string batch;
+    std::string catalog;
+    int mapper = -1;
+    std::string hash;
+    uint64_t frames = UINT64_MAX;
+    uint64_t cycles = UINT64_MAX;
+    Ppu::Render render = Ppu::Render::Scanline;
+    int drawEvery = 1;
+    Cpu::Core core = Cpu::Core::Cycle;
+    unsigned jobs = std::thread::hardware_concurrency();
+    bool headless = false;
+};
+
+static std::string formatHashes(Console& console)
+{
+    auto h = console.hashes();
+    char line[128];
+    std::snprintf(line, sizeof(line), "frame %llu fb %016llx ram %016llx ppu %016llx",
+        (unsigned long long)console.frame(), (unsigned long long)h.framebuffer,
+        (unsigned long long)h.ram, (unsigned long long)h.ppu);
+    return line;
+}
+
+// Run headless until the frame or cycle limit (or the end of the movie, or
+// the CPU jams), calling onFrame after every frame, and recording the frames
+// if recording isn't null. Returns the first frame that didn't match the
+// movie, or -1.
+template <typename F>
+static int64_t runHeadless(Console& console, const Options& options, const Movie& movie, Movie* recording, F onFrame)
+{
+    if (movie.romCrc && movie.romCrc != console.romCrc) {
+        std::fprintf(stderr, "The movie was recorded with another ROM (%08x)\n", movie.romCrc);
+        return 0;
+    }
+    // Without --frames, input runs to its end (a movie, or bare input)
+    auto frames = options.frames == UINT64_MAX && (movie.romCrc || movie.frames()) ? movie.frames() : options.frames;
+    auto endTicks = options.cycles == UINT64_MAX ? INT64_MAX / 2 : int64_t(options.cycles) * 12;
+    while (console.frame() < frames && console.clock.now() < endTicks && !console.jammed()) {
+        movie.input(console);
+        auto frame = console.frame();
+        console.runFrame(endTicks - console.clock.now());
+        if (console.frame() != frame) {
+            if (recording) {
+                recording->record(console);
+            }
+            if (!movie.check(console)) {
+                return frame;
+            }
+            onFrame();
+        }
+    }
+    return -1;
+}
+
+static int runBatch(const Options& options)
+{
+    struct Job {
+        std::string rom;
+        std::string input;
+        std::string result;
+        uint64_t frames = 0;
+        int64_t desync = -1;
+        bool jammed = false;
+        bool failed = false; // didn't run at all
+    };
+    std::vector<Job> jobs;
+    std::ifstream list(options.batch);
+    if (!list) {
+        std::fprintf(stderr, "%s: can't open\n", options.batch.c_str());
+        return 1;
+    }
+    for (std::string line; std::getline(list, line);) {
+        std::istringstream fields(line);
+        Job job;
+        if (fields >> job.rom) {
+            fields >> job.input;
+            jobs.push_back(job);
+        }
+    }
+
+    // Load every ROM once, the consoles share them read only. A ROM that
+    // doesn't open is null, and its jobs fail without stopping the others.
+    std::map<std::string, std::shared_ptr<const Rom>> roms;
+    for (auto& job : jobs) {
+        if (!roms.count(job.rom)) {
+            auto rom = std::make_shared<Rom>();
+            roms[job.rom] = rom->open(job.rom) ? rom : nullptr;
+        }
+    }
+
+    auto startTime = std::chrono::steady_clock::now();
+    size_t threads = 0;
+    {
+        Runner runner(options.jobs);
+        threads = runner.threads();
+        for (auto& job : jobs) {
+            runner.submit([&options, &roms, &job] {
+                if (!roms.at(job.rom)) {
+                    job.result = "can't open";
+                    job.failed = true;
+                    return;
+                }
+                Movie movie;
+                if (!job.input.empty() && !movie.load(job.input)) {
+                    job.result = "no input";
+                    job.failed = true;
+                    return;
+                }
+                auto console = std::make_unique<Console>(roms.at(job.rom));
+                console->ppu->render = options.render;
+                console->ppu->drawEvery = options.drawEvery;
+                console->cpu.core = options.core;
+                console->apu->audio = false;
+                job.desync = runHeadless(*console, options, movie, nullptr, [] {});
+                job.result = formatHashes(*console);
+                job.frames = console->frame();
+                job.jammed = console->jammed();
+            });
+        }
+        runner.wait();
+    }
+
+    uint64_t frames = 0;
+    size_t desyncs = 0;
+    size_t failed = 0;
+    for (auto& job : jobs) {
+        std::printf("%s %s %s", job.rom.c_str(), job.input.empty() ? "-" : job.input.c_str(), job.result.c_str());
+        if (job.desync >= 0) {
+            std::printf(" DESYNC at frame %lld", (long long)job.desync);
+            desyncs++;
+        }
+        if (job.jammed) {
+            std::printf(" JAMMED at frame %llu", (unsigned long long)job.frames);
+        }
+        failed += job.jammed || job.failed;
+        std::printf("\n");
+        frames += job.frames;
+    }
+    auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+    std::fprintf(stderr, "%zu runs, %llu frames in %.3fs (%.1f fps) on %zu threads, %zu out of sync, %zu failed\n",
+        jobs.size(), (unsigned long long)frames, seconds, frames / seconds, threads, desyncs, failed);
+    return desyncs || failed ? 1 : 0;
+}
+
+static int listCatalog(const Options& options)
+{
+    Catalog catalog;
+    auto index = options.catalog + "/.nes2040-catalog";
+    catalog.load(index);
+    auto stats = catalog.scan(options.catalog);
+    if (stats.added || stats.removed) {
+        catalog.save(index);
+    }
+    std::fprintf(stderr, "%zu ROMs: %zu unchanged, %zu new, %zu removed, %zu unreadable\n",
+        catalog.entries.size(), stats.kept, stats.added, stats.removed, stats.failed);
+
+    std::vector<const Catalog::Entry*> entries;
+    if (!options.hash.empty()) {
+        entries = catalog.withHash(options.hash);
+    } else if (options.mapper >= 0) {
+        entries = catalog.withMapper(options.mapper);
+    } else {
+        for (const auto& e : catalog.entries) {
+            entries.push_back(&e);
+        }
+    }
+    for (const auto* e : entries) {
+        if (options.mapper >= 0 && e->header.mapper != options.mapper) {
+            continue;
+        }
+        std::printf("%s\t%d.%d\t%zu\t%zu\t%s\t%s\t%s\t%s\n", e->path.c_str(), e->header.mapper, e->header.submapper,
+            e->header.prgRomSize / 1024, e->header.chrRomSize / 1024,
+            Catalog::toHex(e->prgCrc).c_str(), Catalog::toHex(e->chrCrc).c_str(),
+            Catalog::toHex(e->prgSha1).c_str(), Catalog::toHex(e->chrSha1).c_str());
+    }
+    return 0;
+}
 
 int main(int argc, char** argv)
 {
-    Rom cart;
-    cart.open(argv[1]);
-
-    Bus bus;
-    auto ppu = std::make_shared<Ppu>();
-    ppu->chrRom = cart.chrRomBegin();
-    bus.ram = std::make_shared<Ram<2048>>();
-    bus.prgRom = std::make_shared<PrgRom>(cart.prgRomBegin(), cart.prgRomSize());
-    bus.ppuMem = ppu;
-
-    Cpu cpu(bus);
-
-    Clock clock;
-    clock.addDivizor(12, [&]() {
-        cpu.clk();
-        bus.clk();
-    });
-    clock.addDivizor(4, [&]() {
-        ppu->clk();
+    Options options;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg.rfind("--", 0) != 0) {
+            options.rom = arg;
+            continue;
+        }
+        if (i + 1 == argc) {
+            std::fprintf(stderr, "Missing value for %s\n", argv[i]);
+            return 1;
+        }
+        std::string value = argv[++i];
+        // Real time, not headless
+        if (arg == "--audio") {
+            options.audio = value;
+            continue;
+        }
+        if (arg == "--video") {
+            options.video = value;
+            continue;
+        }
+        if (arg == "--frames") {
+            options.frames = std::strtoull(value.c_str(), nullptr, 0);
+        } else if (arg == "--cycles") {
+            options.cycles = std::strtoull(value.c_str(), nullptr, 0);
+        } else if (arg == "--input") {
+            options.input = value;
+        } else if (arg == "--record") {
+            options.record = value;
+        } else if (arg == "--wav") {
+            options.wav = value;
+        } else if (arg == "--capture") {
+            options.capture = value;
+        } else if (arg == "--capture-policy") {
+            options.capturePolicy = value == "stall" ? Capture::Policy::Stall : Capture::Policy::Drop;
+        } else if (arg == "--render") {
+            options.render = value == "dot" ? Ppu::Render::Dot : Ppu::Render::Scanline;
+        } else if (arg == "--draw-every") {
+            options.drawEvery = std::strtol(value.c_str(), nullptr, 0);
+        } else if (arg == "--core") {
+            options.core = value == "instruction" ? Cpu::Core::Instruction : Cpu::Core::Cycle;
+        } else if (arg == "--catalog") {
+            options.catalog = value;
+        } else if (arg == "--mapper") {
+            options.mapper = std::strtol(value.c_str(), nullptr, 0);
+        } else if (arg == "--hash") {
+            options.hash = value;
+        } else if (arg == "--batch") {
+            options.batch = value;
+        } else if (arg == "--jobs") {
+            options.jobs = std::strtoul(value.c_str(), nullptr, 0);
+        } else {
+            std::fprintf(stderr, "Unknown option %s\n", argv[i - 1]);
+            return 1;
+        }
+        options.headless = true;
+    }
+
+    if (!options.catalog.empty()) {
+        return listCatalog(options);
+    }
+    if (!options.batch.empty()) {
+        return runBatch(options);
+    }
+    if (options.rom.empty()) {
+        std::fprintf(stderr, "usage: %s rom.nes [--frames N] [--cycles N] [--audio command] [--video command] [--input file] [--record file] [--wav file] [--capture file] [--capture-policy drop|stall] [--render dot|scanline] [--draw-every N] [--core cycle|instruction]\n", argv[0]);
+        std::fprintf(stderr, "       %s --batch list.txt [--frames N] [--cycles N] [--draw-every N] [--jobs N]\n", argv[0]);
+        std::fprintf(stderr, "       %s --catalog dir [--mapper N] [--hash crc32|sha1]\n", argv[0]);
+        return 1;
+    }
+
+    auto cart = std::make_shared<Rom>();
+    if (!cart->open(options.rom)) {
+        std::fprintf(stderr, "Failed to open %s\n", options.rom.c_str());
+        return 1;
+    }
+    auto console = std::make_unique<Console>(cart);
+    console->ppu->render = options.render;
+    console->ppu->drawEvery = options.drawEvery;
+    console->cpu.core = options.core;
+    console->apu->audio = !options.headless || !options.wav.empty();
+
+    std::unique_ptr<AudioSink> sink = std::make_unique<NullSink>();
+    if (!options.headless && options.audio.empty()) {
+        std::fprintf(stderr, "No --audio command, the sound goes nowhere\n");
+    } else if (!options.headless) {
+        auto pipe = std::make_unique<PipeSink>(options.audio);
+        if (!pipe->ok()) {
+            return 1;
+        }
+        sink = std::move(pipe);
+    }
+    if (!options.wav.empty()) {
+        auto wav = std::make_unique<WavSink>(options.wav, sampleRate);
+        if (!wav->ok()) {
+            return 1;
+        }
+        sink = std::move(wav);
+    }
+    AudioOutput audio(std::move(sink), sampleRate, !options.headless);
+    console->onFrame = [&] {
+        console->apu->setRateRatio(audio.push(console->apu->samples));
+    };
+
+    if (!options.headless) {
+        std::unique_ptr<VideoSink> videoSink = std::make_unique<NullVideoSink>();
+        if (options.video.empty()) {
+            std::fprintf(stderr, "No --video command, the picture goes nowhere\n");
+        } else {
+            auto pipe = std::make_unique<PipeVideoSink>(options.video);
+            if (!pipe->ok()) {
+                return 1;
+            }
+            videoSink = std::move(pipe);
+        }
+        VideoOutput video(std::move(videoSink));
+        console->onFrame = [&] {
+            console->apu->setRateRatio(audio.push(console->apu->samples));
+            if (console->ppu->drawn()) {
+                video.push(*console->ppu);
+            }
+            // How well the sound keeps up, every 10 seconds
+            if (console->frame() % 600 == 0) {
+                auto m = audio.metrics();
+                std::fprintf(stderr, "audio: %zu of %zu samples in the ring, rate %.4f, %llu underruns, %llu dropped\n",
+                    m.fill, m.target, m.ratio, (unsigned long long)m.underruns, (unsigned long long)m.dropped);
+            }
+        };
+        console->run();
+        return 0;
+    }
+
+    Movie movie;
+    if (!options.input.empty() && !movie.load(options.input)) {
+        return 1;
+    }
+    std::unique_ptr<Capture> capture;
+    if (!options.capture.empty()) {
+        auto encoder = openCapture(options.capture);
+        if (!encoder) {
+            return 1;
+        }
+        capture = std::make_unique<Capture>(std::move(encoder), options.capturePolicy);
+    }
+    Movie recording;
+    auto startTime = std::chrono::steady_clock::now();
+    auto desync = runHeadless(*console, options, movie, options.record.empty() ? nullptr : &recording, [&] {
+        std::printf("%s\n", formatHashes(*console).c_str());
+        if (capture && console->ppu->drawn()) {
+            capture->push(*console->ppu);
+        }
     });
+    if (console->frame() == 0 || options.cycles != UINT64_MAX) {
+        std::printf("%s\n", formatHashes(*console).c_str());
+    }
+    if (!options.record.empty() && !recording.save(options.record)) {
+        return 1;
+    }
+    if (desync >= 0) {
+        std::fprintf(stderr, "Out of sync with the movie at frame %lld\n", (long long)desync);
+        return 1;
+    }
+    if (console->jammed()) {
+        std::fprintf(stderr, "The CPU jammed at frame %llu\n", (unsigned long long)console->frame());
+        return 1;
+    }
 
-    clock.run();
+    auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+    std::fprintf(stderr, "%llu frames, %llu cycles in %.3fs (%.1f fps)\n",
+        (unsigned long long)console->frame(), (unsigned long long)console->cycles(), seconds, console->frame() / seconds);
+    auto chr = console->ppu->chrCacheStats();
+    std::fprintf(stderr, "chr cache: %zu KB predecoded + %zu KB in the PPU, %llu fetches, %.2f%% hits\n",
+        cart->decodedChr.size() * sizeof(DecodedTile) / 1024, chr.bytes / 1024, (unsigned long long)chr.fetches,
+        chr.fetches ? 100.0 * (chr.fetches - chr.decodes) / chr.fetches : 100.0);
+    if (capture) {
+        capture->finish();
+        auto m = capture->metrics();
+        std::fprintf(stderr, "capture: %llu frames written, %llu dropped, %llu stalls, %llu failed\n",
+            (unsigned long long)m.written, (unsigned long long)m.dropped, (unsigned long long)m.stalls,
+            (unsigned long long)m.failed);
+    }
+    if (!options.wav.empty()) {
+        auto m = audio.metrics();
+        std::fprintf(stderr, "audio: %llu samples queued, %zu in the ring, %llu dropped\n",
+            (unsigned long long)(m.played + m.fill), m.fill, (unsigned long long)m.dropped);
+    }
     return 0;
 }
 
-// reset;g++ -std=c++17 main.cpp  && ./a.out rom.nes
\ No newline at end of file
+// reset;g++ -std=c++17 -O2 -pthread main.cpp  && ./a.out rom.nes
@@ -0,0 +1,455 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "bus.hpp"
+#include "cart.hpp"
+#include "ppu.hpp"
+#include "state.hpp"
+#include "trace.hpp"
+
+// https://www.nesdev.org/wiki/Mapper
+// The cartridge board. It owns the PRG and CHR RAM and decides which banks the
+// CPU sees at $6000-$FFFF and the PPU at $0000-$1FFF. Banks are switched by
+// repointing the bus and PPU page tables, so a switched bank reads exactly as
+// fast as NROM, and only writes to the mapper registers reach set().
+//
+// The bus decodes 256 byte pages, so the mapper is mapped from $4100;
+// $4020-$40FF share their page with the APU and I/O registers.
+class Mapper : public Mem {
+public:
+    // Written pages of the PRG RAM window at $6000-$7FFF, the first 8KB of
+    // prgRam
+    DirtyPages<32> prgRamDirty;
+
+    // The CPU cycle of the access being made, for the boards that time
+    // register writes
+    std::function<int64_t()> cpuCycle = [] { return int64_t(0); };
+
+    Mapper(std::shared_ptr<const Rom> rom, Bus& bus, Ppu& ppu)
+        : rom(rom)
+        , bus(bus)
+        , ppu(ppu)
+    {
+        const auto& h = rom->header;
+        if (auto ram = h.prgRamSize + h.prgNvramSize; ram || h.trainer) {
+            prgRam.resize(std::max<size_t>(ram, 0x2000));
+        }
+        if (h.trainer) {
+            std::copy(rom->trainer.begin(), rom->trainer.end(), prgRam.begin() + 0x1000);
+        }
+        if (rom->chr.empty()) {
+            chrRam.resize(std::max<size_t>(h.chrRamSize + h.chrNvramSize, 0x2000));
+        }
+        ppu.mirror(h.fourScreen ? Ppu::Mirroring::FourScreen
+                : h.verticalMirroring  ? Ppu::Mirroring::Vertical
+                                       : Ppu::Mirroring::Horizontal);
+    }
+    virtual ~Mapper() override = default;
+
+    // Map the banks the registers select (at power up, and after loading a state)
+    virtual void update() = 0;
+
+    // Derived boards add their registers
+    virtual void state(Serializer& s)
+    {
+        s.vector(prgRam);
+        s.vector(chrRam);
+        if (s.loading()) {
+            prgRamDirty.markAll();
+        }
+    }
+
+    // The pages of a snapshot not written since the last one (Console::snapshot)
+    void unwrittenPages(const StateLayout& layout, std::vector<StateRange>& out)
+    {
+        auto written = prgRamDirty.take(DirtyReader::Snapshots);
+        auto size = std::min<size_t>(prgRam.size(), 0x2000);
+        prgRamDirty.unwritten(written, 0, size, prgRam.empty() ? SIZE_MAX : layout.offset(prgRam.data()), out);
+    }
+
+    // Called by the PPU once per rendered line, for the boards that say they
+    // count them (the PPU stops on every line for those)
+    virtual bool countsScanlines() const { return false; }
+    virtual void scanline() { }
+
+    // Only reached where no bank is mapped ($4100-$5FFF, disabled PRG RAM)
+    virtual uint8_t get(uint16_t) override { return bus.data; } // open bus
+    virtual void set(uint16_t, uint8_t) override { }
+
+    // nullptr if the board isn't supported
+    static std::shared_ptr<Mapper> create(std::shared_ptr<const Rom> rom, Bus& bus, Ppu& ppu);
+
+protected:
+    std::shared_ptr<const Rom> rom;
+    Bus& bus;
+    Ppu& ppu;
+    std::vector<uint8_t> prgRam;
+    std::vector<uint8_t> chrRam;
+
+    static int wrap(int bank, int count)
+    {
+        return ((bank % count) + count) % count;
+    }
+
+    // Map PRG ROM bank number bank, of size bytes, at addr. Negative banks
+    // count back from the last one. A bank bigger than the whole ROM (32KB on
+    // a 16KB NROM) repeats it, 8KB at a time, which is as small as PRG ROM
+    // gets.
+    void mapPrg(uint16_t addr, int size, int bank)
+    {
+        bank = wrap(bank, std::max<int>(rom->prg.size() / size, 1));
+        for (int offset = 0; offset < size; offset += 0x2000) {
+            auto start = (size_t(bank) * size + offset) % rom->prg.size();
+            bus.remap(addr + offset, addr + offset + std::min(size, 0x2000), rom->prg.data() + start, nullptr);
+        }
+    }
+
+    // Map CHR bank number bank, of size bytes, at PPU address addr
+    void mapChr(uint16_t addr, int size, int bank)
+    {
+        auto total = chrRam.empty() ? rom->chr.size() : chrRam.size();
+        bank = wrap(bank, std::max<int>(total / size, 1));
+        for (int i = 0; i < size / 0x400; i++) {
+            auto k = (bank * size / 0x400 + i) % (total / 0x400);
+            if (chrRam.empty()) {
+                ppu.mapChr(addr / 0x400 + i, rom->chr.data() + k * 0x400, rom->decodedChrBank(k));
+            } else {
+                ppu.mapChrRam(addr / 0x400 + i, chrRam.data() + k * 0x400);
+            }
+        }
+    }
+
+    // https://www.nesdev.org/wiki/Bus_conflict
+    // Boards built from discrete logic don't disable the ROM when the CPU
+    // writes to a register in its range, so both drive the bus and the
+    // register gets the AND of the value and the ROM byte there. NES 2.0
+    // submapper 1 marks the boards that avoid it.
+    uint8_t busConflict(uint16_t addr, uint8_t value) const
+    {
+        if (rom->header.submapper == 1) {
+            return value;
+        }
+        auto page = bus.readPage(addr);
+        return page ? value & page[addr & 0xff] : value;
+    }
+
+    void mapPrgRam(bool enabled, bool writable = true)
+    {
+        if (prgRam.empty() || !enabled) {
+            bus.remap(0x6000, 0x8000, nullptr, nullptr);
+        } else {
+            bus.remap(0x6000, 0x8000, prgRam.data(), writable ? prgRam.data() : nullptr, prgRamDirty.bits.data());
+        }
+    }
+};
+
+// https://www.nesdev.org/wiki/NROM
+// 16 or 32KB of PRG (16KB is mirrored), 8KB of CHR, no registers
+class Nrom : public Mapper {
+public:
+    using Mapper::Mapper;
+
+    virtual void update() override
+    {
+        mapPrg(0x8000, 0x4000, 0);
+        mapPrg(0xc000, 0x4000, -1);
+        mapChr(0x0000, 0x2000, 0);
+        mapPrgRam(true);
+    }
+};
+
+// https://www.nesdev.org/wiki/MMC1
+// Registers are loaded a bit at a time through a 5 bit shift register. A
+// write on the cycle right after another is ignored, so of the two writes a
+// read-modify-write instruction makes only the first counts (Bill & Ted's
+// Excellent Adventure resets the register with INC).
+class Mmc1 : public Mapper {
+private:
+    uint8_t shift = 0x10; // the 1 reaches bit 0 on the fifth write
+    uint8_t control = 0x0c;
+    uint8_t chr0 = 0;
+    uint8_t chr1 = 0;
+    uint8_t prg = 0;
+    int64_t lastWrite = -2; // CPU cycle
+
+public:
+    using Mapper::Mapper;
+
+    virtual void update() override
+    {
+        static constexpr Ppu::Mirroring mirroring[4] = {
+            Ppu::Mirroring::SingleLower,
+            Ppu::Mirroring::SingleUpper,
+            Ppu::Mirroring::Vertical,
+            Ppu::Mirroring::Horizontal,
+        };
+        ppu.mirror(mirroring[control & 3]);
+
+        // 512KB boards (SUROM) pick the 256KB half with bit 4 of the CHR register
+        int outer = rom->prg.size() > 0x40000 ? chr0 & 0x10 : 0;
+        int bank = (prg & 0x0f) | outer;
+        switch (control >> 2 & 3) {
+        case 0:
+        case 1:
+            mapPrg(0x8000, 0x8000, bank >> 1);
+            break;
+        case 2:
+            mapPrg(0x8000, 0x4000, outer);
+            mapPrg(0xc000, 0x4000, bank);
+            break;
+        case 3:
+            mapPrg(0x8000, 0x4000, bank);
+            mapPrg(0xc000, 0x4000, 0x0f | outer);
+            break;
+        }
+
+        if (control & 0x10) {
+            mapChr(0x0000, 0x1000, chr0);
+            mapChr(0x1000, 0x1000, chr1);
+        } else {
+            mapChr(0x0000, 0x2000, chr0 >> 1);
+        }
+        mapPrgRam(!(prg & 0x10));
+    }
+
+    virtual void state(Serializer& s) override
+    {
+        Mapper::state(s);
+        s(shift);
+        s(control);
+        s(chr0);
+        s(chr1);
+        s(prg);
+        s(lastWrite);
+    }
+
+    virtual void set(uint16_t addr, uint8_t value) override
+    {
+        if (addr < 0x8000) {
+            return;
+        }
+        // The instruction core makes both writes of a read-modify-write at
+        // the cycle the instruction starts, the cycle core on consecutive ones
+        auto cycle = cpuCycle();
+        auto consecutive = cycle - lastWrite <= 1;
+        lastWrite = cycle;
+        if (consecutive) {
+            return;
+        }
+        if (value & 0x80) {
+            shift = 0x10;
+            control |= 0x0c;
+            update();
+            return;
+        }
+        auto full = shift & 1;
+        shift = shift >> 1 | (value & 1) << 4;
+        if (!full) {
+            return;
+        }
+
+        trace<Trace::Mapper>("MMC1 register %04x = %02x", addr & 0xe000, shift);
+        switch (addr >> 13 & 3) {
+        case 0: control = shift; break;
+        case 1: chr0 = shift; break;
+        case 2: chr1 = shift; break;
+        case 3: prg = shift; break;
+        }
+        shift = 0x10;
+        update();
+    }
+};
+
+// https://www.nesdev.org/wiki/UxROM
+// A switchable 16KB bank at $8000, the last bank fixed at $C000. The bank
+// register has bus conflicts.
+class Uxrom : public Mapper {
+private:
+    uint8_t bank = 0;
+
+public:
+    using Mapper::Mapper;
+
+    virtual void update() override
+    {
+        mapPrg(0x8000, 0x4000, bank);
+        mapPrg(0xc000, 0x4000, -1);
+        mapChr(0x0000, 0x2000, 0);
+        mapPrgRam(true);
+    }
+
+    virtual void state(Serializer& s) override
+    {
+        Mapper::state(s);
+        s(bank);
+    }
+
+    virtual void set(uint16_t addr, uint8_t value) override
+    {
+        if (addr >= 0x8000) {
+            bank = busConflict(addr, value);
+            trace<Trace::Mapper>("UxROM PRG bank %02x", bank);
+            mapPrg(0x8000, 0x4000, bank);
+        }
+    }
+};
+
+// https://www.nesdev.org/wiki/INES_Mapper_003
+// NROM with a switchable 8KB CHR bank. The bank register has bus conflicts.
+class Cnrom : public Nrom {
+private:
+    uint8_t bank = 0;
+
+public:
+    using Nrom::Nrom;
+
+    virtual void update() override
+    {
+        Nrom::update();
+        mapChr(0x0000, 0x2000, bank);
+    }
+
+    virtual void state(Serializer& s) override
+    {
+        Mapper::state(s);
+        s(bank);
+    }
+
+    virtual void set(uint16_t addr, uint8_t value) override
+    {
+        if (addr >= 0x8000) {
+            bank = busConflict(addr, value);
+            trace<Trace::Mapper>("CNROM CHR bank %02x", bank);
+            mapChr(0x0000, 0x2000, bank);
+        }
+    }
+};
+
+// https://www.nesdev.org/wiki/MMC3
+// Eight bank registers, selected through $8000 and written through $8001, and
+// a scanline counter that raises an IRQ
+class Mmc3 : public Mapper {
+private:
+    uint8_t select = 0;
+    std::array<uint8_t, 8> banks {};
+    uint8_t irqLatch = 0;
+    uint8_t irqCounter = 0;
+    bool irqReload = false;
+    bool irqEnabled = false;
+    uint8_t ramControl = 0x80; // enabled, writable
+
+public:
+    using Mapper::Mapper;
+
+    virtual void update() override
+    {
+        // PRG mode swaps which of $8000 and $C000 is fixed to the second last bank
+        auto swap = select & 0x40 ? 0x4000 : 0;
+        mapPrg(0x8000 ^ swap, 0x2000, banks[6] & 0x3f);
+        mapPrg(0xa000, 0x2000, banks[7] & 0x3f);
+        mapPrg(0xc000 ^ swap, 0x2000, -2);
+        mapPrg(0xe000, 0x2000, -1);
+
+        // CHR inversion swaps the 2KB banks at $0000 with the 1KB ones at $1000
+        auto invert = select & 0x80 ? 0x1000 : 0;
+        mapChr(0x0000 ^ invert, 0x0400, banks[0] & 0xfe);
+        mapChr(0x0400 ^ invert, 0x0400, banks[0] | 1);
+        mapChr(0x0800 ^ invert, 0x0400, banks[1] & 0xfe);
+        mapChr(0x0c00 ^ invert, 0x0400, banks[1] | 1);
+        mapChr(0x1000 ^ invert, 0x0400, banks[2]);
+        mapChr(0x1400 ^ invert, 0x0400, banks[3]);
+        mapChr(0x1800 ^ invert, 0x0400, banks[4]);
+        mapChr(0x1c00 ^ invert, 0x0400, banks[5]);
+        mapPrgRam(ramControl & 0x80, !(ramControl & 0x40));
+    }
+
+    virtual void state(Serializer& s) override
+    {
+        Mapper::state(s);
+        s(select);
+        s(banks);
+        s(irqLatch);
+        s(irqCounter);
+        s(irqReload);
+        s(irqEnabled);
+        s(ramControl);
+    }
+
+    // The counter is clocked by A12 rising, which with the usual layout
+    // (background at $0000, sprites at $1000) happens once per line, when the
+    // sprite fetches start
+    virtual bool countsScanlines() const override { return true; }
+    virtual void scanline() override
+    {
+        if (irqCounter == 0 || irqReload) {
+            irqCounter = irqLatch;
+            irqReload = false;
+        } else {
+            irqCounter--;
+        }
+        if (irqCounter == 0 && irqEnabled) {
+            trace<Trace::Mapper>("MMC3 IRQ");
+            bus.interrupts.raise(Interrupts::Mapper);
+        }
+    }
+
+    virtual void set(uint16_t addr, uint8_t value) override
+    {
+        if (addr < 0x8000) {
+            return;
+        }
+        trace<Trace::Mapper>("MMC3 register %04x = %02x", addr & 0xe001, value);
+        switch (addr & 0xe001) {
+        case 0x8000:
+            select = value;
+            update();
+            break;
+        case 0x8001:
+            banks[select & 7] = value;
+            update();
+            break;
+        case 0xa000:
+            if (!rom->header.fourScreen) {
+                ppu.mirror(value & 1 ? Ppu::Mirroring::Horizontal : Ppu::Mirroring::Vertical);
+            }
+            break;
+        case 0xa001:
+            ramControl = value;
+            mapPrgRam(ramControl & 0x80, !(ramControl & 0x40));
+            break;
+        case 0xc000:
+            irqLatch = value;
+            break;
+        case 0xc001:
+            irqCounter = 0;
+            irqReload = true;
+            break;
+        case 0xe000:
+            irqEnabled = false;
+            bus.interrupts.clear(Interrupts::Mapper);
+            break;
+        case 0xe001:
+            irqEnabled = true;
+            break;
+        }
+    }
+};
+
+inline std::shared_ptr<Mapper> Mapper::create(std::shared_ptr<const Rom> rom, Bus& bus, Ppu& ppu)
+{
+    switch (rom->header.mapper) {
+    case 0: return std::make_shared<Nrom>(rom, bus, ppu);
+    case 1: return std::make_shared<Mmc1>(rom, bus, ppu);
+    case 2: return std::make_shared<Uxrom>(rom, bus, ppu);
+    case 3: return std::make_shared<Cnrom>(rom, bus, ppu);
+    case 4: return std::make_shared<Mmc3>(rom, bus, ppu);
+    default: return nullptr;
+    }
+}
@@ -0,0 +1,149 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "console.hpp"
+#include "hash.hpp"
+
+// https://www.nesdev.org/wiki/Standard_controller
+// Controller input for a run from power up: the buttons of both controllers
+// for every frame, and optionally a hash of the console after every frame, so
+// playing it back checks the emulator still does exactly what it did when it
+// was recorded. The file is an 8 byte magic (the last byte is the version),
+// the CRC-32 of the ROM, the number of frames and flags (bit 0: hashes), all
+// little endian, then 2 bytes of buttons per frame, each followed by its 8
+// byte hash if there are hashes. A file without the magic is bare input, 2
+// bytes per frame. The hashes hold for the --render mode used to record, and
+// have the picture in them, so a run that skips drawing frames can only check
+// the ones it draws.
+class Movie {
+public:
+    uint32_t romCrc = 0; // 0 for bare input, which plays on any ROM
+    std::vector<uint8_t> buttons; // 2 per frame
+    std::vector<uint64_t> hashes; // one per frame, or none
+
+    size_t frames() const { return buttons.size() / 2; }
+
+    // The state after a frame, as one number
+    static uint64_t hash(Console& console)
+    {
+        auto h = console.hashes();
+        uint64_t values[] = { h.framebuffer, h.ram, h.ppu, uint64_t(console.clock.now()) };
+        return fnv1a(values, sizeof(values));
+    }
+
+    bool load(const std::string& path)
+    {
+        romCrc = 0;
+        buttons.clear();
+        hashes.clear();
+        std::ifstream in(path, std::ios::binary);
+        if (!in) {
+            std::fprintf(stderr, "%s: can't open\n", path.c_str());
+            return false;
+        }
+        std::vector<uint8_t> bytes { std::istreambuf_iterator<char>(in), {} };
+        if (bytes.size() < headerSize || !std::equal(magic, magic + 7, bytes.begin())) {
+            buttons = std::move(bytes);
+            buttons.resize(buttons.size() & ~size_t(1));
+            return true;
+        }
+
+        auto frames = get(&bytes[12], 4);
+        auto withHashes = bytes[16] & 1;
+        auto stride = withHashes ? 10 : 2;
+        if (bytes[7] != magic[7] || (bytes.size() - headerSize) / stride < frames) {
+            std::fprintf(stderr, "%s: unsupported version or truncated\n", path.c_str());
+            return false;
+        }
+        romCrc = get(&bytes[8], 4);
+        for (size_t i = 0; i < frames; i++) {
+            auto* p = &bytes[headerSize + i * stride];
+            buttons.push_back(p[0]);
+            buttons.push_back(p[1]);
+            if (withHashes) {
+                hashes.push_back(get(p + 2, 8));
+            }
+        }
+        return true;
+    }
+
+    bool save(const std::string& path) const
+    {
+        std::vector<uint8_t> out(magic, magic + sizeof(magic));
+        put(out, romCrc, 4);
+        put(out, frames(), 4);
+        put(out, hashes.empty() ? 0 : 1, 1);
+        for (size_t i = 0; i < frames(); i++) {
+            out.push_back(buttons[i * 2]);
+            out.push_back(buttons[i * 2 + 1]);
+            if (!hashes.empty()) {
+                put(out, hashes[i], 8);
+            }
+        }
+        std::ofstream file(path, std::ios::binary | std::ios::trunc);
+        if (!file.write((const char*)out.data(), out.size())) {
+            std::fprintf(stderr, "%s: can't write\n", path.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    // Press the buttons of the frame the console is about to run (none past
+    // the end)
+    void input(Console& console) const
+    {
+        auto i = console.frame() * 2;
+        console.controllers->buttons = {
+            i < buttons.size() ? buttons[i] : uint8_t(0),
+            i + 1 < buttons.size() ? buttons[i + 1] : uint8_t(0),
+        };
+    }
+
+    // Append the frame the console just finished, with the buttons it ran with
+    void record(Console& console, bool withHash = true)
+    {
+        romCrc = console.romCrc;
+        auto frame = console.frame() - 1;
+        buttons.resize(frame * 2);
+        buttons.insert(buttons.end(), console.controllers->buttons.begin(), console.controllers->buttons.end());
+        if (withHash) {
+            hashes.resize(frame);
+            hashes.push_back(hash(console));
+        }
+    }
+
+    // Whether the frame the console just finished matches the recording
+    // (frames without a recorded hash, or that the PPU didn't draw, always do)
+    bool check(Console& console) const
+    {
+        auto frame = console.frame() - 1;
+        return frame >= hashes.size() || !console.ppu->drawn() || hash(console) == hashes[frame];
+    }
+
+private:
+    static constexpr uint8_t magic[8] = { 'N', 'E', 'S', 'M', 'O', 'V', 0, 1 }; // last byte is the version
+    static constexpr size_t headerSize = sizeof(magic) + 9;
+
+    // Little endian
+    static void put(std::vector<uint8_t>& out, uint64_t value, int size)
+    {
+        for (int i = 0; i < size; i++) {
+            out.push_back(uint8_t(value >> (i * 8)));
+        }
+    }
+
+    static uint64_t get(const uint8_t* p, int size)
+    {
+        uint64_t value = 0;
+        for (int i = 0; i < size; i++) {
+            value |= uint64_t(p[i]) << (i * 8);
+        }
+        return value;
+    }
+};
@@ -1,7 +1,13 @@
 #pragma once
 #include "bus.hpp"
+#include "hash.hpp"
+#include "state.hpp"
+#include "tile.hpp"
+#include "trace.hpp"
+#include <algorithm>
 #include <array>
 #include <cstdint>
+#include <functional>
 
 /*
 ................XXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXX...........
@@ -30,12 +36,558 @@ public:
 // after a frame or so, faster once the PPU has warmed up, and it is likely that values with
 // alternating bit patterns (such as $55 or $AA) will decay faster.[2]
 class Ppu : public Mem {
+public:
+    // How the cartridge wires the four logical nametables to the PPU's 2KB of RAM
+    // https://www.nesdev.org/wiki/Mirroring
+    enum class Mirroring {
+        Horizontal,
+        Vertical,
+        SingleLower,
+        SingleUpper,
+        FourScreen, // the cartridge supplies the other 2KB
+    };
+
+    // Dot renders every pixel through the real fetch/shift pipeline, one PPU cycle
+    // at a time. Scanline does nothing on most dots and draws a line in one go
+    // (a tile at a time) at dot 256, or earlier, up to the current dot, whenever
+    // the CPU touches a register mid-line. Games that don't change registers in
+    // the middle of a line look the same in both.
+    enum class Render {
+        Dot,
+        Scanline,
+    };
+    Render render = Render::Scanline; // takes effect at the start of the next frame
+
+    // Draw only every drawEvery-th frame (never with 0), for headless runs
+    // that look at the picture now and then. The other frames run everything
+    // the program can see (sprite 0 hit and overflow, vblank and the NMI, the
+    // lines mappers count) but make no pixels, and the framebuffer keeps the
+    // last frame that was drawn. Takes effect at the start of the next frame.
+    int drawEvery = 1;
+
+    // The picture, one palette index per pixel, with the color emphasis bits of
+    // PPUMASK in bits 6-8 (so 512 possible colors)
+    static constexpr int width = 256;
+    static constexpr int height = 240;
+    std::array<uint16_t, width * height> framebuffer {};
+
+    // Frames completed since power up
+    uint64_t frame = 0;
+
+    // Whether the current frame (or, in vblank, the one just completed) is
+    // drawn
+    bool drawn() const { return draw; }
+
+    // https://www.nesdev.org/wiki/PPU_OAM
+    std::array<uint8_t, 256> oam {};
+
+    // Written pages: 0-15 are VRAM, then OAM, then the palette. hash() and
+    // unwrittenPages() use them.
+    static constexpr size_t oamPage = 16;
+    static constexpr size_t palettePage = 17;
+    DirtyPages<18> dirty;
+
+    // Called at dot 260 of every rendered line, where the sprite pattern
+    // fetches begin (scanline counting mappers watch for them)
+    std::function<void()> onScanline;
+
+    // https://www.nesdev.org/wiki/NMI
+    // Where the /NMI output goes. It is low while the vblank flag and the NMI
+    // enable bit of PPUCTRL are both set, and is only updated when one of them
+    // changes.
+    Interrupts* interrupts = nullptr;
+
+    // The console lets the PPU run behind the CPU, and only catches it up when
+    // something could tell: this is called before the CPU or the cartridge
+    // looks at or changes anything the PPU uses, and the console schedules
+    // the cycles eventCycles() counts to.
+    std::function<void()> onAccess;
+
 private:
-    int vblank = 1;
-    int spriteZeroHit = 0;
-    int spriteOverflow = 0;
+    Render active = Render::Scanline;
+    bool draw = true;
+    bool spriteZeroLine = false; // sprite 0 is on the current line
+    std::array<uint16_t, width> hiddenLine {}; // where the pixels of a line that isn't drawn go
+
+    void accessed()
+    {
+        if (onAccess) {
+            onAccess();
+        }
+    }
+
+    void updateNmi()
+    {
+        if (interrupts) {
+            interrupts->nmi = vblank && ctrl & 0x80;
+        }
+    }
+
+    // https://www.nesdev.org/wiki/PPU_registers
+    // TODO https://www.nesdev.org/wiki/PPU_power_up_state
+    uint8_t ctrl = 0;
+    uint8_t mask = 0;
+    uint8_t oamAddr = 0;
+    uint8_t latch = 0; // TODO the latch decays after a frame or so
+    uint8_t readBuffer = 0;
+    bool vblank = true;
+    bool spriteZeroHit = false;
+    bool spriteOverflow = false;
+
+    // https://www.nesdev.org/wiki/PPU_scrolling
+    // v and t are yyy NN YYYYY XXXXX: fine Y, nametable, coarse Y, coarse X
+    uint16_t v = 0; // current VRAM address
+    uint16_t t = 0; // temporary VRAM address, the top left of the screen
+    uint8_t x = 0; // fine X scroll
+    bool w = false; // write toggle for $2005/$2006
+
+    int scanline = 0; // 0-239 visible, 240 post render, 241-260 vblank, 261 pre render
+    int dot = 0; // 0-340
+    bool oddFrame = false;
+
+    Mirroring mirroring = Mirroring::Horizontal;
+    std::array<uint8_t, 4096> vram {};
+    std::array<uint8_t*, 4> nametables {};
+    std::array<uint8_t, 32> palette {};
+    std::array<uint64_t, 18> pageHashes {};
+
+    // Pattern tables, as 1KB banks, so mappers can switch them by moving pointers.
+    // Banks without a write pointer are ROM.
+    std::array<const uint8_t*, 8> chr {};
+    std::array<uint8_t*, 8> chrRam {};
+
+    // The pattern tables expanded to a byte per pixel. Banks of CHR ROM point at
+    // the copy the Rom decoded when it was loaded. Other banks are decoded here a
+    // tile at a time on first use, and again after a bank switch or a write to
+    // the tile.
+    std::array<const DecodedTile*, 8> decodedBanks {};
+    std::array<DecodedTile, 512> decoded;
+    std::array<bool, 512> decodedValid {};
+    uint64_t chrFetches = 0;
+    uint64_t chrDecodes = 0;
+
+    // Background pipeline, https://www.nesdev.org/wiki/PPU_rendering
+    uint8_t nextTile = 0;
+    uint8_t nextAttribute = 0;
+    uint8_t nextLo = 0;
+    uint8_t nextHi = 0;
+    uint16_t patternLo = 0;
+    uint16_t patternHi = 0;
+    uint16_t attributeLo = 0;
+    uint16_t attributeHi = 0;
+
+    // The sprites of the current line, one entry per pixel: pixel in bits 0-1,
+    // palette in 2-3, behind the background in 5, sprite 0 in 6
+    std::array<uint8_t, width> spriteLine {};
+
+    // Scanline mode: pixels of the current line drawn so far, and how many of the
+    // coarse X increments the fetches would have done are already applied to v
+    int rendered = 0;
+    int increments = 0;
+
+    bool rendering() const { return mask & 0x18; }
+    bool renderLine() const { return scanline < 240 || scanline == 261; }
+
+    static int paletteIndex(uint16_t addr)
+    {
+        // $3F10/$3F14/$3F18/$3F1C mirror $3F00/$3F04/$3F08/$3F0C
+        auto i = addr & 0x1f;
+        return (i & 0x13) == 0x10 ? i & 0x0f : i;
+    }
+
+    // https://www.nesdev.org/wiki/PPU_memory_map
+    uint8_t read(uint16_t addr) const
+    {
+        addr &= 0x3fff;
+        if (addr < 0x2000) {
+            return chr[addr >> 10][addr & 0x3ff];
+        }
+        if (addr < 0x3f00) {
+            return nametables[(addr >> 10) & 3][addr & 0x3ff];
+        }
+        return palette[paletteIndex(addr)];
+    }
+
+    void write(uint16_t addr, uint8_t value)
+    {
+        addr &= 0x3fff;
+        if (addr < 0x2000) {
+            if (chrRam[addr >> 10]) {
+                chrRam[addr >> 10][addr & 0x3ff] = value;
+                decodedValid[addr >> 4] = false;
+            }
+        } else if (addr < 0x3f00) {
+            auto* p = &nametables[(addr >> 10) & 3][addr & 0x3ff];
+            *p = value;
+            dirty.mark(p - vram.data());
+        } else {
+            palette[paletteIndex(addr)] = value & 0x3f;
+            dirty.mark(palettePage << 8);
+        }
+    }
+
+    // The decoded pixels of the pattern row at addr (the plane 0 byte)
+    const uint8_t* decodedRow(uint16_t addr)
+    {
+        auto tile = addr >> 4;
+        chrFetches++;
+        if (!decodedValid[tile]) {
+            // a tile never straddles a bank
+            chrDecodes++;
+            decodeTile(chr[tile >> 6] + (tile & 63) * 16, decoded[tile].pixels);
+            decodedValid[tile] = true;
+        }
+        return decodedBanks[tile >> 6][tile & 63].pixels + (addr & 7) * 8;
+    }
+
+    void incrementAddress()
+    {
+        // TODO during rendering this bumps coarse X and Y instead
+        v = (v + (ctrl & 0x04 ? 32 : 1)) & 0x7fff;
+    }
+
+    // Move coarse X (wrapping into the horizontally adjacent nametable) by n tiles
+    static uint16_t advanceX(uint16_t addr, int n)
+    {
+        auto column = ((addr >> 5) & 0x20) | (addr & 0x1f);
+        column = (column + n) & 0x3f;
+        return (addr & ~0x041f) | (column & 0x1f) | ((column & 0x20) << 5);
+    }
+
+    void incrementX()
+    {
+        v = advanceX(v, 1);
+    }
+
+    void incrementY()
+    {
+        if ((v & 0x7000) != 0x7000) {
+            v += 0x1000;
+            return;
+        }
+        v &= ~0x7000;
+        auto y = (v & 0x03e0) >> 5;
+        if (y == 29) {
+            y = 0;
+            v ^= 0x0800;
+        } else if (y == 31) {
+            y = 0;
+        } else {
+            y++;
+        }
+        v = (v & ~0x03e0) | (y << 5);
+    }
+
+    void copyX() { v = (v & ~0x041f) | (t & 0x041f); }
+    void copyY() { v = (v & ~0x7be0) | (t & 0x7be0); }
+
+    uint8_t tileAt(uint16_t addr) const
+    {
+        return read(0x2000 | (addr & 0x0fff));
+    }
+
+    // The two bit palette of the 16x16 area addr falls in
+    uint8_t attributeAt(uint16_t addr) const
+    {
+        uint8_t attribute = read(0x23c0 | (addr & 0x0c00) | ((addr >> 4) & 0x38) | ((addr >> 2) & 0x07));
+        return attribute >> ((addr & 0x40) >> 4 | (addr & 0x02)) & 3;
+    }
+
+    uint16_t patternAt(uint8_t tile) const
+    {
+        return (ctrl & 0x10) << 8 | tile << 4 | (v >> 12 & 7);
+    }
+
+    uint16_t color(int index) const
+    {
+        auto c = palette[index] & (mask & 0x01 ? 0x30 : 0x3f); // greyscale
+        return c | (mask & 0xe0) << 1;
+    }
+
+    // Combine a background pixel (palette in bits 2-3) with the sprites
+    uint16_t pixel(int px, int background)
+    {
+        auto sprite = spriteLine[px];
+        if (!(mask & 0x10) || (px < 8 && !(mask & 0x04))) {
+            sprite = 0;
+        }
+        if (!(mask & 0x08) || (px < 8 && !(mask & 0x02))) {
+            background = 0;
+        }
+
+        // https://www.nesdev.org/wiki/PPU_sprite_priority
+        if (!(sprite & 3)) {
+            return color(background & 3 ? background : 0);
+        }
+        if (!(background & 3)) {
+            return color(0x10 | (sprite & 0x0f));
+        }
+        if (sprite & 0x40 && px != 255) {
+            spriteZeroHit = true;
+        }
+        return color(sprite & 0x20 ? background : 0x10 | (sprite & 0x0f));
+    }
+
+    // With rendering off the PPU shows the backdrop, or the palette entry v
+    // points at if it points into the palette
+    uint16_t backdrop() const
+    {
+        return color((v & 0x3f00) == 0x3f00 ? paletteIndex(v) : 0);
+    }
+
+    // Find the sprites on the next line and lay them out in spriteLine
+    // https://www.nesdev.org/wiki/PPU_sprite_evaluation
+    void evaluateSprites()
+    {
+        spriteLine.fill(0);
+        spriteZeroLine = false;
+        if (scanline == 261) {
+            return; // nothing is ever drawn on line 0
+        }
+
+        int height = ctrl & 0x20 ? 16 : 8;
+        auto visible = [&](uint8_t y) {
+            return unsigned(scanline - y) < unsigned(height);
+        };
+        std::array<int, 8> found;
+        int count = 0;
+        int n = 0;
+        for (; n < 64 && count < 8; n++) {
+            if (visible(oam[n * 4])) {
+                found[count++] = n;
+            }
+        }
+        // After eight sprites the hardware also steps through the bytes of
+        // each entry, so it checks the wrong byte for Y
+        for (int m = 0; count == 8 && n < 64; n++, m = (m + 1) & 3) {
+            if (visible(oam[n * 4 + m])) {
+                spriteOverflow = true;
+                break;
+            }
+        }
+
+        // A frame that isn't drawn only needs sprite 0, for its hit
+        spriteZeroLine = count && found[0] == 0;
+        if (!draw) {
+            count = spriteZeroLine ? 1 : 0;
+        }
+        for (int i = 0; i < count; i++) {
+            const auto* s = &oam[found[i] * 4];
+            auto tile = s[1];
+            auto attributes = s[2];
+            int row = scanline - s[0];
+            if (attributes & 0x80) {
+                row = height - 1 - row;
+            }
+            uint16_t addr;
+            if (height == 16) {
+                addr = (tile & 1) << 12 | (tile & 0xfe) << 4;
+                if (row >= 8) {
+                    addr += 16;
+                    row -= 8;
+                }
+            } else {
+                addr = (ctrl & 0x08) << 9 | tile << 4;
+            }
+            auto pixels = decodedRow(addr + row);
+            uint8_t flags = (attributes & 3) << 2 | (attributes & 0x20) | (found[i] == 0 ? 0x40 : 0);
+            for (int col = 0; col < 8 && s[3] + col < width; col++) {
+                auto p = pixels[attributes & 0x40 ? 7 - col : col];
+                auto& out = spriteLine[s[3] + col];
+                if (p && !(out & 3)) {
+                    out = p | flags;
+                }
+            }
+        }
+    }
+
+    // One cycle of the background pipeline, for Render::Dot
+    void renderDot()
+    {
+        if (rendering()) {
+            if ((dot >= 2 && dot <= 257) || (dot >= 321 && dot <= 337)) {
+                patternLo <<= 1;
+                patternHi <<= 1;
+                attributeLo <<= 1;
+                attributeHi <<= 1;
+                switch ((dot - 1) & 7) {
+                case 0:
+                    patternLo = (patternLo & 0xff00) | nextLo;
+                    patternHi = (patternHi & 0xff00) | nextHi;
+                    attributeLo = (attributeLo & 0xff00) | (nextAttribute & 1 ? 0xff : 0);
+                    attributeHi = (attributeHi & 0xff00) | (nextAttribute & 2 ? 0xff : 0);
+                    nextTile = tileAt(v);
+                    break;
+                case 2:
+                    nextAttribute = attributeAt(v);
+                    break;
+                case 4:
+                    nextLo = read(patternAt(nextTile));
+                    break;
+                case 6:
+                    nextHi = read(patternAt(nextTile) + 8);
+                    break;
+                case 7:
+                    incrementX();
+                    break;
+                }
+            }
+            if (dot == 256) {
+                incrementY();
+            } else if (dot == 257) {
+                copyX();
+                evaluateSprites();
+            } else if (scanline == 261 && dot >= 280 && dot <= 304) {
+                copyY();
+            }
+        }
+
+        if (scanline < 240 && dot >= 1 && dot <= 256 && (draw || (spriteZeroLine && !spriteZeroHit))) {
+            auto px = dot - 1;
+            auto* out = draw ? &framebuffer[scanline * width] : hiddenLine.data();
+            if (!rendering()) {
+                out[px] = backdrop();
+                return;
+            }
+            auto bit = 0x8000 >> x;
+            auto background = (patternLo & bit ? 1 : 0) | (patternHi & bit ? 2 : 0)
+                | (attributeLo & bit ? 4 : 0) | (attributeHi & bit ? 8 : 0);
+            out[px] = pixel(px, background);
+        }
+    }
+
+    // Draw pixels [rendered, end) of the current line, for Render::Scanline
+    void catchUp(int end)
+    {
+        if (end <= rendered) {
+            return;
+        }
+        if (!rendering()) {
+            if (scanline < 240 && draw) {
+                std::fill(&framebuffer[scanline * width + rendered], &framebuffer[scanline * width + end], backdrop());
+            }
+            rendered = end;
+            increments = end >> 3;
+            return;
+        }
+
+        // Lines that aren't drawn only go through the pixels for sprite 0 hit
+        if (scanline < 240 && (draw || (spriteZeroLine && !spriteZeroHit))) {
+            // The fetches for tile k of the line (counting the two fetched at
+            // the end of the previous line) happen while v is at tile k - 2
+            auto* out = draw ? &framebuffer[scanline * width] : hiddenLine.data();
+            for (int px = rendered; px < end;) {
+                auto k = (px + x) >> 3;
+                auto addr = advanceX(v, k - 2 - increments);
+                auto tile = tileAt(addr);
+                auto attribute = attributeAt(addr) << 2;
+                auto pattern = (ctrl & 0x10) << 8 | tile << 4 | (addr >> 12 & 7);
+                auto pixels = decodedRow(pattern);
+                for (auto col = (px + x) & 7; col < 8 && px < end; col++, px++) {
+                    auto p = pixels[col];
+                    out[px] = pixel(px, p ? p | attribute : 0);
+                }
+            }
+        }
+        rendered = end;
+        v = advanceX(v, (end >> 3) - increments);
+        increments = end >> 3;
+    }
+
+    // The CPU is about to look at or change the PPU, so draw everything up to now
+    void sync()
+    {
+        if (active == Render::Scanline && renderLine() && dot <= 256) {
+            catchUp(std::max(dot - 1, 0));
+        }
+    }
+
+    // The next dot of the line that clk() does something on in
+    // Render::Scanline (the line's last dot at the latest, which starts the
+    // next)
+    int nextBusyDot() const
+    {
+        if (renderLine()) {
+            return scanline == 261 && dot <= 1 ? 1 : std::max(dot, 256);
+        }
+        return scanline == 241 && dot <= 1 ? 1 : 340;
+    }
+
+    // Render::Scanline only acts at the end of the visible part of the line and
+    // on the dots that move v around
+    void renderScanline()
+    {
+        if (dot < 256) {
+            return;
+        }
+        if (dot == 256) {
+            catchUp(256);
+            if (rendering()) {
+                incrementY();
+            }
+        } else if (!rendering()) {
+            return;
+        } else if (dot == 257) {
+            copyX();
+            evaluateSprites();
+        } else if (dot == 328 || dot == 336) {
+            incrementX();
+        } else if (scanline == 261 && dot >= 280 && dot <= 304) {
+            copyY();
+        }
+    }
 
 public:
+    Ppu()
+    {
+        dirty.markAll();
+        mirror(Mirroring::Horizontal);
+    }
+
+    // Point a 1KB pattern table bank at ROM, and at its decoded tiles if there
+    // are any (otherwise they get decoded as they are used)
+    void mapChr(int bank, const uint8_t* data, const DecodedTile* predecoded = nullptr)
+    {
+        accessed();
+        chr[bank] = data;
+        chrRam[bank] = nullptr;
+        decodedBanks[bank] = predecoded ? predecoded : &decoded[bank * 64];
+        std::fill(&decodedValid[bank * 64], &decodedValid[bank * 64 + 64], predecoded != nullptr);
+    }
+
+    // Point a 1KB pattern table bank at RAM
+    void mapChrRam(int bank, uint8_t* data)
+    {
+        mapChr(bank, data);
+        chrRam[bank] = data;
+    }
+
+    struct ChrCacheStats {
+        uint64_t fetches; // pattern rows read by the renderer
+        uint64_t decodes; // tiles it had to decode first
+        size_t bytes; // size of the PPU's own decoded tiles
+    };
+    ChrCacheStats chrCacheStats() const
+    {
+        return { chrFetches, chrDecodes, sizeof(decoded) };
+    }
+
+    void mirror(Mirroring m)
+    {
+        static constexpr uint8_t layouts[5][4] = {
+            { 0, 0, 1, 1 },
+            { 0, 1, 0, 1 },
+            { 0, 0, 0, 0 },
+            { 1, 1, 1, 1 },
+            { 0, 1, 2, 3 },
+        };
+        accessed();
+        mirroring = m;
+        for (int i = 0; i < 4; i++) {
+            nametables[i] = vram.data() + 0x400 * layouts[int(m)][i];
+        }
+    }
+
     virtual uint8_t get(uint16_t addr) override
     {
         // PPUCTRL   $2000  VPHB SINN   NMI enable(V), PPU master / slave(P), sprite height(H), background tile select(B), sprite tile select(S), increment mode(I), nametable select(NN)
@@ -46,67 +598,270 @@ public:
         // PPUADDR   $2006	aaaa aaaa	PPU read/write address (two writes: most significant byte, least significant byte)
         // PPUDATA	 $2007	dddd dddd	PPU data read/write
         // OAMDMA	 $4014	aaaa aaaa	OAM DMA high address
+        accessed();
+        sync();
         switch (addr) {
         // PPUSTATUS $2002 VSO. .... vblank(V), sprite 0 hit(S), sprite overflow(O); read resets write pair for $2005/$2006
-        case 2: {
-            // TODO reset write pair for $2005/$2006
-            auto status = vblank << 7 | spriteZeroHit << 6 | spriteOverflow << 5;
-            vblank = 0; // TODO emulate latch
-            return status;
+        case 2:
+            latch = vblank << 7 | spriteZeroHit << 6 | spriteOverflow << 5 | (latch & 0x1f);
+            vblank = false;
+            updateNmi();
+            w = false;
+            break;
+        case 4:
+            // the unused attribute bits read back as 0
+            latch = (oamAddr & 3) == 2 ? oam[oamAddr] & 0xe3 : oam[oamAddr];
+            break;
+        case 7: {
+            auto a = v & 0x3fff;
+            if (a < 0x3f00) {
+                // reads go through a buffer, so return the previous one
+                latch = readBuffer;
+                readBuffer = read(a);
+            } else {
+                // except for the palette, but the buffer gets the nametable underneath
+                latch = (latch & 0xc0) | read(a);
+                readBuffer = read(a - 0x1000);
+            }
+            incrementAddress();
+            break;
         }
-        case 0:
-            return 0;
         default:
-            return 0; // we should never get here
+            break; // write only registers return the latch
         }
+        return latch;
     }
 
-    // bool backgroundPatternTableAddress
     virtual void set(uint16_t addr, uint8_t value) override
     {
+        accessed();
+        sync();
+        latch = value;
         switch (addr) {
         case 0:
-            std::fprintf(stderr, "PPUCTRL %02x\n", value);
+            trace<Trace::Ppu>("PPUCTRL %02x", value);
+            ctrl = value;
+            t = (t & ~0x0c00) | (value & 3) << 10;
+            updateNmi(); // enabling it during vblank makes another edge
+            break;
+        case 1:
+            mask = value;
+            break;
+        case 3:
+            oamAddr = value;
+            break;
+        case 4:
+            // TODO writes during rendering only bump the address
+            oam[oamAddr++] = value;
+            dirty.mark(oamPage << 8);
+            break;
+        case 5:
+            if (!w) {
+                t = (t & ~0x001f) | value >> 3;
+                x = value & 7;
+            } else {
+                t = (t & ~0x73e0) | (value & 7) << 12 | (value & 0xf8) << 2;
+            }
+            w = !w;
+            break;
+        case 6:
+            if (!w) {
+                t = (t & 0x00ff) | (value & 0x3f) << 8;
+            } else {
+                t = (t & 0xff00) | value;
+                v = t;
+            }
+            w = !w;
+            break;
+        case 7:
+            write(v, value);
+            incrementAddress();
             break;
         }
     }
 
-public:
-    const uint8_t* chrRom = nullptr;
+    // https://www.nesdev.org/wiki/PPU_registers#OAMDMA
+    // All 256 writes of an OAM DMA to OAMDATA at once, starting at OAMADDR
+    // (and wrapping around to it)
+    void oamDma(const uint8_t* page)
+    {
+        accessed();
+        sync();
+        std::copy(page, page + 256 - oamAddr, oam.begin() + oamAddr);
+        std::copy(page + 256 - oamAddr, page + 256, oam.begin());
+        dirty.mark(oamPage << 8);
+    }
 
-    // https://www.nesdev.org/wiki/PPU_registers
-    // TODO https://www.nesdev.org/wiki/PPU_power_up_state
-    std::array<uint8_t, 8> regs;
-    // TODO emulate the latch
+    // The pattern table banks aren't saved, the mapper maps them again
+    void state(Serializer& s)
+    {
+        if (s.withFramebuffer) {
+            s(framebuffer);
+        }
+        s(frame);
+        s(oam);
+        s(active);
+        s(draw);
+        s(spriteZeroLine);
+        s(ctrl);
+        s(mask);
+        s(oamAddr);
+        s(latch);
+        s(readBuffer);
+        s(vblank);
+        s(spriteZeroHit);
+        s(spriteOverflow);
+        s(v);
+        s(t);
+        s(x);
+        s(w);
+        s(scanline);
+        s(dot);
+        s(oddFrame);
+        s(mirroring);
+        s(vram);
+        s(palette);
+        s(nextTile);
+        s(nextAttribute);
+        s(nextLo);
+        s(nextHi);
+        s(patternLo);
+        s(patternHi);
+        s(attributeLo);
+        s(attributeHi);
+        s(spriteLine);
+        s(rendered);
+        s(increments);
+        if (s.loading()) {
+            mirror(mirroring);
+            dirty.markAll();
+        }
+    }
+
+    // The pages of a snapshot not written since the last one (Console::snapshot)
+    void unwrittenPages(const StateLayout& layout, std::vector<StateRange>& out)
+    {
+        auto written = dirty.take(DirtyReader::Snapshots);
+        dirty.unwritten(written, 0, vram.size(), layout.offset(vram.data()), out);
+        dirty.unwritten(written, oamPage, oam.size(), layout.offset(oam.data()), out);
+        dirty.unwritten(written, palettePage, palette.size(), layout.offset(palette.data()), out);
+    }
+
+    // Fingerprint of the internal state, for regression runs. Only the pages
+    // written since the last call are hashed again.
+    uint64_t hash()
+    {
+        dirty.take(DirtyReader::Hashes, [this](size_t page) {
+            pageHashes[page] = page == oamPage ? fnv1a(oam.data(), oam.size())
+                : page == palettePage          ? fnv1a(palette.data(), palette.size())
+                                               : fnv1a(&vram[page << 8], 256);
+        });
+        auto h = fnv1a(pageHashes.data(), sizeof(pageHashes));
+        int regs[] = { ctrl, mask, oamAddr, latch, readBuffer, vblank, spriteZeroHit, spriteOverflow,
+            v, t, x, w, scanline, dot, oddFrame };
+        return fnv1a(regs, sizeof(regs), h);
+    }
+
+    // The number of cycles up to and including the next one that has an
+    // effect outside the PPU without being asked: the last dot of a frame, the
+    // start of vblank (and its NMI), and dot 260 of every rendered line if
+    // there is an onScanline. The dot that decides whether the pre render line
+    // is cut short is one too, so the count never depends on rendering being
+    // switched on or off in the meantime.
+    int eventCycles() const
+    {
+        constexpr int frameDots = 262 * 341;
+        auto at = scanline * 341 + dot;
+        auto next = frameDots;
+        auto consider = [&](int line, int d) {
+            auto e = line * 341 + d;
+            next = std::min(next, e >= at ? e - at : e + frameDots - at);
+        };
+        consider(239, 340);
+        consider(241, 1);
+        consider(261, 339);
+        if (onScanline) {
+            auto line = dot <= 260 ? scanline : scanline + 1;
+            consider(line >= 240 && line < 261 ? 261 : line % 262, 260);
+        }
+        return next + 1;
+    }
+
+    // Run a number of cycles. Render::Scanline jumps over the dots where it
+    // does nothing instead of ticking through them, which is most of them:
+    // the first 256 of every rendered line and nearly all of vblank.
+    void run(int cycles)
+    {
+        while (cycles > 0) {
+            if (active == Render::Scanline) {
+                auto idle = std::min(nextBusyDot() - dot, cycles);
+                dot += idle;
+                cycles -= idle;
+                if (!cycles) {
+                    break;
+                }
+            }
+            clk();
+            cycles--;
+        }
+    }
 
     // The PPU clock runs 3 tims faster that the CPU clock
     // The are NOT guaranteed to be in sync (CPU tick 0 can be PPU tick 0, 1 or 2)
     // The clock is triggerd
-    int tick = 1;
     void clk()
     {
         // The PPU renders 262 scanlines per frame. Each scanline lasts for 341 PPU clock cycles
         // The VBlank flag of the PPU is set at tick 1 (the second tick) of scanline 241, where the VBlank NMI also occurs.
-        if (tick == 0) {
-            std::fprintf(stderr, "End VBLANK\n");
-            vblank = false;
-        } else if (!vblank && tick == 240 * 341) {
-            std::fprintf(stderr, "Begin VBLANK\n");
+        if (renderLine()) {
+            if (active == Render::Dot) {
+                renderDot();
+            } else {
+                renderScanline();
+            }
+            if (dot == 260 && rendering() && onScanline) {
+                onScanline();
+            }
+            if (scanline == 261 && dot == 1) {
+                trace<Trace::Ppu>("End VBLANK");
+                vblank = false;
+                updateNmi();
+                spriteZeroHit = false;
+                spriteOverflow = false;
+            }
+        } else if (scanline == 241 && dot == 1) {
+            trace<Trace::Ppu>("Begin VBLANK");
             vblank = true;
+            updateNmi();
         }
 
-        tick = tick == 262 * 341 ? 0 : tick + 1; // set tick back to zero each frame
-
         // The NTSC video signal is made up of 262 scanlines, and 20 of those are spent in vblank state.
         // After the program has received an NMI, it has about 2270 cycles to update the palette, sprites,
         // and nametables as necessary before rendering begins.
 
         // Each scanline is made up of 341 pixels, 85 of which are horizontal blanking pixels (leaving 256 visible pixels),
-        // Im a little confused because 262 - 20 = 242, and there are 240 virtical pixels, So what is the 2 extra lines?
+        // The other two lines are the post render line (240) and the pre render line (261), which fetches
+        // the first two tiles of line 0.
+
+        // On odd frames, with rendering on, the pre render line is one dot shorter
+        dot++;
+        if (dot == 341 || (dot == 340 && scanline == 261 && oddFrame && rendering())) {
+            dot = 0;
+            rendered = 0;
+            increments = 0;
+            scanline++;
+            if (scanline == 240) {
+                frame++;
+            } else if (scanline == 261) {
+                active = render;
+                draw = drawEvery && (frame + 1) % drawEvery == 0;
+            } else if (scanline == 262) {
+                scanline = 0;
+                oddFrame = !oddFrame;
+            }
+        }
 
         // https://www.nesdev.org/wiki/PPU_frame_timing
         // https://www.nesdev.org/wiki/PPU_rendering
     }
-
-public:
-};
\ No newline at end of file
+};
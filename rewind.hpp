@@ -0,0 +1,245 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <vector>
+
+#include "console.hpp"
+
+// Rewind and rollback
+// Keeps a save state per frame in memory, without the framebuffer (the next
+// frame draws it again). Every keyframeInterval frames the whole state is
+// kept, and the frames in between only as the XOR against the frame before,
+// run length encoded: a frame changes a few RAM pages and PPU registers, so
+// a delta is a few hundred bytes. The console tells which pages of RAM, PPU
+// memory and PRG RAM weren't written since the frame before
+// (Console::snapshot), and those aren't compared at all, only the registers,
+// the written pages and the memory without dirty bits (CHR RAM). A console
+// should push to one Rewind only. Restoring walks the deltas from the nearest
+// of the keyframe and the last frame restored or pushed (XOR undoes itself),
+// so stepping back a frame at a time costs one delta plus the load. The
+// oldest keyframe and its deltas are dropped when the ring grows past its
+// byte budget.
+class Rewind {
+private:
+    struct Group {
+        uint64_t first; // frame of the keyframe
+        std::vector<uint8_t> keyframe;
+        std::vector<std::vector<uint8_t>> deltas; // deltas[i] takes frame first + i - 1 to first + i, deltas[0] is empty
+    };
+    std::deque<Group> groups;
+    size_t budget;
+    int keyframeInterval;
+    size_t used = 0;
+
+    std::vector<uint8_t> state; // scratch for saving
+    std::vector<StateRange> unchanged; // of state, against the frame before
+    std::vector<uint8_t> current; // the state of currentFrame, if valid
+    uint64_t currentFrame = 0;
+    bool valid = false;
+
+    static void putVarint(std::vector<uint8_t>& out, size_t value)
+    {
+        for (; value >= 0x80; value >>= 7) {
+            out.push_back(uint8_t(value) | 0x80);
+        }
+        out.push_back(uint8_t(value));
+    }
+
+    static size_t getVarint(const uint8_t*& p)
+    {
+        size_t value = 0;
+        for (int shift = 0;; shift += 7) {
+            auto b = *p++;
+            value |= size_t(b & 0x7f) << shift;
+            if (!(b & 0x80)) {
+                return value;
+            }
+        }
+    }
+
+    static size_t bytes(const Group& g)
+    {
+        auto size = g.keyframe.size();
+        for (const auto& d : g.deltas) {
+            size += d.size();
+        }
+        return size;
+    }
+
+    // Forget frame and everything after it. A group left over always keeps
+    // its keyframe.
+    void dropFrom(uint64_t frame)
+    {
+        while (!groups.empty() && groups.back().first >= frame) {
+            used -= bytes(groups.back());
+            groups.pop_back();
+        }
+        if (!groups.empty()) {
+            auto& g = groups.back();
+            while (g.first + g.deltas.size() > frame) {
+                used -= g.deltas.back().size();
+                g.deltas.pop_back();
+            }
+        }
+        if (currentFrame >= frame) {
+            valid = false;
+        }
+    }
+
+    // The group frame is saved in, or null
+    const Group* find(uint64_t frame) const
+    {
+        for (auto it = groups.rbegin(); it != groups.rend(); ++it) {
+            if (it->first <= frame) {
+                return frame - it->first < it->deltas.size() ? &*it : nullptr;
+            }
+        }
+        return nullptr;
+    }
+
+    // Make current the state of frame, which is saved
+    void seek(uint64_t frame)
+    {
+        const auto* g = find(frame);
+        if (!valid || find(currentFrame) != g) {
+            current = g->keyframe;
+            currentFrame = g->first;
+            valid = true;
+        }
+        while (currentFrame < frame) {
+            apply(g->deltas[++currentFrame - g->first], current.data());
+        }
+        while (currentFrame > frame) {
+            apply(g->deltas[currentFrame-- - g->first], current.data());
+        }
+    }
+
+public:
+    explicit Rewind(size_t budget = 16 << 20, int keyframeInterval = 60)
+        : budget(budget)
+        , keyframeInterval(keyframeInterval)
+    {
+    }
+
+    // Encode a ^ b as runs of [equal bytes][differing bytes][the XORed bytes].
+    // The sorted ranges in same are known to be equal and aren't compared.
+    static void diff(const uint8_t* a, const uint8_t* b, size_t size, std::vector<uint8_t>& out, const std::vector<StateRange>& same = {})
+    {
+        size_t i = 0;
+        size_t next = 0; // the first range of same not behind i
+        while (i < size) {
+            auto start = i;
+            for (;;) {
+                if (next < same.size() && i == same[next].offset) {
+                    i += same[next++].size;
+                    continue;
+                }
+                auto end = next < same.size() ? same[next].offset : size;
+                while (i + 8 <= end && std::memcmp(a + i, b + i, 8) == 0) {
+                    i += 8;
+                }
+                while (i < end && a[i] == b[i]) {
+                    i++;
+                }
+                if (i < end || i == size) {
+                    break;
+                }
+            }
+            auto equal = i - start;
+            if (i == size) {
+                break;
+            }
+
+            // Literals run until 8 equal bytes in a row (or a known equal
+            // range), shorter gaps are cheaper inline
+            start = i;
+            auto end = next < same.size() ? same[next].offset : size;
+            for (size_t run = 0; i < end && run < 8; i++) {
+                run = a[i] == b[i] ? run + 1 : 0;
+            }
+            while (i > start && a[i - 1] == b[i - 1]) {
+                i--;
+            }
+            putVarint(out, equal);
+            putVarint(out, i - start);
+            for (auto j = start; j < i; j++) {
+                out.push_back(a[j] ^ b[j]);
+            }
+        }
+    }
+
+    // state ^= the delta diff() made
+    static void apply(const std::vector<uint8_t>& delta, uint8_t* state)
+    {
+        const auto* p = delta.data();
+        const auto* end = p + delta.size();
+        while (p < end) {
+            state += getVarint(p);
+            auto count = getVarint(p);
+            size_t j = 0;
+            for (; j + 8 <= count; j += 8) {
+                uint64_t x, y;
+                std::memcpy(&x, state + j, 8);
+                std::memcpy(&y, p + j, 8);
+                x ^= y;
+                std::memcpy(state + j, &x, 8);
+            }
+            for (; j < count; j++) {
+                state[j] ^= p[j];
+            }
+            state += count;
+            p += count;
+        }
+    }
+
+    // Remember the console as it is now, as its current frame. Anything saved
+    // for this frame or later is forgotten first (the timeline forked).
+    void push(Console& console)
+    {
+        auto frame = console.frame();
+        dropFrom(frame);
+        console.snapshot(state, unchanged);
+
+        auto* last = groups.empty() ? nullptr : &groups.back();
+        if (!last || last->deltas.size() >= size_t(keyframeInterval) || last->first + last->deltas.size() != frame
+            || last->keyframe.size() != state.size()) {
+            groups.push_back({ frame, state, { {} } });
+            used += state.size();
+        } else {
+            seek(frame - 1);
+            std::vector<uint8_t> delta;
+            diff(state.data(), current.data(), state.size(), delta, unchanged);
+            used += delta.size();
+            last->deltas.push_back(std::move(delta));
+        }
+        std::swap(current, state);
+        currentFrame = frame;
+        valid = true;
+
+        while (used > budget && groups.size() > 1) {
+            used -= bytes(groups.front());
+            groups.pop_front();
+        }
+    }
+
+    // Put the console back to a saved frame. The frames after it stay until
+    // the next push.
+    bool restore(Console& console, uint64_t frame)
+    {
+        if (!find(frame)) {
+            return false;
+        }
+        seek(frame);
+        return console.load(current.data(), current.size());
+    }
+
+    bool has(uint64_t frame) const
+    {
+        return !groups.empty() && frame >= groups.front().first
+            && frame < groups.back().first + groups.back().deltas.size();
+    }
+
+    size_t size() const { return used; }
+};
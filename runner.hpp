@@ -0,0 +1,134 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A work-stealing thread pool for running many independent consoles.
+// Every worker has its own queue. It takes work from the back of its own queue
+// and, when that runs dry, steals from the front of the others, so the load
+// evens out without a single shared queue. Jobs are expected to be coarse
+// (a whole ROM run), so each queue is just a deque behind its own lock.
+class Runner {
+private:
+    using job = std::function<void()>;
+    struct Queue {
+        std::mutex mutex;
+        std::deque<job> jobs;
+    };
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> workers;
+    std::atomic<size_t> next = 0; // queue the next submitted job goes to
+    std::atomic<size_t> queued = 0; // submitted but not taken
+    std::atomic<size_t> pending = 0; // submitted but not finished
+
+    std::mutex mutex; // guards sleeping and waking, not the queues
+    std::condition_variable wake;
+    std::condition_variable done;
+    bool stopping = false;
+
+    bool take(size_t self, job& out)
+    {
+        {
+            auto& q = *queues[self];
+            std::lock_guard<std::mutex> lock(q.mutex);
+            if (!q.jobs.empty()) {
+                out = std::move(q.jobs.back());
+                q.jobs.pop_back();
+                --queued;
+                return true;
+            }
+        }
+        for (size_t i = 1; i < queues.size(); i++) {
+            auto& q = *queues[(self + i) % queues.size()];
+            std::lock_guard<std::mutex> lock(q.mutex);
+            if (!q.jobs.empty()) {
+                out = std::move(q.jobs.front());
+                q.jobs.pop_front();
+                --queued;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void work(size_t self)
+    {
+        job j;
+        for (;;) {
+            if (take(self, j)) {
+                j();
+                j = nullptr;
+                if (--pending == 0) {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    done.notify_all();
+                }
+                continue;
+            }
+
+            // Sleep until there is a job to take, the ones still running
+            // can't give this worker anything
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [this] { return stopping || queued > 0; });
+            if (stopping) {
+                return;
+            }
+        }
+    }
+
+public:
+    Runner(unsigned threads = std::thread::hardware_concurrency())
+    {
+        threads = std::max(1u, threads);
+        for (unsigned i = 0; i < threads; i++) {
+            queues.push_back(std::make_unique<Queue>());
+        }
+        for (unsigned i = 0; i < threads; i++) {
+            workers.emplace_back([this, i] { work(i); });
+        }
+    }
+
+    ~Runner()
+    {
+        wait();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& w : workers) {
+            w.join();
+        }
+    }
+
+    size_t threads() const { return workers.size(); }
+
+    void submit(job j)
+    {
+        ++pending;
+        auto& q = *queues[next++ % queues.size()];
+        {
+            std::lock_guard<std::mutex> lock(q.mutex);
+            q.jobs.push_back(std::move(j));
+            ++queued;
+        }
+        // Under the lock, so a worker between checking queued and sleeping
+        // doesn't miss it
+        std::lock_guard<std::mutex> lock(mutex);
+        wake.notify_one();
+    }
+
+    // Block until every submitted job has finished
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [this] { return pending == 0; });
+    }
+};
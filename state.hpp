@@ -0,0 +1,109 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Save states
+// Every device has a state(Serializer&) that lists its members once, and the
+// same list is used to save (append them to a buffer) and to load (copy them
+// back out). Values are stored as raw host bytes, so states are meant for the
+// build and machine that made them (rewind, rollback, search), not for
+// sharing. Pointers are never saved; devices rebuild them after loading.
+// Bytes [offset, offset + size) of a saved state
+struct StateRange {
+    size_t offset;
+    size_t size;
+};
+
+// Where each block of memory a save went through Serializer::bytes ended up,
+// by its address in the machine, so a device can find its memory in the
+// state (Console::snapshot)
+struct StateLayout {
+    std::vector<std::pair<const void*, size_t>> blocks;
+
+    // SIZE_MAX if memory isn't in the state
+    size_t offset(const void* memory) const
+    {
+        for (const auto& [data, offset] : blocks) {
+            if (data == memory) {
+                return offset;
+            }
+        }
+        return SIZE_MAX;
+    }
+};
+
+class Serializer {
+private:
+    std::vector<uint8_t>* out = nullptr;
+    const uint8_t* in = nullptr;
+    const uint8_t* end = nullptr;
+    bool good = true;
+
+public:
+    // Whether the picture (Ppu::framebuffer) is in the state. Snapshots that
+    // are only ever run on from (rewind) leave it out, it is most of the
+    // state and the next frame draws it again.
+    bool withFramebuffer = true;
+
+    // Saving, records where everything goes, if set
+    StateLayout* layout = nullptr;
+
+    // Save, appending to out
+    explicit Serializer(std::vector<uint8_t>& out)
+        : out(&out)
+    {
+    }
+
+    // Load from [data, data + size)
+    Serializer(const uint8_t* data, size_t size)
+        : in(data)
+        , end(data + size)
+    {
+    }
+
+    bool loading() const { return out == nullptr; }
+    bool ok() const { return good; }
+    void fail() { good = false; }
+
+    template <typename T>
+    void operator()(T& value)
+    {
+        static_assert(std::is_trivially_copyable_v<T>, "only plain values can be saved");
+        bytes(&value, sizeof(T));
+    }
+
+    void bytes(void* data, size_t size)
+    {
+        if (size == 0) {
+            return; // data may be null (an empty vector)
+        }
+        if (out) {
+            if (layout) {
+                layout->blocks.push_back({ data, out->size() });
+            }
+            auto p = static_cast<const uint8_t*>(data);
+            out->insert(out->end(), p, p + size);
+        } else if (good && size_t(end - in) >= size) {
+            std::memcpy(data, in, size);
+            in += size;
+        } else {
+            good = false;
+        }
+    }
+
+    // The size is fixed by the cartridge, so it is only checked
+    void vector(std::vector<uint8_t>& v)
+    {
+        auto size = uint32_t(v.size());
+        (*this)(size);
+        if (size != v.size()) {
+            good = false;
+            return;
+        }
+        bytes(v.data(), v.size());
+    }
+};
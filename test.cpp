@@ -0,0 +1,640 @@
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "cart.hpp"
+#include "audio.hpp"
+#include "capture.hpp"
+#include "catalog.hpp"
+#include "console.hpp"
+#include "movie.hpp"
+#include "rewind.hpp"
+#include "runner.hpp"
+#include "video.hpp"
+
+// Self checks for the parts that have a right answer without a ROM: file
+// formats that must read back what was written, and the fast paths that must
+// agree with the plain ones. Prints each failure and exits with the number of
+// them.
+static int failures = 0;
+
+#define CHECK(condition)                                                           \
+    do {                                                                           \
+        if (!(condition)) {                                                        \
+            std::fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #condition); \
+            failures++;                                                            \
+        }                                                                          \
+    } while (0)
+
+// A 16 byte header followed by size - 16 zeros
+static std::vector<uint8_t> romFile(std::vector<uint8_t> header, size_t size)
+{
+    header.resize(16);
+    header.resize(size);
+    return header;
+}
+
+static bool parses(const std::vector<uint8_t>& bytes, Rom::Header& h)
+{
+    std::string error;
+    return Rom::parse({ bytes.data(), bytes.size() }, h, error);
+}
+
+static void testHeaders()
+{
+    Rom::Header h;
+    // NROM-128 with CHR ROM
+    CHECK(parses(romFile({ 'N', 'E', 'S', 0x1a, 1, 1 }, 16 + 16384 + 8192), h));
+    CHECK(h.prgRomSize == 16384 && h.chrRomSize == 8192 && h.mapper == 0);
+    // One byte short
+    CHECK(!parses(romFile({ 'N', 'E', 'S', 0x1a, 1, 1 }, 16 + 16384 + 8191), h));
+    CHECK(!parses(romFile({ 'N', 'E', 'S', 0x1b, 1, 1 }, 16 + 16384 + 8192), h));
+    CHECK(!parses({ 'N', 'E', 'S', 0x1a }, h));
+    CHECK(!parses(romFile({ 'N', 'E', 'S', 0x1a, 0, 1 }, 16 + 8192), h));
+    // The trainer counts
+    CHECK(!parses(romFile({ 'N', 'E', 'S', 0x1a, 1, 0, 0x04 }, 16 + 16384), h));
+    CHECK(parses(romFile({ 'N', 'E', 'S', 0x1a, 1, 0, 0x04 }, 16 + 512 + 16384), h));
+
+    // NES 2.0 exponent sizes: 2^13 * 3 = 24KB of PRG
+    CHECK(parses(romFile({ 'N', 'E', 'S', 0x1a, 13 << 2 | 1, 0, 0, 0x08, 0, 0x0f }, 16 + 24576), h));
+    CHECK(h.nes2 && h.prgRomSize == 24576 && h.chrRomSize == 0);
+    // 4KB isn't whole banks
+    CHECK(!parses(romFile({ 'N', 'E', 'S', 0x1a, 12 << 2, 0, 0, 0x08, 0, 0x0f }, 16 + 4096), h));
+    // 2^63 * 7 twice doesn't fit anywhere and must not wrap around to fit
+    CHECK(!parses(romFile({ 'N', 'E', 'S', 0x1a, 0xfc, 0xfc, 0, 0x08, 0, 0xff }, 64), h));
+    CHECK(!parses(romFile({ 'N', 'E', 'S', 0x1a, 0xff, 0xff, 0, 0x08, 0, 0xff }, 64), h));
+    for (int e = 0; e < 64; e++) {
+        parses(romFile({ 'N', 'E', 'S', 0x1a, uint8_t(e << 2 | 3), uint8_t(e << 2 | 3), 0, 0x08, 0, 0xff }, 64), h);
+    }
+}
+
+// Scratch space for the tests that need files, removed at the end
+static std::string tempDirectory()
+{
+    auto path = std::filesystem::temp_directory_path() / ("nes2040-test-" + std::to_string(getpid()));
+    std::filesystem::create_directories(path);
+    return path.string();
+}
+
+static void writeFile(const std::string& path, const std::vector<uint8_t>& bytes)
+{
+    std::ofstream(path, std::ios::binary).write((const char*)bytes.data(), bytes.size());
+}
+
+// A malformed file in the library is counted and skipped, the rest is indexed
+static void testCatalog()
+{
+    auto directory = tempDirectory() + "/catalog";
+    std::filesystem::create_directories(directory);
+    auto good = romFile({ 'N', 'E', 'S', 0x1a, 1, 1 }, 16 + 16384 + 8192);
+    good[16] = 0x4c;
+    writeFile(directory + "/good.nes", good);
+    writeFile(directory + "/huge.nes", romFile({ 'N', 'E', 'S', 0x1a, 0xfc, 0xfc, 0, 0x08, 0, 0xff }, 64));
+    writeFile(directory + "/short.nes", { 'N', 'E', 'S' });
+
+    Catalog catalog;
+    auto stats = catalog.scan(directory);
+    CHECK(stats.added == 1 && stats.failed == 2);
+    CHECK(catalog.entries.size() == 1);
+    if (catalog.entries.size() == 1) {
+        CHECK(catalog.entries[0].prgCrc == crc32(good.data() + 16, 16384));
+        CHECK(catalog.entries[0].chrCrc == crc32(good.data() + 16 + 16384, 8192));
+    }
+
+    // The index reads back the same, and a rescan keeps everything
+    auto index = directory + "/.nes2040-catalog";
+    CHECK(catalog.save(index));
+    Catalog loaded;
+    CHECK(loaded.load(index));
+    CHECK(loaded.entries.size() == 1 && loaded.entries[0].prgSha1 == catalog.entries[0].prgSha1);
+    stats = loaded.scan(directory);
+    CHECK(stats.kept == 1 && stats.added == 0);
+}
+
+// A ROM of prgBanks 16KB banks, where the first byte of every 8KB bank is its
+// number, written to the scratch directory and opened
+static std::shared_ptr<Rom> bankedRom(int mapper, int prgBanks, uint8_t submapper = 0)
+{
+    auto bytes = romFile({ 'N', 'E', 'S', 0x1a, uint8_t(prgBanks), 1, uint8_t(mapper << 4), uint8_t((mapper & 0xf0) | (submapper ? 0x08 : 0)), uint8_t(submapper << 4) },
+        16 + prgBanks * 16384 + 8192);
+    for (int bank = 0; bank < prgBanks * 2; bank++) {
+        bytes[16 + bank * 8192] = uint8_t(bank);
+    }
+    auto path = tempDirectory() + "/mapper.nes";
+    writeFile(path, bytes);
+    auto rom = std::make_shared<Rom>();
+    CHECK(rom->open(path));
+    return rom;
+}
+
+static void testMappers()
+{
+    // MMC1: five writes of a bit each load a register, a write on the cycle
+    // after another doesn't count
+    {
+        Console console(bankedRom(1, 8));
+        int64_t cycle = 100;
+        console.mapper->cpuCycle = [&] { return cycle; };
+        auto load = [&](uint16_t addr, uint8_t value) {
+            for (int i = 0; i < 5; i++, cycle += 4) {
+                console.mapper->set(addr, value >> i & 1);
+            }
+        };
+        load(0x8000, 0x0c); // 16KB banks at $8000, last fixed
+        load(0xe000, 0x05);
+        CHECK(console.bus.readPage(0x8000)[0] == 10);
+        // Writes in pairs on consecutive cycles, like read-modify-write
+        // instructions make: only the first of each counts
+        for (int i = 0; i < 5; i++, cycle += 4) {
+            console.mapper->set(0xe000, 0x03 >> i & 1);
+            cycle++;
+            console.mapper->set(0xe000, ~0x03 >> i & 1);
+        }
+        CHECK(console.bus.readPage(0x8000)[0] == 6);
+    }
+
+    // UxROM: the bank register gets the AND of the value and the ROM byte
+    // under it, unless submapper 1 says the board avoids the conflict
+    for (uint8_t submapper : { 0, 1 }) {
+        Console console(bankedRom(2, 4, submapper));
+        console.mapper->set(0x8000, 2); // the ROM byte at $8000 is 0
+        CHECK(console.bus.readPage(0x8000)[0] == (submapper ? 4 : 0));
+    }
+}
+
+// NROM running code at $C000: NMIs and rendering on, then a loop that keeps
+// reading the first controller and writing RAM, PRG RAM and VRAM, and an NMI
+// handler that scrolls
+static std::shared_ptr<Rom> programRom()
+{
+    auto bytes = romFile({ 'N', 'E', 'S', 0x1a, 1, 1 }, 16 + 16384 + 8192);
+    const uint8_t reset[] = {
+        0xa9, 0x80, 0x8d, 0x00, 0x20, // LDA #$80, STA $2000
+        0xa9, 0x1e, 0x8d, 0x01, 0x20, // LDA #$1e, STA $2001
+        0xe6, 0x10, 0xa6, 0x10, 0xfe, 0x00, 0x03, // INC $10, LDX $10, INC $0300,X
+        0xfe, 0x00, 0x70, // INC $7000,X
+        0xa9, 0x01, 0x8d, 0x16, 0x40, 0xa9, 0x00, 0x8d, 0x16, 0x40, // strobe $4016
+        0xad, 0x16, 0x40, 0x85, 0x12, // LDA $4016, STA $12
+        0xa5, 0x10, 0x8d, 0x07, 0x20, 0x4c, 0x0a, 0xc0, // LDA $10, STA $2007, JMP $c00a
+    };
+    const uint8_t nmi[] = { 0xe6, 0x11, 0xa5, 0x11, 0x8d, 0x05, 0x20, 0x8d, 0x05, 0x20, 0x40 };
+    std::copy(std::begin(reset), std::end(reset), bytes.begin() + 16);
+    std::copy(std::begin(nmi), std::end(nmi), bytes.begin() + 16 + 0x100);
+    const uint8_t vectors[] = { 0x00, 0xc1, 0x00, 0xc0, 0x00, 0xc1 };
+    std::copy(std::begin(vectors), std::end(vectors), bytes.begin() + 16 + 0x3ffa);
+    for (int i = 0; i < 8192; i++) {
+        bytes[16 + 16384 + i] = uint8_t(i * 7);
+    }
+    auto path = tempDirectory() + "/program.nes";
+    writeFile(path, bytes);
+    auto rom = std::make_shared<Rom>();
+    CHECK(rom->open(path));
+    return rom;
+}
+
+static bool sameHashes(Console& a, Console& b)
+{
+    auto x = a.hashes(), y = b.hashes();
+    return x.framebuffer == y.framebuffer && x.ram == y.ram && x.ppu == y.ppu && a.clock.now() == b.clock.now();
+}
+
+// A CPU with 64 KB of RAM and nothing else, so there are no side effects a
+// bus access could have and no interrupts
+struct CpuOnly {
+    Bus bus;
+    std::shared_ptr<Ram<0x10000>> memory = std::make_shared<Ram<0x10000>>();
+    Cpu cpu { bus };
+    int64_t cycles = 0;
+
+    CpuOnly(const std::vector<uint8_t>& bytes, Cpu::Core core)
+    {
+        for (size_t i = 0; i < bytes.size(); i++) {
+            memory->set(uint16_t(i), bytes[i]);
+        }
+        bus.map(0x0000, 0x10000, memory);
+        cpu.core = core;
+    }
+
+    // Up to the next opcode fetch, or until the CPU jams
+    void step()
+    {
+        do {
+            cycles += cpu.tick();
+        } while (cpu.step != 0 && !cpu.jammed);
+    }
+
+    bool same(const CpuOnly& other) const
+    {
+        const auto& a = cpu;
+        const auto& b = other.cpu;
+        return a.ProgramCounter == b.ProgramCounter && a.Accumulator == b.Accumulator && a.Xregister == b.Xregister
+            && a.Yregister == b.Yregister && a.StackPointer == b.StackPointer && a.Status == b.Status
+            && bus.data == other.bus.data && cycles == other.cycles;
+    }
+};
+
+// On random programs of official opcodes (the code and the data they touch,
+// including the vectors BRK jumps through) the instruction core ends every
+// instruction where the cycle core does: same registers, same cycle count and
+// in the end the same memory. So does a CPU that changes cores between
+// instructions.
+static void testCores()
+{
+    std::mt19937 random(2040);
+    std::vector<uint8_t> official;
+    for (int i = 0; i < 256; i++) {
+        if (opcodes[i].op != Op::Illegal) {
+            official.push_back(uint8_t(i));
+        }
+    }
+    int jams = 0;
+    for (int program = 0; program < 100; program++) {
+        std::vector<uint8_t> bytes(0x10000);
+        for (auto& b : bytes) {
+            b = official[random() % official.size()];
+        }
+        CpuOnly cycle(bytes, Cpu::Core::Cycle);
+        CpuOnly instruction(bytes, Cpu::Core::Instruction);
+        CpuOnly mixed(bytes, Cpu::Core::Cycle);
+        bool same = true;
+        for (int i = 0; i < 2000 && same; i++) {
+            mixed.cpu.core = random() & 1 ? Cpu::Core::Cycle : Cpu::Core::Instruction;
+            cycle.step();
+            instruction.step();
+            mixed.step();
+            if (cycle.cpu.jammed || instruction.cpu.jammed || mixed.cpu.jammed) {
+                // Writes can put an unofficial opcode in the code
+                CHECK(cycle.cpu.jammed && instruction.cpu.jammed && mixed.cpu.jammed);
+                CHECK(cycle.cpu.ProgramCounter == instruction.cpu.ProgramCounter);
+                jams++;
+                break;
+            }
+            same = cycle.same(instruction) && cycle.same(mixed);
+            CHECK(same);
+        }
+        CHECK(std::equal(cycle.memory->readPointer(), cycle.memory->readPointer() + 0x10000, instruction.memory->readPointer()));
+        CHECK(std::equal(cycle.memory->readPointer(), cycle.memory->readPointer() + 0x10000, mixed.memory->readPointer()));
+    }
+    CHECK(jams < 100);
+}
+
+// A state saved mid frame (and mid instruction for the cycle core) runs on
+// exactly like the console it came from, in another console too
+static void testSaveStates()
+{
+    auto rom = programRom();
+    for (auto core : { Cpu::Core::Cycle, Cpu::Core::Instruction }) {
+        Console console(rom);
+        console.cpu.core = core;
+        for (int i = 0; i < 10; i++) {
+            console.runFrame();
+        }
+        console.runFrame(12345);
+        std::vector<uint8_t> state;
+        console.save(state);
+        for (int i = 0; i < 5; i++) {
+            console.runFrame();
+        }
+
+        Console other(rom);
+        other.cpu.core = core;
+        CHECK(other.load(state.data(), state.size()));
+        for (int i = 0; i < 5; i++) {
+            other.runFrame();
+        }
+        CHECK(sameHashes(console, other));
+
+        // Loading into the console that moved on takes it back too
+        CHECK(console.load(state.data(), state.size()));
+        std::vector<uint8_t> again;
+        console.save(again);
+        CHECK(again == state);
+
+        // Damaged states are refused
+        CHECK(!other.load(state.data(), state.size() - 1));
+        auto wrongVersion = state;
+        wrongVersion[4] ^= 0xff;
+        CHECK(!other.load(wrongVersion.data(), wrongVersion.size()));
+        CHECK(!other.load(nullptr, 0));
+    }
+}
+
+static void testRewind()
+{
+    auto rom = programRom();
+    // Push at frame 0, run past a few keyframes, go back to 0 and push again
+    // (the timeline forks at the very start)
+    {
+        Console console(rom);
+        Rewind rewind(16 << 20, 10);
+        rewind.push(console);
+        for (int i = 0; i < 25; i++) {
+            console.runFrame();
+            rewind.push(console);
+        }
+        CHECK(rewind.has(0) && rewind.has(25) && !rewind.has(26));
+        CHECK(rewind.restore(console, 0));
+        CHECK(console.frame() == 0);
+        rewind.push(console);
+        CHECK(rewind.has(0) && !rewind.has(1));
+        console.runFrame();
+        rewind.push(console);
+        CHECK(rewind.has(1));
+    }
+
+    // Restoring any frame and running on gives what the first run gave, and
+    // a frame costs a delta, not a state
+    {
+        Console console(rom);
+        Rewind rewind(16 << 20, 30);
+        std::vector<Console::Hashes> hashes;
+        std::vector<uint8_t> state;
+        console.save(state, false);
+        for (int i = 0; i < 100; i++) {
+            console.runFrame();
+            rewind.push(console);
+            hashes.push_back(console.hashes());
+        }
+        CHECK(rewind.size() < state.size() * 4 + 100 * 1024);
+        for (uint64_t frame : { 99, 98, 50, 1, 31, 30, 29, 60, 61 }) {
+            CHECK(rewind.restore(console, frame));
+            CHECK(console.frame() == frame);
+            CHECK(console.hashes().ram == hashes[frame - 1].ram);
+            console.runFrame();
+            auto h = console.hashes();
+            auto& expected = hashes[frame];
+            CHECK(h.framebuffer == expected.framebuffer && h.ram == expected.ram && h.ppu == expected.ppu);
+        }
+        // A restored frame is exactly the state it was pushed as, though the
+        // deltas skip the pages that weren't written and hashes() takes the
+        // same pages as it goes
+        std::vector<std::vector<uint8_t>> states;
+        Console other(rom);
+        Rewind again(16 << 20, 30);
+        for (int i = 0; i < 100; i++) {
+            other.runFrame();
+            again.push(other);
+            if (i % 3 == 0) {
+                other.hashes();
+            }
+            states.emplace_back();
+            other.save(states.back(), false);
+        }
+        for (uint64_t frame : { 100, 37, 38, 99, 2, 61, 60, 59, 1 }) {
+            CHECK(again.restore(other, frame));
+            std::vector<uint8_t> restored;
+            other.save(restored, false);
+            CHECK(restored == states[frame - 1]);
+        }
+
+        // Rollback: the frames after a restored one go on the next push
+        CHECK(rewind.restore(console, 40));
+        console.runFrame();
+        rewind.push(console);
+        CHECK(rewind.has(41) && !rewind.has(42));
+    }
+}
+
+// A recorded movie reads back the same and plays back in sync, and bare
+// input is just the buttons
+static void testMovies()
+{
+    auto rom = programRom();
+    Console console(rom);
+    Movie recording;
+    for (int i = 0; i < 20; i++) {
+        console.controllers->buttons = { uint8_t(i * 3), uint8_t(i) };
+        console.runFrame();
+        recording.record(console);
+    }
+    auto path = tempDirectory() + "/movie.nesmov";
+    CHECK(recording.save(path));
+
+    Movie movie;
+    CHECK(movie.load(path));
+    CHECK(movie.romCrc == console.romCrc && movie.buttons == recording.buttons && movie.hashes == recording.hashes);
+    Console replay(rom);
+    for (size_t i = 0; i < movie.frames(); i++) {
+        movie.input(replay);
+        replay.runFrame();
+        CHECK(movie.check(replay));
+    }
+
+    // Another input from frame 10 on goes out of sync
+    Console other(rom);
+    auto changed = movie;
+    changed.buttons[20] ^= 0xff;
+    bool synced = true;
+    for (size_t i = 0; i < changed.frames(); i++) {
+        changed.input(other);
+        other.runFrame();
+        synced = synced && changed.check(other);
+    }
+    CHECK(!synced);
+
+    auto bare = tempDirectory() + "/bare.bin";
+    writeFile(bare, { 1, 2, 3, 4, 5 });
+    CHECK(movie.load(bare));
+    CHECK(movie.romCrc == 0 && movie.frames() == 2 && movie.hashes.empty());
+}
+
+// Every job runs, wait() returns once they have (a lost wakeup hangs here),
+// and a pool asked for no threads still gets one
+static void testRunner()
+{
+    CHECK(Runner(0).threads() == 1);
+    for (int round = 0; round < 20; round++) {
+        std::atomic<int> ran = 0;
+        Runner runner(4);
+        for (int i = 0; i < 200; i++) {
+            runner.submit([&ran, i] {
+                if (i % 50 == 0) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                }
+                ran++;
+            });
+        }
+        runner.wait();
+        CHECK(ran == 200);
+    }
+}
+
+// Everything pushed before the output is destroyed reaches the sink, in order
+static void testAudioDrain()
+{
+    struct Collect : AudioSink {
+        std::vector<int16_t>& samples;
+        explicit Collect(std::vector<int16_t>& samples)
+            : samples(samples)
+        {
+        }
+        virtual void write(const int16_t* in, size_t count) override { samples.insert(samples.end(), in, in + count); }
+    };
+    // A sink slower than the pushes, with more than the ring holds: pushes
+    // wait for room instead of dropping
+    struct Slow : Collect {
+        using Collect::Collect;
+        virtual void write(const int16_t* in, size_t count) override
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+            Collect::write(in, count);
+        }
+    };
+    for (int run = 0; run < 21; run++) {
+        std::vector<int16_t> got;
+        std::vector<int16_t> sent;
+        {
+            auto slow = run == 20;
+            std::unique_ptr<AudioSink> sink = std::make_unique<Collect>(got);
+            if (slow) {
+                sink = std::make_unique<Slow>(got);
+            }
+            AudioOutput audio(std::move(sink), 48000, false);
+            std::vector<int16_t> frame(800);
+            for (int i = 0; i < (slow ? 200 : 10); i++) {
+                for (size_t j = 0; j < frame.size(); j++) {
+                    frame[j] = int16_t(sent.size() + j);
+                }
+                audio.push(frame);
+                sent.insert(sent.end(), frame.begin(), frame.end());
+            }
+            CHECK(audio.metrics().dropped == 0);
+        }
+        CHECK(got == sent);
+    }
+}
+
+// Every tile decoder gives the scalar path's pixels, on random tiles and on
+// the all zeros and all ones ones
+static void testTiles()
+{
+    std::mt19937 random(9);
+    for (int i = 0; i < 1000; i++) {
+        uint8_t tile[16];
+        for (auto& b : tile) {
+            b = i == 0 ? 0 : i == 1 ? 0xff : uint8_t(random());
+        }
+        uint8_t scalar[64], fast[64];
+        decodeTileScalar(tile, scalar);
+        CHECK(scalar[0] == (tile[0] >> 7 | (tile[8] >> 7) << 1) && scalar[63] == ((tile[7] & 1) | (tile[15] & 1) << 1));
+#if defined(__SSE2__)
+        decodeTileSse2(tile, fast);
+        CHECK(std::equal(scalar, scalar + 64, fast));
+#endif
+#if defined(NES_AVX2_KERNELS)
+        if (hasAvx2()) {
+            decodeTileAvx2(tile, fast);
+            CHECK(std::equal(scalar, scalar + 64, fast));
+        }
+#endif
+        decodeTile(tile, fast);
+        CHECK(std::equal(scalar, scalar + 64, fast));
+    }
+}
+
+// The SIMD palette kernels match the lookups, for every index (high bits
+// ignored), at lengths and offsets that leave a scalar tail
+static void testPalette()
+{
+    std::vector<uint16_t> in(1024 + 37);
+    for (size_t i = 0; i < in.size(); i++) {
+        in[i] = uint16_t(i * 0x9e37 + (i >> 3));
+    }
+    for (size_t start : { 0, 1, 5 }) {
+        for (size_t count : { size_t(0), size_t(7), size_t(15), size_t(17), in.size() - start }) {
+            std::vector<uint32_t> rgba(count), rgbaScalar(count);
+            toRgba8888(in.data() + start, rgba.data(), count);
+            toRgba8888(in.data() + start, rgbaScalar.data(), count, false);
+            CHECK(rgba == rgbaScalar);
+            std::vector<uint16_t> rgb565(count), rgb565Scalar(count);
+            toRgb565(in.data() + start, rgb565.data(), count);
+            toRgb565(in.data() + start, rgb565Scalar.data(), count, false);
+            CHECK(rgb565 == rgb565Scalar);
+            for (size_t i = 0; i < count; i++) {
+                CHECK(rgba[i] == rgbaPalette[in[start + i] & 0x1ff]);
+                CHECK(rgb565[i] == rgb565Palette[in[start + i] & 0x1ff]);
+            }
+        }
+    }
+}
+
+// A .nescap plays back exactly the frames recorded, across a keyframe and
+// with emphasis bits, and up to the last whole frame of a cut file
+static void testCapture()
+{
+    auto rom = programRom();
+    Console console(rom);
+    auto path = tempDirectory() + "/capture.nescap";
+    std::vector<std::vector<uint16_t>> frames;
+    std::vector<uint64_t> numbers;
+    {
+        NesCapEncoder encoder(path);
+        CHECK(encoder.ok());
+        for (int i = 0; i < 70; i++) {
+            console.runFrame();
+            std::vector<uint16_t> frame(console.ppu->framebuffer.begin(), console.ppu->framebuffer.end());
+            for (int j = 0; j < 8; j++) {
+                frame[6000 + j] = uint16_t((i + j * 5) & 0x3f);
+            }
+            if (i % 7 == 3) {
+                std::fill(frame.begin() + 1000, frame.begin() + 3000, uint16_t(0x140 | i));
+                for (int j = 0; j < 4; j++) {
+                    frame[5000 + j] = uint16_t(0x100 + j * 3 + i);
+                }
+            }
+            CHECK(encoder.write(console.ppu->frame, frame.data()));
+            frames.push_back(frame);
+            numbers.push_back(console.ppu->frame);
+        }
+    }
+
+    NesCapReader reader(path);
+    CHECK(reader.ok());
+    size_t read = 0;
+    for (; reader.next(); read++) {
+        CHECK(read < frames.size() && reader.pixels == frames[read] && reader.number == numbers[read]);
+        CHECK(reader.keyframe == (read % 60 == 0));
+    }
+    CHECK(read == frames.size());
+
+    auto size = std::filesystem::file_size(path);
+    std::filesystem::resize_file(path, size - 1);
+    NesCapReader cut(path);
+    for (read = 0; cut.next(); read++) {
+    }
+    CHECK(read == frames.size() - 1);
+
+    writeFile(path, { 'N', 'E', 'S', 'C', 'A', 'P', 0, 1, 0, 1, 240, 0 });
+    CHECK(!NesCapReader(path).ok());
+}
+
+int main()
+{
+    testHeaders();
+    testCatalog();
+    testMappers();
+    testCores();
+    testSaveStates();
+    testRewind();
+    testMovies();
+    testRunner();
+    testAudioDrain();
+    testTiles();
+    testPalette();
+    testCapture();
+    std::filesystem::remove_all(tempDirectory());
+    if (failures) {
+        std::fprintf(stderr, "%d failed\n", failures);
+    } else {
+        std::fprintf(stderr, "all passed\n");
+    }
+    return failures;
+}
+
+// g++ -std=c++17 -O2 -pthread test.cpp && ./a.out
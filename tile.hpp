@@ -0,0 +1,120 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <cstring>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define NES_AVX2_KERNELS 1
+#endif
+
+// https://www.nesdev.org/wiki/PPU_pattern_tables
+// A tile is 16 bytes, eight rows of bit plane 0 followed by eight rows of bit
+// plane 1. Pixel c of row r is bit 7-c of plane 0 plus twice bit 7-c of plane 1.
+// These expand ("planar to chunky") tiles to one byte per pixel, 8 pixels per
+// row, rows in order. Assumes a little endian host.
+
+// The AVX2 kernels (here and in video.hpp) are built for it whatever the
+// compiler flags, with target("avx2"), and only called when the CPU has it,
+// so a plain build gets them too
+#if defined(NES_AVX2_KERNELS)
+inline bool hasAvx2()
+{
+    static const bool has = __builtin_cpu_supports("avx2");
+    return has;
+}
+#endif
+
+// A decoded tile, on its own cache line
+struct alignas(64) DecodedTile {
+    uint8_t pixels[64];
+};
+
+// Bit 7-c of the index moved to bit 0 of byte c
+inline constexpr auto spreadBits = [] {
+    std::array<uint64_t, 256> table {};
+    for (int i = 0; i < 256; i++) {
+        for (int c = 0; c < 8; c++) {
+            table[i] |= uint64_t(i >> (7 - c) & 1) << (8 * c);
+        }
+    }
+    return table;
+}();
+
+// One row from its two bit plane bytes
+inline void decodeRow(uint8_t lo, uint8_t hi, uint8_t* out)
+{
+    auto pixels = spreadBits[lo] | spreadBits[hi] << 1;
+    std::memcpy(out, &pixels, 8);
+}
+
+// A whole tile, 16 bytes in, 64 out. decodeTile picks the fastest of these,
+// they all give the same pixels.
+inline void decodeTileScalar(const uint8_t* tile, uint8_t* out)
+{
+    for (int row = 0; row < 8; row++) {
+        decodeRow(tile[row], tile[row + 8], out + row * 8);
+    }
+}
+
+#if defined(NES_AVX2_KERNELS)
+__attribute__((target("avx2"))) inline void decodeTileAvx2(const uint8_t* tile, uint8_t* out)
+{
+    // Repeat every plane byte across the 8 pixels of its row, 4 rows per
+    // register, then test each pixel's bit
+    auto planes = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)tile));
+    auto bits = _mm256_set1_epi64x(0x0102040810204080);
+    auto one = _mm256_set1_epi8(1);
+    auto two = _mm256_set1_epi8(2);
+    for (int half = 0; half < 2; half++) {
+        auto r = char(half * 4);
+        auto lo = _mm256_shuffle_epi8(planes, _mm256_setr_epi8(
+            r, r, r, r, r, r, r, r, r + 1, r + 1, r + 1, r + 1, r + 1, r + 1, r + 1, r + 1,
+            r + 2, r + 2, r + 2, r + 2, r + 2, r + 2, r + 2, r + 2, r + 3, r + 3, r + 3, r + 3, r + 3, r + 3, r + 3, r + 3));
+        auto hi = _mm256_shuffle_epi8(planes, _mm256_setr_epi8(
+            r + 8, r + 8, r + 8, r + 8, r + 8, r + 8, r + 8, r + 8, r + 9, r + 9, r + 9, r + 9, r + 9, r + 9, r + 9, r + 9,
+            r + 10, r + 10, r + 10, r + 10, r + 10, r + 10, r + 10, r + 10, r + 11, r + 11, r + 11, r + 11, r + 11, r + 11, r + 11, r + 11));
+        lo = _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_and_si256(lo, bits), bits), one);
+        hi = _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_and_si256(hi, bits), bits), two);
+        _mm256_storeu_si256((__m256i*)(out + half * 32), _mm256_or_si256(lo, hi));
+    }
+}
+#endif
+
+#if defined(__SSE2__)
+inline void decodeTileSse2(const uint8_t* tile, uint8_t* out)
+{
+    // SSE2 has no byte shuffle, so repeat the bytes by unpacking them with
+    // themselves: 8 bytes, then pairs, then fours, then eights (2 rows)
+    auto bits = _mm_set1_epi64x(0x0102040810204080);
+    auto one = _mm_set1_epi8(1);
+    auto two = _mm_set1_epi8(2);
+    auto lo = _mm_loadl_epi64((const __m128i*)tile);
+    auto hi = _mm_loadl_epi64((const __m128i*)(tile + 8));
+    lo = _mm_unpacklo_epi8(lo, lo);
+    hi = _mm_unpacklo_epi8(hi, hi);
+    __m128i lo4[2] = { _mm_unpacklo_epi16(lo, lo), _mm_unpackhi_epi16(lo, lo) };
+    __m128i hi4[2] = { _mm_unpacklo_epi16(hi, hi), _mm_unpackhi_epi16(hi, hi) };
+    for (int i = 0; i < 4; i++) {
+        auto l = i & 1 ? _mm_unpackhi_epi32(lo4[i >> 1], lo4[i >> 1]) : _mm_unpacklo_epi32(lo4[i >> 1], lo4[i >> 1]);
+        auto h = i & 1 ? _mm_unpackhi_epi32(hi4[i >> 1], hi4[i >> 1]) : _mm_unpacklo_epi32(hi4[i >> 1], hi4[i >> 1]);
+        l = _mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(l, bits), bits), one);
+        h = _mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(h, bits), bits), two);
+        _mm_storeu_si128((__m128i*)(out + i * 16), _mm_or_si128(l, h));
+    }
+}
+#endif
+
+inline void decodeTile(const uint8_t* tile, uint8_t* out)
+{
+#if defined(NES_AVX2_KERNELS)
+    if (hasAvx2()) {
+        decodeTileAvx2(tile, out);
+        return;
+    }
+#endif
+#if defined(__SSE2__)
+    decodeTileSse2(tile, out);
+#else
+    decodeTileScalar(tile, out);
+#endif
+}
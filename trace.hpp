@@ -0,0 +1,175 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Trace logging
+// Tracing is chosen at compile time, per category, by building with
+// -DNES_TRACE=<mask>. For example -DNES_TRACE=0x5 traces the CPU and the PPU.
+// Categories that are not enabled compile to nothing.
+//
+// Enabled trace points don't format anything on the emulation thread. They
+// push a small binary record (a format string and two arguments) into a
+// lock-free ring, and a background thread formats and prints them. If the
+// ring is full, records are dropped (and counted) rather than stalling the
+// emulation. Every thread that traces gets a ring of its own (a ring has a
+// single producer), so a batch can trace consoles on all its workers; with
+// more than one, each line starts with the number of the thread it came from.
+#ifndef NES_TRACE
+#define NES_TRACE 0
+#endif
+
+enum class Trace : uint8_t {
+    Cpu = 0x01,
+    Bus = 0x02,
+    Ppu = 0x04,
+    Mapper = 0x08,
+    Apu = 0x10,
+};
+
+constexpr bool tracing(Trace category)
+{
+    return (NES_TRACE & unsigned(category)) != 0;
+}
+
+class TraceLog {
+private:
+    struct Record {
+        const char* format;
+        uint16_t a;
+        uint16_t b;
+        Trace category;
+    };
+
+    static constexpr size_t size = 1 << 16; // records, must be a power of 2
+    struct Ring {
+        std::array<Record, size> records;
+        std::atomic<size_t> head = 0; // written by the emulation thread
+        std::atomic<size_t> tail = 0; // written by the log thread
+        std::atomic<uint64_t> dropped = 0;
+    };
+
+    std::mutex mutex; // guards rings, not what's in them
+    std::vector<std::unique_ptr<Ring>> rings; // kept until exit, so a thread's ring outlives it
+    std::atomic<bool> running = true;
+    std::thread thread;
+
+    static const char* name(Trace category)
+    {
+        switch (category) {
+        case Trace::Cpu: return "cpu";
+        case Trace::Bus: return "bus";
+        case Trace::Ppu: return "ppu";
+        case Trace::Mapper: return "mapper";
+        case Trace::Apu: return "apu";
+        }
+        return "";
+    }
+
+    // This thread's ring, made on its first trace
+    Ring& ring()
+    {
+        thread_local Ring* mine = nullptr;
+        if (!mine) {
+            std::lock_guard<std::mutex> lock(mutex);
+            rings.push_back(std::make_unique<Ring>());
+            mine = rings.back().get();
+        }
+        return *mine;
+    }
+
+    void drain()
+    {
+        std::vector<Ring*> all;
+        for (;;) {
+            // Read running first: everything pushed before it was cleared is
+            // in the heads by then
+            bool last = !running;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                all.clear();
+                for (auto& r : rings) {
+                    all.push_back(r.get());
+                }
+            }
+            bool any = false;
+            for (size_t i = 0; i < all.size(); i++) {
+                auto& ring = *all[i];
+                auto t = ring.tail.load(std::memory_order_relaxed);
+                auto h = ring.head.load(std::memory_order_acquire);
+                for (; t != h; t++) {
+                    const auto& r = ring.records[t & (size - 1)];
+                    if (all.size() > 1) {
+                        std::fprintf(stderr, "[%zu %s] ", i, name(r.category));
+                    } else {
+                        std::fprintf(stderr, "[%s] ", name(r.category));
+                    }
+                    std::fprintf(stderr, r.format, r.a, r.b);
+                    std::fputc('\n', stderr);
+                    any = true;
+                }
+                ring.tail.store(t, std::memory_order_release);
+            }
+            if (!any) {
+                if (last) {
+                    break;
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        }
+
+        uint64_t dropped = 0;
+        for (auto* r : all) {
+            dropped += r->dropped;
+        }
+        if (dropped) {
+            std::fprintf(stderr, "[trace] %llu records dropped\n", (unsigned long long)dropped);
+        }
+    }
+
+    TraceLog()
+    {
+        thread = std::thread([this] { drain(); });
+    }
+
+public:
+    ~TraceLog()
+    {
+        running = false;
+        thread.join();
+    }
+
+    static TraceLog& instance()
+    {
+        static TraceLog log;
+        return log;
+    }
+
+    void push(Trace category, const char* format, uint16_t a, uint16_t b)
+    {
+        auto& r = ring();
+        auto h = r.head.load(std::memory_order_relaxed);
+        if (h - r.tail.load(std::memory_order_acquire) == size) {
+            r.dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        r.records[h & (size - 1)] = { format, a, b, category };
+        r.head.store(h + 1, std::memory_order_release);
+    }
+};
+
+// format is a printf format string taking up to two unsigned arguments
+template <Trace C>
+inline void trace(const char* format, uint16_t a = 0, uint16_t b = 0)
+{
+    if constexpr (tracing(C)) {
+        TraceLog::instance().push(C, format, a, b);
+    }
+}
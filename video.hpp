@@ -0,0 +1,325 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ppu.hpp"
+#include "tile.hpp"
+
+// Video output
+// The PPU makes palette indices with the emphasis bits on top (9 bits, see
+// Ppu::framebuffer). Turning them into colors is a lookup in a 512 entry
+// table, done on a thread of its own: the emulation thread copies a finished
+// frame into a triple buffer and moves on, and the video thread converts the
+// newest frame there and hands it to the sink. The emulation thread never
+// waits; if the sink is slow the frames it didn't get to are overwritten.
+
+// https://www.nesdev.org/wiki/PPU_palettes
+// The 2C02's 64 colors, as RGB
+inline constexpr uint8_t nesColors[64][3] = {
+    { 84, 84, 84 }, { 0, 30, 116 }, { 8, 16, 144 }, { 48, 0, 136 }, { 68, 0, 100 }, { 92, 0, 48 }, { 84, 4, 0 }, { 60, 24, 0 },
+    { 32, 42, 0 }, { 8, 58, 0 }, { 0, 64, 0 }, { 0, 60, 0 }, { 0, 50, 60 }, { 0, 0, 0 }, { 0, 0, 0 }, { 0, 0, 0 },
+    { 152, 150, 152 }, { 8, 76, 196 }, { 48, 50, 236 }, { 92, 30, 228 }, { 136, 20, 176 }, { 160, 20, 100 }, { 152, 34, 32 }, { 120, 60, 0 },
+    { 84, 90, 0 }, { 40, 114, 0 }, { 8, 124, 0 }, { 0, 118, 40 }, { 0, 102, 120 }, { 0, 0, 0 }, { 0, 0, 0 }, { 0, 0, 0 },
+    { 236, 238, 236 }, { 76, 154, 236 }, { 120, 124, 236 }, { 176, 98, 236 }, { 228, 84, 236 }, { 236, 88, 180 }, { 236, 106, 100 }, { 212, 136, 32 },
+    { 160, 170, 0 }, { 116, 196, 0 }, { 76, 208, 32 }, { 56, 204, 108 }, { 56, 180, 204 }, { 60, 60, 60 }, { 0, 0, 0 }, { 0, 0, 0 },
+    { 236, 238, 236 }, { 168, 204, 236 }, { 188, 188, 236 }, { 212, 178, 236 }, { 236, 174, 236 }, { 236, 174, 212 }, { 236, 180, 176 }, { 228, 196, 144 },
+    { 204, 210, 120 }, { 180, 222, 120 }, { 168, 226, 144 }, { 152, 226, 180 }, { 160, 214, 228 }, { 160, 162, 160 }, { 0, 0, 0 }, { 0, 0, 0 },
+};
+
+// https://www.nesdev.org/wiki/Colour_emphasis
+// Each emphasis bit (red, green, blue in bits 6-8 of a pixel) darkens the
+// other two components by about 18%
+inline constexpr std::array<uint8_t, 3> emphasized(int pixel)
+{
+    const auto* c = nesColors[pixel & 0x3f];
+    std::array<uint8_t, 3> rgb { c[0], c[1], c[2] };
+    for (int bit = 0; bit < 3; bit++) {
+        if (pixel >> (6 + bit) & 1) {
+            for (int channel = 0; channel < 3; channel++) {
+                if (channel != bit) {
+                    rgb[channel] = uint8_t(rgb[channel] * 0.816328f + 0.5f);
+                }
+            }
+        }
+    }
+    return rgb;
+}
+
+// RGBA8888, R in the first byte in memory (little endian host)
+inline constexpr auto rgbaPalette = [] {
+    std::array<uint32_t, 512> table {};
+    for (int i = 0; i < 512; i++) {
+        auto c = emphasized(i);
+        table[i] = 0xff000000 | c[2] << 16 | c[1] << 8 | c[0];
+    }
+    return table;
+}();
+
+// RGB565, held in 32 bits so the AVX2 kernel can gather them too
+inline constexpr auto rgb565Palette = [] {
+    std::array<uint32_t, 512> table {};
+    for (int i = 0; i < 512; i++) {
+        auto c = emphasized(i);
+        table[i] = (c[0] >> 3) << 11 | (c[1] >> 2) << 5 | c[2] >> 3;
+    }
+    return table;
+}();
+
+// The conversions are table lookups, which only AVX2's gathers do in SIMD
+// (SSE has nothing like them), picked when the CPU has it (see tile.hpp).
+// They do as many pixels as fit in whole registers and return how many, the
+// scalar loop does the rest.
+#if defined(NES_AVX2_KERNELS)
+__attribute__((target("avx2"))) inline size_t toRgba8888Avx2(const uint16_t* in, uint32_t* out, size_t count)
+{
+    // Widen 8 indices to 32 bits and gather their colors
+    size_t i = 0;
+    auto mask = _mm256_set1_epi32(0x1ff);
+    for (; i + 8 <= count; i += 8) {
+        auto index = _mm256_and_si256(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(in + i))), mask);
+        _mm256_storeu_si256((__m256i*)(out + i), _mm256_i32gather_epi32((const int*)rgbaPalette.data(), index, 4));
+    }
+    return i;
+}
+
+__attribute__((target("avx2"))) inline size_t toRgb565Avx2(const uint16_t* in, uint16_t* out, size_t count)
+{
+    // Two gathers of 8, packed back to 16 bits. The pack works on each 128
+    // bit half, so the middle quarters come out swapped.
+    size_t i = 0;
+    auto mask = _mm256_set1_epi32(0x1ff);
+    const auto* table = (const int*)rgb565Palette.data();
+    for (; i + 16 <= count; i += 16) {
+        auto lo = _mm256_and_si256(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(in + i))), mask);
+        auto hi = _mm256_and_si256(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(in + i + 8))), mask);
+        auto packed = _mm256_packus_epi32(_mm256_i32gather_epi32(table, lo, 4), _mm256_i32gather_epi32(table, hi, 4));
+        _mm256_storeu_si256((__m256i*)(out + i), _mm256_permute4x64_epi64(packed, 0xd8));
+    }
+    return i;
+}
+#endif
+
+// simd false always takes the scalar path (to check the kernels against it)
+inline void toRgba8888(const uint16_t* in, uint32_t* out, size_t count, bool simd = true)
+{
+    size_t i = 0;
+#if defined(NES_AVX2_KERNELS)
+    if (simd && hasAvx2()) {
+        i = toRgba8888Avx2(in, out, count);
+    }
+#endif
+    for (; i < count; i++) {
+        out[i] = rgbaPalette[in[i] & 0x1ff];
+    }
+}
+
+inline void toRgb565(const uint16_t* in, uint16_t* out, size_t count, bool simd = true)
+{
+    size_t i = 0;
+#if defined(NES_AVX2_KERNELS)
+    if (simd && hasAvx2()) {
+        i = toRgb565Avx2(in, out, count);
+    }
+#endif
+    for (; i < count; i++) {
+        out[i] = uint16_t(rgb565Palette[in[i] & 0x1ff]);
+    }
+}
+
+// Hands the newest of a stream of values from one thread to another without
+// either ever waiting. The producer fills one buffer, the consumer reads
+// another, and the third sits in the middle holding the last one published.
+template <typename T>
+class TripleBuffer {
+private:
+    std::vector<T> buffers = std::vector<T>(3);
+    std::atomic<uint8_t> middle = 1; // its index, and bit 2 set if the consumer hasn't seen it
+    uint8_t back = 0; // the producer's
+    uint8_t front = 2; // the consumer's
+
+public:
+    // Producer
+    T& writeBuffer() { return buffers[back]; }
+    // Returns false if the value published before was never seen (it is
+    // replaced)
+    bool publish()
+    {
+        auto old = middle.exchange(back | 4, std::memory_order_acq_rel);
+        back = old & 3;
+        return !(old & 4);
+    }
+
+    // Consumer. Takes the newest value if there is one it hasn't seen.
+    bool update()
+    {
+        if (!(middle.load(std::memory_order_relaxed) & 4)) {
+            return false;
+        }
+        front = middle.exchange(front, std::memory_order_acq_rel) & 3;
+        return true;
+    }
+    const T& readBuffer() const { return buffers[front]; }
+};
+
+// A converted frame, for the sink
+struct VideoFrame {
+    enum class Format {
+        Rgba8888,
+        Rgb565,
+    };
+
+    uint64_t number; // the PPU's frame count
+    Format format;
+    const void* pixels; // Ppu::width * Ppu::height, rows in order, no padding
+};
+
+// Where the frames end up (a display, an encoder). Called on the video
+// thread only.
+class VideoSink {
+public:
+    virtual ~VideoSink() = default;
+    virtual void write(const VideoFrame& frame) = 0;
+};
+
+class NullVideoSink : public VideoSink {
+public:
+    virtual void write(const VideoFrame&) override { }
+};
+
+// Raw frames into the standard input of a command that shows them in a
+// window on the host, like (for the default RGBA8888)
+//   ffplay -loglevel quiet -f rawvideo -pixel_format rgba -video_size 256x240 -framerate 60 -
+// or rgb565le for RGB565. A player that blocks when it's behind only costs
+// frames, the triple buffer replaces them. If it quits, the rest is thrown
+// away.
+class PipeVideoSink : public VideoSink {
+private:
+    FILE* pipe;
+
+public:
+    explicit PipeVideoSink(const std::string& command)
+        : pipe(popen(command.c_str(), "w"))
+    {
+        if (!pipe) {
+            std::fprintf(stderr, "%s: can't run\n", command.c_str());
+            return;
+        }
+        // A write to a player that quit fails instead of killing us
+        std::signal(SIGPIPE, SIG_IGN);
+    }
+
+    ~PipeVideoSink()
+    {
+        if (pipe) {
+            pclose(pipe);
+        }
+    }
+
+    bool ok() const { return pipe != nullptr; }
+
+    virtual void write(const VideoFrame& frame) override
+    {
+        size_t size = frame.format == VideoFrame::Format::Rgba8888 ? 4 : 2;
+        size_t count = Ppu::width * Ppu::height;
+        if (pipe && (std::fwrite(frame.pixels, size, count, pipe) < count || std::fflush(pipe))) {
+            pclose(pipe);
+            pipe = nullptr;
+        }
+    }
+};
+
+class VideoOutput {
+public:
+    struct Metrics {
+        uint64_t pushed; // frames the emulation thread handed over
+        uint64_t shown; // frames the sink got
+        uint64_t replaced; // frames overwritten before the sink got to them
+    };
+
+private:
+    struct Indexed {
+        uint64_t number = 0;
+        std::array<uint16_t, Ppu::width * Ppu::height> pixels;
+    };
+
+    std::unique_ptr<VideoSink> sink;
+    VideoFrame::Format format;
+    TripleBuffer<Indexed> frames;
+    std::atomic<uint64_t> pushed = 0;
+    std::atomic<uint64_t> shown = 0;
+    std::atomic<uint64_t> replaced = 0;
+    std::atomic<bool> running = true;
+    std::thread thread;
+
+    void show()
+    {
+        std::vector<uint32_t> rgba;
+        std::vector<uint16_t> rgb565;
+        for (;;) {
+            // Read running first: a frame pushed before it was cleared is
+            // published by then
+            bool last = !running;
+            if (!frames.update()) {
+                if (last) {
+                    break;
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                continue;
+            }
+            const auto& frame = frames.readBuffer();
+            const void* pixels;
+            if (format == VideoFrame::Format::Rgba8888) {
+                rgba.resize(frame.pixels.size());
+                toRgba8888(frame.pixels.data(), rgba.data(), rgba.size());
+                pixels = rgba.data();
+            } else {
+                rgb565.resize(frame.pixels.size());
+                toRgb565(frame.pixels.data(), rgb565.data(), rgb565.size());
+                pixels = rgb565.data();
+            }
+            sink->write({ frame.number, format, pixels });
+            shown++;
+        }
+    }
+
+public:
+    VideoOutput(std::unique_ptr<VideoSink> sink, VideoFrame::Format format = VideoFrame::Format::Rgba8888)
+        : sink(std::move(sink))
+        , format(format)
+    {
+        thread = std::thread([this] { show(); });
+    }
+
+    // Shows the last frame pushed, if it wasn't yet
+    ~VideoOutput()
+    {
+        running = false;
+        thread.join();
+    }
+
+    // A finished frame, from the emulation thread. Doesn't block.
+    void push(const Ppu& ppu)
+    {
+        auto& frame = frames.writeBuffer();
+        frame.number = ppu.frame;
+        frame.pixels = ppu.framebuffer;
+        pushed++;
+        if (!frames.publish()) {
+            replaced++;
+        }
+    }
+
+    Metrics metrics() const
+    {
+        return { pushed, shown, replaced };
+    }
+};